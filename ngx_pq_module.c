@@ -7,6 +7,12 @@
 #include <internal/libpq-int.h>
 #include <internal/pqexpbuffer.h>
 #include <libpq-fe.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 extern ngx_int_t ngx_http_push_stream_add_msg_to_channel_my(ngx_log_t *log, ngx_str_t *id, ngx_str_t *text, ngx_str_t *event_id, ngx_str_t *event_type, ngx_flag_t store_messages, ngx_pool_t *temp_pool) __attribute__((weak));
 extern ngx_int_t ngx_http_push_stream_delete_channel_my(ngx_log_t *log, ngx_str_t *id, u_char *text, size_t len, ngx_pool_t *temp_pool) __attribute__((weak));
@@ -40,14 +46,80 @@ enum {
 };
 
 enum {
+    ngx_pq_arrow_binary = 4,
+    ngx_pq_arrow_bool = 6,
+    ngx_pq_arrow_date = 8,
+    ngx_pq_arrow_fixed_size_binary = 15,
+    ngx_pq_arrow_floating_point = 3,
+    ngx_pq_arrow_int = 2,
+    ngx_pq_arrow_timestamp = 10,
+    ngx_pq_arrow_utf8 = 5,
+};
+
+enum {
+    ngx_pq_balance_least_queries = 1,
+};
+
+enum {
+    ngx_pq_breaker_closed = 0,
+    ngx_pq_breaker_half_open = 2,
+    ngx_pq_breaker_open = 1,
+};
+
+enum {
+    ngx_pq_role_primary = 1,
+    ngx_pq_role_standby = 2,
+};
+
+enum {
+    ngx_pq_route_read = 1,
+    ngx_pq_route_write = 2,
+};
+
+enum {
+    ngx_pq_pack_array,
+    ngx_pq_pack_bin,
+    ngx_pq_pack_str,
+};
+
+enum {
+    ngx_pq_output_arrow = 7,
     ngx_pq_output_binary = 4,
+    ngx_pq_output_cbor = 9,
     ngx_pq_output_csv = 2,
+    ngx_pq_output_json = 5,
+    ngx_pq_output_msgpack = 8,
+    ngx_pq_output_ndjson = 6,
     ngx_pq_output_none = 0,
     ngx_pq_output_plain = 3,
     ngx_pq_output_value = 1,
 };
 
+enum {
+    ngx_pq_oid_bool = 16,
+    ngx_pq_oid_bpchar = 1042,
+    ngx_pq_oid_bytea = 17,
+    ngx_pq_oid_char = 18,
+    ngx_pq_oid_date = 1082,
+    ngx_pq_oid_float4 = 700,
+    ngx_pq_oid_float8 = 701,
+    ngx_pq_oid_int2 = 21,
+    ngx_pq_oid_int4 = 23,
+    ngx_pq_oid_int8 = 20,
+    ngx_pq_oid_json = 114,
+    ngx_pq_oid_jsonb = 3802,
+    ngx_pq_oid_name = 19,
+    ngx_pq_oid_numeric = 1700,
+    ngx_pq_oid_oid = 26,
+    ngx_pq_oid_text = 25,
+    ngx_pq_oid_timestamp = 1114,
+    ngx_pq_oid_timestamptz = 1184,
+    ngx_pq_oid_uuid = 2950,
+    ngx_pq_oid_varchar = 1043,
+};
+
 typedef struct {
+    ngx_flag_t binary;
     struct {
         ngx_http_complex_value_t complex;
         Oid value;
@@ -64,32 +136,128 @@ typedef struct {
 } ngx_pq_command_t;
 
 typedef struct {
+    ngx_atomic_t checked;
+    ngx_atomic_t down;
+    ngx_atomic_t errors;
+    ngx_atomic_t fails;
+    ngx_atomic_t latency;
+    ngx_atomic_t opened;
+    ngx_atomic_t passes;
+    ngx_atomic_t probes;
+    ngx_atomic_t queries;
+    ngx_atomic_t requests;
+    ngx_atomic_t role;
+    ngx_atomic_t sampled;
+    ngx_atomic_t state;
+    ngx_atomic_t window;
+    uint64_t lsn;
+} ngx_pq_stat_t;
+
+typedef struct {
+    ngx_pq_stat_t **peers;
+    ngx_str_t conninfo;
+    ngx_uint_t role;
+    ngx_uint_t stat;
+    socklen_t socklen;
+    struct sockaddr *sockaddr;
+} ngx_pq_conninfo_t;
+
+typedef struct {
+    ngx_array_t conninfos;
     ngx_array_t options;
     ngx_msec_t timeout;
+    ngx_str_t conninfo;
+    ngx_uint_t statements;
     PGContextVisibility show_context;
     PGVerbosity errors;
 } ngx_pq_connect_t;
 
+typedef struct {
+    ngx_rbtree_node_t sentinel;
+    ngx_rbtree_t rbtree;
+    ngx_queue_t queue;
+    ngx_uint_t generation;
+} ngx_pq_cache_sh_t;
+
+typedef struct {
+    ngx_pq_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_str_t channel;
+} ngx_pq_cache_zone_t;
+
+typedef struct {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    ngx_uint_t generation;
+    ngx_uint_t status;
+    size_t len;
+    time_t expire;
+    u_char key[16];
+    u_char data[1];
+} ngx_pq_cache_node_t;
+
+typedef struct {
+    ngx_array_t caches;
+    ngx_array_t prefixes;
+    ngx_array_t variables;
+    struct {
+        ngx_rbtree_node_t sentinel;
+        ngx_rbtree_t rbtree;
+    } coalesce;
+} ngx_pq_main_conf_t;
+
 typedef struct {
     ngx_array_t queries;
     ngx_http_complex_value_t complex;
     ngx_http_upstream_conf_t upstream;
     ngx_pq_connect_t connect;
+    ngx_flag_t coalesce;
+    ngx_flag_t copy_in;
+    ngx_flag_t lsn;
     ngx_uint_t empty;
+    struct {
+        ngx_http_complex_value_t *lsn;
+        ngx_uint_t type;
+    } route;
+    struct {
+        ngx_shm_zone_t *zone;
+        time_t ttl;
+    } cache;
 } ngx_pq_loc_conf_t;
 
+typedef struct {
+    size_t pos;
+    u_char *start;
+} ngx_pq_fb_t;
+
+typedef struct {
+    size_t size;
+    uint64_t value;
+    size_t pos;
+} ngx_pq_fb_slot_t;
+
 typedef struct {
     ngx_array_t arguments;
     ngx_array_t commands;
+    ngx_flag_t binary;
+    ngx_flag_t copy;
     ngx_flag_t header;
+    ngx_flag_t prefix;
     ngx_flag_t string;
+#ifdef LIBPQ_HAS_PIPELINING
+    ngx_flag_t cache;
+#endif
 #ifdef LIBPQ_HAS_CHUNK_MODE
     ngx_int_t chunkSize;
 #endif
+    int resultFormat;
     ngx_int_t index;
     ngx_str_t null;
+    ngx_str_t sql;
     ngx_uint_t output;
+    ngx_uint_t slot;
     ngx_uint_t type;
+    size_t size;
     u_char delimiter;
     u_char escape;
     u_char quote;
@@ -111,12 +279,72 @@ typedef struct {
     ngx_log_t *log;
     ngx_pq_connect_t connect;
     size_t buffer_size;
+    struct {
+        ngx_uint_t method;
+        ngx_uint_t next;
+    } balance;
+    struct {
+        ngx_msec_t latency;
+        ngx_msec_t open;
+        ngx_msec_t window;
+        ngx_uint_t errors;
+        ngx_uint_t min;
+        ngx_uint_t probes;
+        ngx_uint_t status;
+    } breaker;
+    struct {
+        ngx_event_t timer;
+        ngx_msec_t interval;
+        ngx_str_t query;
+        ngx_uint_t fails;
+        ngx_uint_t passes;
+    } health;
+    struct {
+        ngx_msec_t idle_timeout;
+        ngx_queue_t queue;
+        ngx_uint_t max;
+    } multiplex;
+    struct {
+        ngx_event_t event;
+        ngx_event_t timer;
+        ngx_http_upstream_srv_conf_t *upstream;
+        ngx_msec_t idle_timeout;
+        ngx_msec_t lifetime;
+        ngx_msec_t lsn_interval;
+        ngx_msec_t timeout;
+        ngx_queue_t free;
+        ngx_queue_t waiters;
+        ngx_uint_t count;
+        ngx_uint_t idle;
+        ngx_uint_t max;
+        ngx_uint_t min;
+        ngx_uint_t next;
+        ngx_uint_t queue;
+        ngx_uint_t waiting;
+    } pool;
+    struct {
+        ngx_pq_stat_t *peers;
+        ngx_shm_zone_t *zone;
+        ngx_uint_t number;
+        uint32_t hash;
+    } stat;
 } ngx_pq_srv_conf_t;
 
+typedef struct {
+    int nParams;
+    ngx_flag_t prepared;
+    ngx_queue_t queue;
+    ngx_str_t sql;
+    Oid *paramTypes;
+    uint32_t hash;
+    u_char name[sizeof("ngx_pq_ffffffff_") + NGX_INT_T_LEN];
+} ngx_pq_statement_t;
+
 typedef struct {
     const char **paramValues;
     ngx_flag_t not_first;
     ngx_pq_query_t *query;
+    ngx_pq_statement_t *statement;
     ngx_queue_t queue;
     Oid *paramTypes;
 } ngx_pq_query_queue_t;
@@ -127,37 +355,65 @@ typedef struct {
 } ngx_pq_channel_queue_t;
 
 typedef struct {
-    ngx_str_t column_name;
-    ngx_str_t constraint_name;
-    ngx_str_t context;
-    ngx_str_t datatype_name;
-    ngx_str_t internal_position;
-    ngx_str_t internal_query;
-    ngx_str_t message_detail;
-    ngx_str_t message_hint;
-    ngx_str_t message_primary;
-    ngx_str_t schema_name;
-    ngx_str_t severity;
-    ngx_str_t severity_nonlocalized;
-    ngx_str_t source_file;
-    ngx_str_t source_function;
-    ngx_str_t source_line;
-    ngx_str_t sqlstate;
-    ngx_str_t statement_position;
-    ngx_str_t table_name;
-} ngx_pq_error_t;
+    ngx_str_t value;
+    size_t size;
+    u_char *buffer;
+} ngx_pq_variable_t;
+
+typedef struct {
+    ngx_pool_t *pool;
+    ngx_pq_variable_t *variables;
+    ngx_uint_t count;
+    ngx_uint_t nelts;
+} ngx_pq_variables_t;
 
 typedef struct {
     int inBufSize;
-    ngx_array_t variables;
+    ngx_pq_conninfo_t *conninfo;
+    ngx_pq_variables_t *variables;
     ngx_connection_t *connection;
     ngx_event_handler_pt read;
     ngx_event_handler_pt write;
     ngx_flag_t keepalive;
+    ngx_int_t rc;
     ngx_msec_t timeout;
     ngx_queue_t queue;
     ngx_uint_t count;
     PGconn *conn;
+    struct {
+        ngx_queue_t deallocate;
+        ngx_queue_t queue;
+        ngx_uint_t count;
+        ngx_uint_t max;
+        ngx_uint_t sequence;
+    } statements;
+    struct {
+        ngx_flag_t failed;
+        ngx_flag_t sent;
+        ngx_pq_srv_conf_t *pscf;
+        ngx_pq_stat_t *stat;
+    } health;
+    struct {
+        ngx_flag_t init;
+        ngx_flag_t ready;
+        ngx_flag_t retire;
+        ngx_pq_srv_conf_t *pscf;
+        ngx_queue_t free;
+        ngx_queue_t queue;
+        ngx_queue_t requests;
+        ngx_queue_t slots;
+        ngx_uint_t count;
+    } multiplex;
+    struct {
+        ngx_flag_t idle;
+        ngx_flag_t prewarm;
+        ngx_flag_t ready;
+        ngx_flag_t sample;
+        ngx_msec_t start;
+        ngx_msec_t used;
+        ngx_pq_srv_conf_t *pscf;
+        ngx_queue_t queue;
+    } pool;
 } ngx_pq_save_t;
 
 #ifdef LIBPQ_HAS_ASYNC_CANCEL
@@ -168,21 +424,75 @@ typedef struct {
 #endif
 
 typedef struct {
-    ngx_array_t variables;
+    ngx_pq_variables_t *variables;
     ngx_flag_t empty;
     ngx_http_request_t *request;
     ngx_int_t row;
     ngx_peer_connection_t peer;
-    ngx_pq_error_t error;
     ngx_pq_save_t *save;
     ngx_queue_t queue;
     ngx_uint_t type;
+    PGresult **prefix;
+    struct {
+        ngx_msec_t end;
+        ngx_flag_t sent;
+        ngx_msec_t start;
+        ngx_pq_stat_t *stat;
+    } balance;
+    struct {
+        ngx_atomic_uint_t start;
+        ngx_flag_t probe;
+        ngx_pq_srv_conf_t *pscf;
+        ngx_pq_stat_t *stat;
+        ngx_str_t *name;
+    } breaker;
+    struct {
+        ngx_pool_cleanup_t *cln;
+        PGresult *res;
+    } error;
+    struct {
+        ngx_flag_t on;
+        ngx_uint_t generation;
+        u_char key[16];
+    } cache;
+    struct {
+        ngx_flag_t on;
+        ngx_http_request_t *leader;
+        ngx_queue_t queue;
+        ngx_queue_t waiters;
+        ngx_str_node_t node;
+    } coalesce;
+    struct {
+        ngx_flag_t sent;
+        ngx_str_t value;
+    } lsn;
+    struct {
+        ngx_chain_t *in;
+        ngx_flag_t started;
+        ngx_uint_t next;
+        ngx_uint_t type;
+        u_char *buffer;
+    } copy;
+    struct {
+        ngx_flag_t done;
+        ngx_flag_t on;
+        ngx_flag_t sent;
+        ngx_int_t rc;
+        ngx_queue_t queue;
+    } multiplex;
+    struct {
+        ngx_connection_t *connection;
+        ngx_event_t event;
+        ngx_pq_srv_conf_t *pscf;
+        ngx_queue_t queue;
+    } pool;
 } ngx_pq_data_t;
 
 typedef struct {
-    ngx_chain_t *cl;
-    ngx_int_t index;
-} ngx_pq_variable_t;
+    ngx_flag_t init;
+    ngx_pq_data_t *data;
+    ngx_queue_t queue;
+} ngx_pq_slot_t;
 
 static u_char *ngx_pq_log_error_handler(ngx_log_t *log, u_char *buf, size_t len) {
     u_char *p = buf;
@@ -203,70 +513,377 @@ static u_char *ngx_pq_log_error_handler(ngx_log_t *log, u_char *buf, size_t len)
     return buf;
 }
 
-static ngx_int_t ngx_pq_output(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_pq_query_t *query, const u_char *data, size_t len) {
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%*s", (int)len, data);
+static void ngx_pq_variables_cleanup_handler(void *data) {
+    ngx_pq_variables_t *variables = data;
+    for (ngx_uint_t i = 0; i < variables->nelts; i++) if (variables->variables[i].buffer) ngx_free(variables->variables[i].buffer);
+}
+static ngx_pq_variables_t *ngx_pq_variables_create(ngx_log_t *log) {
+    ngx_pq_main_conf_t *pmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_pq_module);
+    ngx_pool_t *pool;
+    if (!(pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log))) { ngx_log_error(NGX_LOG_ERR, log, 0, "!ngx_create_pool"); return NULL; }
+    ngx_pq_variables_t *variables;
+    if (!(variables = ngx_pcalloc(pool, sizeof(*variables) + pmcf->variables.nelts * sizeof(*variables->variables)))) { ngx_log_error(NGX_LOG_ERR, log, 0, "!ngx_pcalloc"); goto destroy; }
+    variables->variables = (ngx_pq_variable_t *)(variables + 1);
+    variables->nelts = pmcf->variables.nelts;
+    variables->pool = pool;
+    variables->count = 1;
+    ngx_pool_cleanup_t *cln;
+    if (!(cln = ngx_pool_cleanup_add(pool, 0))) { ngx_log_error(NGX_LOG_ERR, log, 0, "!ngx_pool_cleanup_add"); goto destroy; }
+    cln->handler = ngx_pq_variables_cleanup_handler;
+    cln->data = variables;
+    return variables;
+destroy:
+    ngx_destroy_pool(pool);
+    return NULL;
+}
+static void ngx_pq_variables_release(void *data) {
+    ngx_pq_variables_t *variables = data;
+    if (--variables->count) return;
+    ngx_destroy_pool(variables->pool);
+}
+static void ngx_pq_variables_reset(ngx_pq_save_t *s) {
+    if (!s->variables) return;
+    if (s->variables->count > 1) {
+        ngx_pq_variables_release(s->variables);
+        s->variables = NULL;
+        return;
+    }
+    for (ngx_uint_t i = 0; i < s->variables->nelts; i++) ngx_str_null(&s->variables->variables[i].value);
+}
+static ngx_int_t ngx_pq_output_reserve(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_pq_query_t *query, size_t len, u_char **data) {
+    *data = NULL;
     if (!len) return NGX_OK;
     if (!d) return NGX_OK;
     ngx_http_request_t *r = d->request;
     if (query->index) {
-        ngx_array_t *variables;
-        ngx_connection_t *c;
-        if (query->type & ngx_pq_type_upstream) {
-            c = s->connection;
-            variables = &s->variables;
-        } else if (query->type & ngx_pq_type_location) {
-            c = r->connection;
-            variables = &d->variables;
-        } else return NGX_OK;
-        ngx_pq_variable_t *variable = variables->elts;
-        ngx_uint_t i;
-        for (i = 0; i < variables->nelts; i++) if (variable[i].index == query->index) break;
-        ngx_chain_t *cl;
-        if (i == variables->nelts) {
-            if (!variables->elts && ngx_array_init(&s->variables, c->pool, 1, sizeof(*variable)) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_array_init != NGX_OK"); return NGX_ERROR; }
-            if (!(variable = ngx_array_push(&s->variables))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_array_push"); return NGX_ERROR; }
-            ngx_memzero(variable, sizeof(*variable));
-            variable->index = query->index;
-            if (!(cl = variable->cl = ngx_alloc_chain_link(c->pool))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_alloc_chain_link"); return NGX_ERROR; }
-        } else {
-            variable = &variable[i];
-            cl = variable->cl;
-            if (!(cl = cl->next = ngx_alloc_chain_link(c->pool))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_alloc_chain_link"); return NGX_ERROR; }
+        if (!(query->type & ngx_pq_type_upstream)) return NGX_OK;
+        ngx_connection_t *c = s->connection;
+        if (!s->variables && !(s->variables = ngx_pq_variables_create(c->log))) return NGX_ERROR;
+        if (query->slot >= s->variables->nelts) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "query->slot >= s->variables->nelts"); return NGX_ERROR; }
+        ngx_pq_variable_t *variable = &s->variables->variables[query->slot];
+        /* buffers live on heap and not in variables pool, because ngx_pfree returns only large allocations and regrown ones would stay until connection is closed */
+        if (variable->value.len + len > variable->size) {
+            size_t size = ngx_max(2 * variable->size, variable->value.len + len);
+            u_char *p;
+            if (!(p = ngx_alloc(size, c->log))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_alloc"); return NGX_ERROR; }
+            if (variable->buffer) {
+                ngx_memcpy(p, variable->buffer, variable->value.len);
+                ngx_free(variable->buffer);
+            }
+            variable->buffer = p;
+            variable->size = size;
         }
-        cl->next = NULL;
-        if (!(cl->buf = ngx_create_temp_buf(c->pool, len))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_create_temp_buf"); return NGX_ERROR; }
-        cl->buf->last = ngx_copy(cl->buf->last, data, len);
+        variable->value.data = variable->buffer;
+        *data = variable->value.data + variable->value.len;
+        variable->value.len += len;
     } else if (query->output) {
         ngx_connection_t *c = r->connection;
         ngx_http_upstream_t *u = r->upstream;
-        ngx_chain_t *cl, **ll;
-        for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) ll = &cl->next;
+        ngx_chain_t *cl, *last = NULL, **ll;
+        for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) { last = cl; ll = &cl->next; }
+        if (last && last->buf->tag == u->output.tag && (size_t)(last->buf->end - last->buf->last) >= len) {
+            *data = last->buf->last;
+            last->buf->last += len;
+            return NGX_OK;
+        }
+        ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+        size_t size = ngx_max(len, plcf->upstream.buffer_size);
         if (!(cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_chain_get_free_buf"); return NGX_ERROR; }
         *ll = cl;
         ngx_buf_t *b = cl->buf;
-        if (b->start) ngx_pfree(r->pool, b->start);
-        if (!(b->start = ngx_palloc(r->pool, len))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_palloc"); return NGX_ERROR; }
-        b->end = b->start + len;
+        if (!b->start || (size_t)(b->end - b->start) < size) {
+            if (b->start) ngx_pfree(r->pool, b->start);
+            if (!(b->start = ngx_palloc(r->pool, size))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_palloc"); return NGX_ERROR; }
+            b->end = b->start + size;
+        }
         b->flush = 1;
-        b->last = ngx_copy(b->start, data, len);
         b->memory = 1;
         b->pos = b->start;
+        b->last = b->start + len;
         b->tag = u->output.tag;
         b->temporary = 1;
+        *data = b->pos;
     }
     return NGX_OK;
 }
-
-static ngx_int_t ngx_pq_copy_error(ngx_pq_data_t *d, PGresult *res, int fieldcode, ngx_uint_t offset) {
+static ngx_int_t ngx_pq_output(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_pq_query_t *query, const u_char *data, size_t len) {
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%*s", (int)len, data);
+    u_char *p;
+    if (ngx_pq_output_reserve(s, d, query, len, &p) != NGX_OK) return NGX_ERROR;
+    if (p) ngx_memcpy(p, data, len);
+    return NGX_OK;
+}
+static void ngx_pq_result_cleanup_handler(void *data) {
+    PQclear(data);
+}
+static ngx_int_t ngx_pq_output_result(ngx_pq_data_t *d, PGresult *res, u_char *data, size_t len) {
     ngx_http_request_t *r = d->request;
-    char *err;
-    if (!(err = PQresultErrorField(res, fieldcode))) return NGX_OK;
-    ngx_str_t str = {ngx_strlen(err), (u_char *)err};
-    ngx_str_t *error = (ngx_str_t *)((u_char *)&d->error + offset);
-    if (!(error->data = ngx_pstrdup(r->pool, &str))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pstrdup"); return NGX_ERROR; }
-    error->len = str.len;
+    ngx_connection_t *c = r->connection;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_pool_cleanup_t *cln;
+    if (!(cln = ngx_pool_cleanup_add(r->pool, 0))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pool_cleanup_add"); return NGX_ERROR; }
+    ngx_chain_t *cl, **ll;
+    if (!(cl = ngx_alloc_chain_link(r->pool))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_alloc_chain_link"); return NGX_ERROR; }
+    ngx_buf_t *b;
+    if (!(b = cl->buf = ngx_calloc_buf(r->pool))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_calloc_buf"); return NGX_ERROR; }
+    cl->next = NULL;
+    b->flush = 1;
+    b->memory = 1;
+    b->pos = b->start = data;
+    b->last = b->end = data + len;
+    b->tag = (ngx_buf_tag_t)&ngx_pq_module;
+    for (ll = &u->out_bufs; *ll; ll = &(*ll)->next);
+    *ll = cl;
+    cln->handler = ngx_pq_result_cleanup_handler;
+    cln->data = res;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "hold %uz bytes", len);
     return NGX_OK;
 }
+static void ngx_pq_prefix_cleanup_handler(void *data) {
+    ngx_pq_data_t *d = data;
+    ngx_pq_main_conf_t *pmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_pq_module);
+    for (ngx_uint_t i = 0; i < pmcf->prefixes.nelts; i++) if (d->prefix[i]) { PQclear(d->prefix[i]); d->prefix[i] = NULL; }
+}
+static ngx_int_t ngx_pq_res_prefix(ngx_pq_data_t *d, ngx_pq_query_t *query, PGresult **hold) {
+    ngx_http_request_t *r = d->request;
+    ngx_connection_t *c = r->connection;
+    if (!d->prefix) {
+        ngx_pq_main_conf_t *pmcf = ngx_http_get_module_main_conf(r, ngx_pq_module);
+        ngx_pool_cleanup_t *cln;
+        if (!(cln = ngx_pool_cleanup_add(r->pool, 0))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pool_cleanup_add"); return NGX_ERROR; }
+        if (!(d->prefix = ngx_pcalloc(r->pool, pmcf->prefixes.nelts * sizeof(*d->prefix)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+        cln->handler = ngx_pq_prefix_cleanup_handler;
+        cln->data = d;
+    }
+    PGresult *res = d->prefix[query->slot];
+    if (res && PQntuples(res)) return NGX_OK;
+    if (res) PQclear(res);
+    d->prefix[query->slot] = *hold;
+    *hold = NULL;
+    return NGX_OK;
+}
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2"))) static size_t ngx_pq_quote_count_avx2(const u_char **data, const u_char *e, u_char quote) {
+    const u_char *p = *data;
+    size_t count = 0;
+    __m256i q = _mm256_set1_epi8(quote), zero = _mm256_setzero_si256();
+    while (e - p >= 32) {
+        __m256i acc = zero;
+        for (ngx_uint_t i = 0; i < 255 && e - p >= 32; i++, p += 32) acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), q));
+        acc = _mm256_sad_epu8(acc, zero);
+        __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        count += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+    }
+    *data = p;
+    return count;
+}
+#endif
+static size_t ngx_pq_quote_count(const u_char *data, size_t len, u_char quote) {
+    const u_char *e = data + len;
+    if (!(data = memchr(data, quote, len))) return 0;
+    size_t count = 1;
+    data++;
+#if defined(__x86_64__) && defined(__GNUC__)
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (avx2) count += ngx_pq_quote_count_avx2(&data, e, quote);
+#endif
+#ifdef __SSE2__
+    __m128i q = _mm_set1_epi8(quote), zero = _mm_setzero_si128();
+    while (e - data >= 16) {
+        __m128i acc = zero;
+        for (ngx_uint_t i = 0; i < 255 && e - data >= 16; i++, data += 16) acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data), q));
+        acc = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+    }
+#endif
+    for (; data < e; data++) count += *data == quote;
+    return count;
+}
+static size_t ngx_pq_value_size(ngx_pq_query_t *query, const u_char *data, size_t len) {
+    if (!query->string || !query->quote) return len;
+    size_t size = len + 2 * sizeof(query->quote);
+    if (query->escape) size += ngx_pq_quote_count(data, len, query->quote) * sizeof(query->escape);
+    return size;
+}
+static u_char *ngx_pq_value_copy(u_char *p, ngx_pq_query_t *query, const u_char *data, size_t len) {
+    if (!query->string || !query->quote) return ngx_copy(p, data, len);
+    const u_char *e = data + len;
+    *p++ = query->quote;
+    if (query->escape) for (const u_char *q; (q = memchr(data, query->quote, e - data)); data = q + 1) {
+        p = ngx_copy(p, data, q - data);
+        *p++ = query->escape;
+        *p++ = query->quote;
+    }
+    p = ngx_copy(p, data, e - data);
+    *p++ = query->quote;
+    return p;
+}
+static const u_char *ngx_pq_json_special(const u_char *data, const u_char *e) {
+#ifdef __SSE2__
+    __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1f);
+    for (; e - data >= 16; data += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)data);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)), _mm_cmpeq_epi8(_mm_min_epu8(x, control), x)));
+        if (mask) return data + __builtin_ctz(mask);
+    }
+#endif
+    for (; data < e; data++) if (*data == '"' || *data == '\\' || *data < 0x20) return data;
+    return e;
+}
+static size_t ngx_pq_json_string_size(const u_char *data, size_t len) {
+    const u_char *e = data + len;
+    size_t size = len + 2;
+    for (; (data = ngx_pq_json_special(data, e)) < e; data++) switch (*data) {
+        case '"': case '\\': case '\b': case '\f': case '\n': case '\r': case '\t': size += 1; break;
+        default: size += 5; break;
+    }
+    return size;
+}
+static u_char *ngx_pq_json_string_copy(u_char *p, const u_char *data, size_t len) {
+    static const u_char hex[] = "0123456789abcdef";
+    const u_char *e = data + len;
+    *p++ = '"';
+    for (const u_char *q; (q = ngx_pq_json_special(data, e)) < e; data = q + 1) {
+        p = ngx_copy(p, data, q - data);
+        *p++ = '\\';
+        switch (*q) {
+            case '"': *p++ = '"'; break;
+            case '\\': *p++ = '\\'; break;
+            case '\b': *p++ = 'b'; break;
+            case '\f': *p++ = 'f'; break;
+            case '\n': *p++ = 'n'; break;
+            case '\r': *p++ = 'r'; break;
+            case '\t': *p++ = 't'; break;
+            default: *p++ = 'u'; *p++ = '0'; *p++ = '0'; *p++ = hex[*q >> 4]; *p++ = hex[*q & 0xf]; break;
+        }
+    }
+    p = ngx_copy(p, data, e - data);
+    *p++ = '"';
+    return p;
+}
+static size_t ngx_pq_json_value_size(Oid oid, const u_char *data, size_t len) {
+    switch (oid) {
+        case ngx_pq_oid_bool: return *data == 't' ? sizeof("true") - 1 : sizeof("false") - 1;
+        case ngx_pq_oid_int2: case ngx_pq_oid_int4: case ngx_pq_oid_int8: case ngx_pq_oid_oid: case ngx_pq_oid_json: case ngx_pq_oid_jsonb: return len;
+        case ngx_pq_oid_float4: case ngx_pq_oid_float8: case ngx_pq_oid_numeric: if (len && data[len - 1] >= '0' && data[len - 1] <= '9') return len; break;
+        default: break;
+    }
+    return ngx_pq_json_string_size(data, len);
+}
+static u_char *ngx_pq_json_value_copy(u_char *p, Oid oid, const u_char *data, size_t len) {
+    switch (oid) {
+        case ngx_pq_oid_bool: return *data == 't' ? ngx_copy(p, "true", sizeof("true") - 1) : ngx_copy(p, "false", sizeof("false") - 1);
+        case ngx_pq_oid_int2: case ngx_pq_oid_int4: case ngx_pq_oid_int8: case ngx_pq_oid_oid: case ngx_pq_oid_json: case ngx_pq_oid_jsonb: return ngx_copy(p, data, len);
+        case ngx_pq_oid_float4: case ngx_pq_oid_float8: case ngx_pq_oid_numeric: if (len && data[len - 1] >= '0' && data[len - 1] <= '9') return ngx_copy(p, data, len); break;
+        default: break;
+    }
+    return ngx_pq_json_string_copy(p, data, len);
+}
+
+static ngx_pq_slot_t *ngx_pq_multiplex_slot(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_flag_t init) {
+    ngx_connection_t *c = s->connection;
+    ngx_pq_slot_t *slot;
+    if (!ngx_queue_empty(&s->multiplex.free)) {
+        ngx_queue_t *q = ngx_queue_head(&s->multiplex.free);
+        ngx_queue_remove(q);
+        slot = ngx_queue_data(q, ngx_pq_slot_t, queue);
+    } else if (!(slot = ngx_palloc(c->pool, sizeof(*slot)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_palloc"); return NULL; }
+    slot->data = d;
+    slot->init = init;
+    ngx_queue_insert_tail(&s->multiplex.slots, &slot->queue);
+    return slot;
+}
+static void ngx_pq_statement_free(ngx_pq_save_t *s, ngx_pq_statement_t *statement) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "statement = %s", statement->name);
+    ngx_queue_remove(&statement->queue);
+    s->statements.count--;
+    ngx_free(statement);
+}
+/* called only when the server has no prepared statements left, after DEALLOCATE ALL or DISCARD ALL or on close, so pending DEALLOCATEs are dropped unsent */
+static void ngx_pq_statement_reset(ngx_pq_save_t *s) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%s", __func__);
+    for (ngx_queue_t *q = ngx_queue_head(&s->statements.queue), *_; q != ngx_queue_sentinel(&s->statements.queue) && (_ = ngx_queue_next(q)); q = _) {
+        ngx_pq_statement_t *statement = ngx_queue_data(q, ngx_pq_statement_t, queue);
+        if (statement->prepared) ngx_pq_statement_free(s, statement);
+    }
+    while (!ngx_queue_empty(&s->statements.deallocate)) {
+        ngx_queue_t *q = ngx_queue_head(&s->statements.deallocate);
+        ngx_queue_remove(q);
+        ngx_free(ngx_queue_data(q, ngx_pq_statement_t, queue));
+    }
+}
+#ifdef LIBPQ_HAS_PIPELINING
+static ngx_pq_statement_t *ngx_pq_statement_get(ngx_pq_save_t *s, const char *sql, int nParams, const Oid *paramTypes, ngx_flag_t *prepare) {
+    ngx_connection_t *c = s->connection;
+    ngx_pq_statement_t *statement;
+    size_t len = ngx_strlen(sql), size = nParams * sizeof(Oid);
+    uint32_t hash;
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *)paramTypes, size);
+    ngx_crc32_update(&hash, (u_char *)sql, len);
+    ngx_crc32_final(hash);
+    *prepare = 0;
+    for (ngx_queue_t *q = ngx_queue_head(&s->statements.queue); q != ngx_queue_sentinel(&s->statements.queue); q = ngx_queue_next(q)) {
+        statement = ngx_queue_data(q, ngx_pq_statement_t, queue);
+        if (statement->hash != hash || statement->nParams != nParams || statement->sql.len != len || ngx_memcmp(statement->paramTypes, paramTypes, size) || ngx_memcmp(statement->sql.data, sql, len)) continue;
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&s->statements.queue, q);
+        return statement;
+    }
+    if (!s->statements.max) return NULL;
+    if (s->statements.count >= s->statements.max) {
+        ngx_queue_t *q = ngx_queue_last(&s->statements.queue);
+        statement = ngx_queue_data(q, ngx_pq_statement_t, queue);
+        if (!statement->prepared) return NULL;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "evict %s", statement->name);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&s->statements.deallocate, q);
+        s->statements.count--;
+    }
+    if (!(statement = ngx_alloc(sizeof(*statement) + size + len, c->log))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_alloc"); return NULL; }
+    statement->hash = hash;
+    statement->nParams = nParams;
+    statement->prepared = 0;
+    statement->paramTypes = (Oid *)(statement + 1);
+    ngx_memcpy(statement->paramTypes, paramTypes, size);
+    statement->sql.data = (u_char *)statement->paramTypes + size;
+    statement->sql.len = len;
+    ngx_memcpy(statement->sql.data, sql, len);
+    (void)ngx_sprintf(statement->name, "ngx_pq_%08xD_%ui%Z", hash, ++s->statements.sequence);
+    ngx_queue_insert_head(&s->statements.queue, &statement->queue);
+    s->statements.count++;
+    *prepare = 1;
+    return statement;
+}
+static ngx_int_t ngx_pq_statement_deallocate(ngx_pq_save_t *s) {
+    ngx_connection_t *c = s->connection;
+    ngx_int_t rc = NGX_OK;
+    PQExpBufferData sql;
+    initPQExpBuffer(&sql);
+    if (s->multiplex.pscf && !ngx_pq_multiplex_slot(s, NULL, 0)) { rc = NGX_ERROR; goto term; }
+    while (!ngx_queue_empty(&s->statements.deallocate)) {
+        ngx_queue_t *q = ngx_queue_head(&s->statements.deallocate);
+        ngx_queue_remove(q);
+        ngx_pq_statement_t *statement = ngx_queue_data(q, ngx_pq_statement_t, queue);
+        resetPQExpBuffer(&sql);
+        appendPQExpBuffer(&sql, "DEALLOCATE %s", statement->name);
+        ngx_free(statement);
+        if (PQExpBufferDataBroken(sql)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "PQExpBufferDataBroken"); rc = NGX_ERROR; goto term; }
+        if (!PQsendQueryParams(s->conn, sql.data, 0, NULL, NULL, NULL, NULL, 0)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryParams"); rc = NGX_DECLINED; goto term; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryParams('%s')", sql.data);
+        if (!s->multiplex.pscf) s->count++;
+    }
+    if (!PQpipelineSync(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQpipelineSync"); rc = NGX_DECLINED; goto term; }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQpipelineSync");
+term:
+    termPQExpBuffer(&sql);
+    return rc;
+}
+#endif
 
 static ngx_int_t ngx_pq_res_command_ok(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult *res) {
     char *value;
@@ -276,12 +893,16 @@ static ngx_int_t ngx_pq_res_command_ok(ngx_pq_save_t *s, ngx_pq_data_t *d, PGres
     else { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", PQresStatus(PQresultStatus(res))); }
     if (s->count) { s->count--; return NGX_OK; }
     if (!d) return NGX_OK;
+    /* DEALLOCATE of a single statement keeps the others on the server, so they stay cached and evicted ones are still deallocated */
+    if (len == sizeof("DEALLOCATE ALL") - 1 && !ngx_strncasecmp((u_char *)value, (u_char *)"DEALLOCATE ALL", sizeof("DEALLOCATE ALL") - 1)) ngx_pq_statement_reset(s);
+    else if (len == sizeof("DISCARD ALL") - 1 && !ngx_strncasecmp((u_char *)value, (u_char *)"DISCARD ALL", sizeof("DISCARD ALL") - 1)) ngx_pq_statement_reset(s);
     if (ngx_queue_empty(&d->queue)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_queue_empty"); return NGX_ERROR; }
     ngx_queue_t *q = ngx_queue_head(&d->queue);
     ngx_queue_remove(q);
     ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
     ngx_pq_query_t *query = qq->query;
     d->type = query->type;
+    if (qq->statement) { qq->statement->prepared = 1; return NGX_OK; }
     if (ngx_http_push_stream_delete_channel_my && query->commands.nelts == 2 && len == sizeof("LISTEN") - 1 && !ngx_strncasecmp((u_char *)value, (u_char *)"LISTEN", sizeof("LISTEN") - 1)) {
         ngx_pq_command_t *command = query->commands.elts;
         command = &command[1];
@@ -297,26 +918,94 @@ static ngx_int_t ngx_pq_res_command_ok(ngx_pq_save_t *s, ngx_pq_data_t *d, PGres
 }
 static ngx_int_t ngx_pq_res_copy_out(ngx_pq_save_t *s, ngx_pq_data_t *d) {
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_COPY_OUT");
-    char *buffer = NULL;
-    int len;
-    ngx_int_t rc = NGX_OK;
-    switch ((len = PQgetCopyData(s->conn, &buffer, 0))) {
-        case 0: break;
-        case -1: break;
-        case -2: ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "PQgetCopyData == -2"); rc = NGX_HTTP_BAD_GATEWAY; break;
-        default:
-            if (!d) break;
-            if (ngx_queue_empty(&d->queue)) break;
-            ngx_queue_t *q = ngx_queue_head(&d->queue);
-            ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
-            ngx_pq_query_t *query = qq->query;
-            d->type = query->type;
+    ngx_pq_query_t *query = NULL;
+    if (d && !ngx_queue_empty(&d->queue)) {
+        ngx_pq_query_queue_t *qq = ngx_queue_data(ngx_queue_head(&d->queue), ngx_pq_query_queue_t, queue);
+        query = qq->query;
+        d->type = query->type;
+    }
+    for (;;) {
+        char *buffer = NULL;
+        int len;
+        switch ((len = PQgetCopyData(s->conn, &buffer, 1))) {
+            case 0: {
+                int avail = s->conn->inEnd - s->conn->inStart;
+                if (!PQconsumeInput(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQconsumeInput"); return NGX_DECLINED; }
+                if (s->conn->inEnd - s->conn->inStart > avail) return NGX_OK;
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQgetCopyData == 0");
+                return NGX_AGAIN;
+            }
+            case -1: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQgetCopyData == -1"); return NGX_OK;
+            case -2: ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "PQgetCopyData == -2"); return NGX_HTTP_BAD_GATEWAY;
+        }
+        ngx_int_t rc = NGX_OK;
+        if (query) {
             d->row++;
-            if (ngx_pq_output(s, d, query, (const u_char *)buffer, len) != NGX_OK) rc = NGX_ERROR;
-            break;
+            rc = ngx_pq_output(s, d, query, (const u_char *)buffer, len);
+        }
+        PQfreemem(buffer);
+        if (rc != NGX_OK) return NGX_ERROR;
     }
-    if (buffer) PQfreemem(buffer);
-    return rc;
+}
+static void ngx_pq_request_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_pq_res_copy_in(ngx_pq_save_t *s, ngx_pq_data_t *d) {
+    ngx_connection_t *c = s->connection;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_COPY_IN");
+    switch (PQflush(s->conn)) {
+        case 0: break;
+        case 1: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQflush == 1"); c->write->active = 1; return NGX_AGAIN;
+        case -1: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return NGX_DECLINED;
+    }
+    const char *errormsg = NULL;
+    ngx_http_request_t *r = d ? d->request : NULL;
+    if (!d || s->multiplex.pscf) errormsg = "COPY FROM STDIN is not supported here";
+    else if (!r->request_body || !((ngx_pq_loc_conf_t *)ngx_http_get_module_loc_conf(r, ngx_pq_module))->copy_in) errormsg = "pq_copy_in is off";
+    if (errormsg) goto end;
+    if (r->request_body_no_buffering) r->read_event_handler = ngx_pq_request_body_handler;
+    for (;;) {
+        if (!d->copy.in) {
+            if (r->request_body_no_buffering) {
+                if (!r->request_body->bufs && r->reading_body) {
+                    ngx_int_t rc = ngx_http_read_unbuffered_request_body(r);
+                    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_read_unbuffered_request_body = %i", rc); errormsg = "client request body error"; goto end; }
+                }
+                d->copy.in = r->request_body->bufs;
+                r->request_body->bufs = NULL;
+            } else if (!d->copy.started) d->copy.in = r->request_body->bufs;
+            d->copy.started = 1;
+            if (!d->copy.in) break;
+        }
+        ngx_buf_t *b = d->copy.in->buf;
+        off_t size = ngx_buf_size(b);
+        if (!size) { d->copy.in = d->copy.in->next; continue; }
+        u_char *data = b->pos;
+        if (!ngx_buf_in_memory(b)) {
+            ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+            if (!d->copy.buffer && !(d->copy.buffer = ngx_pnalloc(r->pool, plcf->upstream.buffer_size))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pnalloc"); errormsg = "out of memory"; goto end; }
+            ssize_t n = ngx_read_file(b->file, d->copy.buffer, (size_t)ngx_min(size, (off_t)plcf->upstream.buffer_size), b->file_pos);
+            if (n <= 0) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_read_file = %z", n); errormsg = "client request body error"; goto end; }
+            data = d->copy.buffer;
+            size = n;
+        }
+        switch (PQputCopyData(s->conn, (const char *)data, size)) {
+            case 0: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQputCopyData == 0"); c->write->active = 1; return NGX_AGAIN;
+            case -1: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQputCopyData == -1"); return NGX_DECLINED;
+        }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQputCopyData(%O)", size);
+        if (ngx_buf_in_memory(b)) b->pos += size;
+        if (b->in_file) b->file_pos += size;
+        switch (PQflush(s->conn)) {
+            case 0: break;
+            case 1: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQflush == 1"); c->write->active = 1; return NGX_AGAIN;
+            case -1: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return NGX_DECLINED;
+        }
+    }
+    if (r->request_body_no_buffering && r->reading_body) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "r->reading_body"); return NGX_AGAIN; }
+end:
+    if (PQputCopyEnd(s->conn, errormsg) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQputCopyEnd == -1"); return NGX_DECLINED; }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQputCopyEnd(%s)", errormsg ? errormsg : "NULL");
+    if (PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return NGX_DECLINED; }
+    return NGX_OK;
 }
 static ngx_int_t ngx_pq_res_default(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult *res) {
     char *value;
@@ -330,9 +1019,11 @@ static ngx_int_t ngx_pq_res_default(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult
     ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
     ngx_pq_query_t *query = qq->query;
     d->type = query->type;
+    if (qq->statement) ngx_pq_statement_free(s, qq->statement);
     return NGX_HTTP_BAD_GATEWAY;
 }
-static ngx_int_t ngx_pq_res_fatal_error(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult *res) {
+static ngx_int_t ngx_pq_res_fatal_error(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult **hold) {
+    PGresult *res = *hold;
     char *value;
     if ((value = PQcmdStatus(res)) && ngx_strlen(value)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQresultErrorMessage(res), "%s and %s", PQresStatus(PQresultStatus(res)), value); }
     else { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQresultErrorMessage(res), "%s", PQresStatus(PQresultStatus(res))); }
@@ -344,126 +1035,908 @@ static ngx_int_t ngx_pq_res_fatal_error(ngx_pq_save_t *s, ngx_pq_data_t *d, PGre
     ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
     ngx_pq_query_t *query = qq->query;
     d->type = query->type;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SEVERITY, offsetof(ngx_pq_error_t, severity)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SEVERITY_NONLOCALIZED, offsetof(ngx_pq_error_t, severity_nonlocalized)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SQLSTATE, offsetof(ngx_pq_error_t, sqlstate)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_MESSAGE_PRIMARY, offsetof(ngx_pq_error_t, message_primary)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_MESSAGE_DETAIL, offsetof(ngx_pq_error_t, message_detail)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_MESSAGE_HINT, offsetof(ngx_pq_error_t, message_hint)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_STATEMENT_POSITION, offsetof(ngx_pq_error_t, statement_position)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_INTERNAL_POSITION, offsetof(ngx_pq_error_t, internal_position)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_INTERNAL_QUERY, offsetof(ngx_pq_error_t, internal_query)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_CONTEXT, offsetof(ngx_pq_error_t, context)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SCHEMA_NAME, offsetof(ngx_pq_error_t, schema_name)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_TABLE_NAME, offsetof(ngx_pq_error_t, table_name)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_COLUMN_NAME, offsetof(ngx_pq_error_t, column_name)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_DATATYPE_NAME, offsetof(ngx_pq_error_t, datatype_name)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_CONSTRAINT_NAME, offsetof(ngx_pq_error_t, constraint_name)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SOURCE_FILE, offsetof(ngx_pq_error_t, source_file)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SOURCE_LINE, offsetof(ngx_pq_error_t, source_line)) != NGX_OK) return NGX_ERROR;
-    if (ngx_pq_copy_error(d, res, PG_DIAG_SOURCE_FUNCTION, offsetof(ngx_pq_error_t, source_function)) != NGX_OK) return NGX_ERROR;
+    if (qq->statement) ngx_pq_statement_free(s, qq->statement);
+    ngx_http_request_t *r = d->request;
+    if (!d->error.cln) {
+        if (!(d->error.cln = ngx_pool_cleanup_add(r->pool, 0))) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_ERROR; }
+        d->error.cln->handler = ngx_pq_result_cleanup_handler;
+    } else PQclear(d->error.res);
+    d->error.cln->data = d->error.res = res;
+    *hold = NULL;
     return NGX_HTTP_BAD_GATEWAY;
 }
-static ngx_int_t ngx_pq_res_tuples(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult *res) {
-    char *value;
-    if ((value = PQcmdStatus(res)) && ngx_strlen(value)) switch (PQresultStatus(res)) {
-#ifdef LIBPQ_HAS_CHUNK_MODE
-        case PGRES_TUPLES_CHUNK: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_CHUNK and %s", value); break;
-#endif
-        case PGRES_TUPLES_OK: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_OK and %s", value); break;
-        default: break;
-    } else switch (PQresultStatus(res)) {
-#ifdef LIBPQ_HAS_CHUNK_MODE
-        case PGRES_TUPLES_CHUNK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_CHUNK"); break;
-#endif
-        case PGRES_TUPLES_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_OK"); break;
-        default: break;
-    }
-    if (PQresultStatus(res) == PGRES_TUPLES_OK && s->count) { s->count--; return NGX_OK; }
-    if (!d) return NGX_OK;
-    d->empty |= PQntuples(res) == 0;
-    if (ngx_queue_empty(&d->queue)) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "ngx_queue_empty"); return NGX_ERROR; }
-    ngx_queue_t *q = ngx_queue_head(&d->queue);
-    if (PQresultStatus(res) == PGRES_TUPLES_OK) { ngx_queue_remove(q); }
-    ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
+static ngx_int_t ngx_pq_res_json(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_pq_query_queue_t *qq, PGresult *res) {
     ngx_pq_query_t *query = qq->query;
-    d->type = query->type;
-    if (query->header && !qq->not_first) {
-        qq->not_first = 1;
-        if (d->type & ngx_pq_type_location && d->row > 0) if (ngx_pq_output(s, d, query, (const u_char *)"\n", sizeof("\n") - 1) != NGX_OK) return NGX_ERROR;
-        for (int col = 0; col < PQnfields(res); col++) {
-            if (col > 0) if (ngx_pq_output(s, d, query, &query->delimiter, sizeof(query->delimiter)) != NGX_OK) return NGX_ERROR;
-            if (query->string && query->quote) if (ngx_pq_output(s, d, query, &query->quote, sizeof(query->quote)) != NGX_OK) return NGX_ERROR;
+    ngx_flag_t array = query->output == ngx_pq_output_json;
+    ngx_flag_t first = !qq->not_first;
+    ngx_flag_t last = PQresultStatus(res) == PGRES_TUPLES_OK;
+    ngx_flag_t newline = d->type & ngx_pq_type_location && d->row > 0;
+    int nfields = PQnfields(res);
+    int ntuples = PQntuples(res);
+    qq->not_first = 1;
+    size_t len = 0;
+    if (array && first) len += newline + sizeof("[") - 1;
+    if (array && last) len += sizeof("]") - 1;
+    if (ntuples) {
+        size_t keys = 0;
+        for (int col = 0; col < nfields; col++) {
             const u_char *data = (const u_char *)PQfname(res, col);
-            ngx_uint_t len = ngx_strlen(data);
-            if (query->string && query->quote && query->escape) for (ngx_uint_t k = 0; k < len; k++) {
-                if (data[k] == query->quote) if (ngx_pq_output(s, d, query, &query->escape, sizeof(query->escape)) != NGX_OK) return NGX_ERROR;
-                if (ngx_pq_output(s, d, query, &data[k], sizeof(data[k])) != NGX_OK) return NGX_ERROR;
-            } else {
-                if (ngx_pq_output(s, d, query, (const u_char *)data, len) != NGX_OK) return NGX_ERROR;
-            }
-            if (query->string && query->quote) if (ngx_pq_output(s, d, query, &query->quote, sizeof(query->quote)) != NGX_OK) return NGX_ERROR;
+            keys += ngx_pq_json_string_size(data, ngx_strlen(data)) + sizeof(":") - 1;
         }
+        if (nfields > 1) keys += nfields - 1;
+        len += ntuples * (keys + sizeof("{}") - 1 + (array ? sizeof(",") - 1 : sizeof("\n") - 1));
+        if (array && first) len -= sizeof(",") - 1;
     }
-    for (int row = 0; row < PQntuples(res); row++, d->row++) {
-        if (row > 0 || query->header) if (ngx_pq_output(s, d, query, (const u_char *)"\n", sizeof("\n") - 1) != NGX_OK) return NGX_ERROR;
-        for (int col = 0; col < PQnfields(res); col++) {
-            if (col > 0) if (ngx_pq_output(s, d, query, &query->delimiter, sizeof(query->delimiter)) != NGX_OK) return NGX_ERROR;
-            if (PQgetisnull(res, row, col)) {
-                if (query->null.len) if (ngx_pq_output(s, d, query, query->null.data, query->null.len) != NGX_OK) return NGX_ERROR;
-            } else {
-                if (query->string && query->quote) if (ngx_pq_output(s, d, query, &query->quote, sizeof(query->quote)) != NGX_OK) return NGX_ERROR;
-                const u_char *data = (const u_char *)PQgetvalue(res, row, col);
-                ngx_uint_t len = PQgetlength(res, row, col);
-                if (query->string && query->quote && query->escape) for (ngx_uint_t k = 0; k < len; k++) {
-                    if (data[k] == query->quote) if (ngx_pq_output(s, d, query, &query->escape, sizeof(query->escape)) != NGX_OK) return NGX_ERROR;
-                    if (ngx_pq_output(s, d, query, &data[k], sizeof(data[k])) != NGX_OK) return NGX_ERROR;
-                } else {
-                    if (ngx_pq_output(s, d, query, (const u_char *)data, len) != NGX_OK) return NGX_ERROR;
-                }
-                if (query->string && query->quote) if (ngx_pq_output(s, d, query, &query->quote, sizeof(query->quote)) != NGX_OK) return NGX_ERROR;
-            }
+    for (int row = 0; row < ntuples; row++) for (int col = 0; col < nfields; col++) {
+        if (PQgetisnull(res, row, col)) len += sizeof("null") - 1;
+        else len += ngx_pq_json_value_size(PQftype(res, col), (const u_char *)PQgetvalue(res, row, col), PQgetlength(res, row, col));
+    }
+    u_char *p, *start;
+    if (ngx_pq_output_reserve(s, d, query, len, &start) != NGX_OK) return NGX_ERROR;
+    if (!(p = start)) { d->row += ntuples; return NGX_OK; }
+    if (array && first) {
+        if (newline) *p++ = '\n';
+        *p++ = '[';
+    }
+    for (int row = 0; row < ntuples; row++, d->row++) {
+        if (array && (row > 0 || !first)) *p++ = ',';
+        *p++ = '{';
+        for (int col = 0; col < nfields; col++) {
+            if (col > 0) *p++ = ',';
+            const u_char *data = (const u_char *)PQfname(res, col);
+            p = ngx_pq_json_string_copy(p, data, ngx_strlen(data));
+            *p++ = ':';
+            if (PQgetisnull(res, row, col)) p = ngx_copy(p, "null", sizeof("null") - 1);
+            else p = ngx_pq_json_value_copy(p, PQftype(res, col), (const u_char *)PQgetvalue(res, row, col), PQgetlength(res, row, col));
         }
+        *p++ = '}';
+        if (!array) *p++ = '\n';
     }
+    if (array && last) *p++ = ']';
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%*s", (int)(p - start), start);
     return NGX_OK;
 }
-static ngx_int_t ngx_pq_notify(ngx_pq_save_t *s) {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%s", __func__);
-    ngx_int_t rc = NGX_OK;
-    ngx_pool_t *p;
-    for (PGnotify *notify; (notify = PQnotifies(s->conn)); PQfreemem(notify)) {
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "relname=%s, extra=%s, be_pid=%i", notify->relname, notify->extra, notify->be_pid);
-        if (!ngx_http_push_stream_add_msg_to_channel_my) continue;
-        ngx_str_t id = { ngx_strlen(notify->relname), (u_char *)notify->relname };
-        ngx_str_t text = { ngx_strlen(notify->extra), (u_char *)notify->extra };
-        if (!(p = ngx_create_pool(4096 + id.len + text.len, s->connection->log))) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "!ngx_create_pool"); rc = NGX_ERROR; continue; }
-        if (rc == NGX_OK) switch ((rc = ngx_http_push_stream_add_msg_to_channel_my(s->connection->log, &id, &text, NULL, NULL, 1, p))) {
-            case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_ERROR"); break;
-            case NGX_DECLINED: ngx_log_error(NGX_LOG_WARN, s->connection->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_DECLINED"); {
-                for (ngx_queue_t *q = ngx_queue_head(&s->queue), *_; q != ngx_queue_sentinel(&s->queue) && (_ = ngx_queue_next(q)); q = _) {
-                    ngx_pq_channel_queue_t *cq = ngx_queue_data(q, ngx_pq_channel_queue_t, queue);
-                    if (cq->channel.len != id.len || ngx_strncmp(cq->channel.data, id.data, id.len)) continue;
-                    ngx_queue_remove(q);
-                    break;
-                }
-#ifdef LIBPQ_HAS_PIPELINING
-                if (PQpipelineStatus(s->conn) == PQ_PIPELINE_OFF) {
-                    if (!PQenterPipelineMode(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQenterPipelineMode"); rc = NGX_ERROR; goto destroy; }
-                    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQenterPipelineMode");
-                }
-#endif
-                PQExpBufferData sql;
-                initPQExpBuffer(&sql);
-                appendPQExpBufferStr(&sql, "UNLISTEN ");
-                char *str;
-                if (!(str = PQescapeIdentifier(s->conn, (char *)id.data, id.len))) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQescapeIdentifier"); rc = NGX_ERROR; goto term; }
-                appendPQExpBufferStr(&sql, str);
-                PQfreemem(str);
-                if (PQExpBufferDataBroken(sql)) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "PQExpBufferDataBroken"); rc = NGX_ERROR; goto term; }
-                if (!PQsendQueryParams(s->conn, sql.data, 0, NULL, NULL, NULL, NULL, 0)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQsendQueryParams"); rc = NGX_ERROR; goto term; }
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQsendQueryParams('%s')", sql.data);
-                s->count++;
-                rc = NGX_OK;
+static void ngx_pq_fb_write(u_char *p, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++, value >>= 8) p[i] = (u_char)value;
+}
+static void ngx_pq_fb_scalar(ngx_pq_fb_t *fb, uint64_t value, size_t size) {
+    if (fb->start) ngx_pq_fb_write(fb->start + fb->pos, value, size);
+    fb->pos += size;
+}
+static void ngx_pq_fb_pad(ngx_pq_fb_t *fb, size_t align) {
+    size_t pos = ngx_align(fb->pos, align);
+    if (fb->start) ngx_memzero(fb->start + fb->pos, pos - fb->pos);
+    fb->pos = pos;
+}
+static void ngx_pq_fb_patch(ngx_pq_fb_t *fb, size_t pos, size_t target) {
+    if (fb->start) ngx_pq_fb_write(fb->start + pos, target - pos, 4);
+}
+static size_t ngx_pq_fb_table(ngx_pq_fb_t *fb, ngx_pq_fb_slot_t *slot, ngx_uint_t n) {
+    size_t size = 4;
+    for (size_t width = 8; width; width >>= 1) for (ngx_uint_t i = 0; i < n; i++) if (slot[i].size == width) {
+        size = ngx_align(size, width);
+        slot[i].pos = size;
+        size += width;
+    }
+    ngx_pq_fb_pad(fb, 2);
+    size_t vtable = fb->pos;
+    ngx_pq_fb_scalar(fb, 4 + 2 * n, 2);
+    ngx_pq_fb_scalar(fb, size, 2);
+    for (ngx_uint_t i = 0; i < n; i++) ngx_pq_fb_scalar(fb, slot[i].size ? slot[i].pos : 0, 2);
+    ngx_pq_fb_pad(fb, 8);
+    size_t table = fb->pos;
+    if (fb->start) ngx_memzero(fb->start + table, size);
+    ngx_pq_fb_scalar(fb, table - vtable, 4);
+    for (ngx_uint_t i = 0; i < n; i++) if (slot[i].size) {
+        slot[i].pos += table;
+        if (fb->start) ngx_pq_fb_write(fb->start + slot[i].pos, slot[i].value, slot[i].size);
+    }
+    fb->pos = table + size;
+    return table;
+}
+static size_t ngx_pq_fb_vector(ngx_pq_fb_t *fb, ngx_uint_t n, size_t align) {
+    ngx_pq_fb_pad(fb, align);
+    if (align > 4) ngx_pq_fb_scalar(fb, 0, 4);
+    size_t vector = fb->pos;
+    ngx_pq_fb_scalar(fb, n, 4);
+    return vector;
+}
+static size_t ngx_pq_fb_string(ngx_pq_fb_t *fb, const u_char *data, size_t len) {
+    size_t string = ngx_pq_fb_vector(fb, len, 4);
+    if (fb->start) ngx_memcpy(fb->start + fb->pos, data, len);
+    fb->pos += len;
+    ngx_pq_fb_scalar(fb, 0, 1);
+    return string;
+}
+static ngx_uint_t ngx_pq_arrow_type(Oid oid, size_t *width) {
+    *width = 0;
+    switch (oid) {
+        case ngx_pq_oid_bool: return ngx_pq_arrow_bool;
+        case ngx_pq_oid_bpchar: case ngx_pq_oid_char: case ngx_pq_oid_json: case ngx_pq_oid_jsonb: case ngx_pq_oid_name: case ngx_pq_oid_text: case ngx_pq_oid_varchar: return ngx_pq_arrow_utf8;
+        case ngx_pq_oid_date: *width = 4; return ngx_pq_arrow_date;
+        case ngx_pq_oid_float4: *width = 4; return ngx_pq_arrow_floating_point;
+        case ngx_pq_oid_float8: *width = 8; return ngx_pq_arrow_floating_point;
+        case ngx_pq_oid_int2: *width = 2; return ngx_pq_arrow_int;
+        case ngx_pq_oid_int4: case ngx_pq_oid_oid: *width = 4; return ngx_pq_arrow_int;
+        case ngx_pq_oid_int8: *width = 8; return ngx_pq_arrow_int;
+        case ngx_pq_oid_timestamp: case ngx_pq_oid_timestamptz: *width = 8; return ngx_pq_arrow_timestamp;
+        case ngx_pq_oid_uuid: *width = 16; return ngx_pq_arrow_fixed_size_binary;
+        default: return ngx_pq_arrow_binary;
+    }
+}
+static size_t ngx_pq_arrow_message(ngx_pq_fb_t *fb, ngx_uint_t type, size_t body, ngx_pq_fb_slot_t *header) {
+    ngx_pq_fb_scalar(fb, 0xffffffff, 4);
+    ngx_pq_fb_scalar(fb, 0, 4);
+    ngx_pq_fb_scalar(fb, 0, 4);
+    ngx_pq_fb_slot_t message[] = { { 2, 4, 0 }, { 1, type, 0 }, { 4, 0, 0 }, { 8, body, 0 } };
+    ngx_pq_fb_patch(fb, 8, ngx_pq_fb_table(fb, message, sizeof(message) / sizeof(message[0])));
+    *header = message[2];
+    return 8;
+}
+static size_t ngx_pq_arrow_schema(u_char *start, PGresult *res) {
+    ngx_pq_fb_t fb = { 0, start };
+    ngx_pq_fb_slot_t header;
+    size_t base = ngx_pq_arrow_message(&fb, 1, 0, &header);
+    int nfields = PQnfields(res);
+#if (NGX_HAVE_LITTLE_ENDIAN)
+    ngx_pq_fb_slot_t schema[] = { { 2, 0, 0 }, { 4, 0, 0 } };
+#else
+    ngx_pq_fb_slot_t schema[] = { { 2, 1, 0 }, { 4, 0, 0 } };
+#endif
+    ngx_pq_fb_patch(&fb, header.pos, ngx_pq_fb_table(&fb, schema, sizeof(schema) / sizeof(schema[0])));
+    size_t fields = ngx_pq_fb_vector(&fb, nfields, 4);
+    ngx_pq_fb_patch(&fb, schema[1].pos, fields);
+    fb.pos += nfields * 4;
+    for (int col = 0; col < nfields; col++) {
+        size_t width;
+        Oid oid = PQftype(res, col);
+        ngx_uint_t type = ngx_pq_arrow_type(oid, &width);
+        ngx_pq_fb_slot_t field[] = { { 4, 0, 0 }, { 1, 1, 0 }, { 1, type, 0 }, { 4, 0, 0 }, { 0, 0, 0 }, { 4, 0, 0 } };
+        ngx_pq_fb_patch(&fb, fields + 4 + 4 * col, ngx_pq_fb_table(&fb, field, sizeof(field) / sizeof(field[0])));
+        const u_char *name = (const u_char *)PQfname(res, col);
+        ngx_pq_fb_patch(&fb, field[0].pos, ngx_pq_fb_string(&fb, name, ngx_strlen(name)));
+        switch (type) {
+            case ngx_pq_arrow_date: { ngx_pq_fb_slot_t date[] = { { 2, 0, 0 } }; ngx_pq_fb_patch(&fb, field[3].pos, ngx_pq_fb_table(&fb, date, 1)); } break;
+            case ngx_pq_arrow_fixed_size_binary: { ngx_pq_fb_slot_t fixed[] = { { 4, width, 0 } }; ngx_pq_fb_patch(&fb, field[3].pos, ngx_pq_fb_table(&fb, fixed, 1)); } break;
+            case ngx_pq_arrow_floating_point: { ngx_pq_fb_slot_t floating[] = { { 2, width == 4 ? 1 : 2, 0 } }; ngx_pq_fb_patch(&fb, field[3].pos, ngx_pq_fb_table(&fb, floating, 1)); } break;
+            case ngx_pq_arrow_int: { ngx_pq_fb_slot_t integer[] = { { 4, width * 8, 0 }, { 1, oid != ngx_pq_oid_oid, 0 } }; ngx_pq_fb_patch(&fb, field[3].pos, ngx_pq_fb_table(&fb, integer, 2)); } break;
+            case ngx_pq_arrow_timestamp: {
+                ngx_pq_fb_slot_t timestamp[] = { { 2, 2, 0 }, { oid == ngx_pq_oid_timestamptz ? 4 : 0, 0, 0 } };
+                ngx_pq_fb_patch(&fb, field[3].pos, ngx_pq_fb_table(&fb, timestamp, 2));
+                if (oid == ngx_pq_oid_timestamptz) ngx_pq_fb_patch(&fb, timestamp[1].pos, ngx_pq_fb_string(&fb, (u_char *)"UTC", sizeof("UTC") - 1));
+            } break;
+            default: ngx_pq_fb_patch(&fb, field[3].pos, ngx_pq_fb_table(&fb, NULL, 0)); break;
+        }
+        ngx_pq_fb_patch(&fb, field[5].pos, ngx_pq_fb_vector(&fb, 0, 4));
+    }
+    ngx_pq_fb_pad(&fb, 8);
+    if (start) ngx_pq_fb_write(start + 4, fb.pos - base, 4);
+    return fb.pos;
+}
+static u_char *ngx_pq_arrow_value(u_char *p, Oid oid, const u_char *data, size_t width) {
+    if (width > sizeof(uint64_t)) return ngx_cpymem(p, data, width);
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++) value = value << 8 | data[i];
+    switch (oid) {
+        case ngx_pq_oid_date: value = (uint32_t)((int32_t)value + 10957); break;
+        case ngx_pq_oid_timestamp: case ngx_pq_oid_timestamptz: value = (uint64_t)((int64_t)value + 946684800000000LL); break;
+    }
+    switch (width) {
+        case 2: { uint16_t v = value; p = ngx_cpymem(p, &v, sizeof(v)); } break;
+        case 4: { uint32_t v = value; p = ngx_cpymem(p, &v, sizeof(v)); } break;
+        case 8: { uint64_t v = value; p = ngx_cpymem(p, &v, sizeof(v)); } break;
+    }
+    return p;
+}
+static size_t ngx_pq_arrow_batch(u_char *start, PGresult *res, ngx_log_t *log) {
+    int nfields = PQnfields(res);
+    int ntuples = PQntuples(res);
+    size_t bitmap = ngx_align((ntuples + 7) / 8, 8);
+    size_t body = 0, nbuffers = 0;
+    for (int col = 0; col < nfields; col++) {
+        size_t width;
+        Oid oid = PQftype(res, col);
+        ngx_uint_t type = ngx_pq_arrow_type(oid, &width);
+        body += bitmap;
+        if (type == ngx_pq_arrow_bool) { body += bitmap; nbuffers += 2; continue; }
+        if (width) {
+            for (int row = 0; row < ntuples; row++) if (!PQgetisnull(res, row, col) && (size_t)PQgetlength(res, row, col) != width) { ngx_log_error(NGX_LOG_ERR, log, 0, "arrow: column \"%s\" value length %d != %uz", PQfname(res, col), PQgetlength(res, row, col), width); return 0; }
+            body += ngx_align(ntuples * width, 8);
+            nbuffers += 2;
+            continue;
+        }
+        size_t len = 0;
+        for (int row = 0; row < ntuples; row++) if (!PQgetisnull(res, row, col)) len += PQgetlength(res, row, col) - (oid == ngx_pq_oid_jsonb && PQgetlength(res, row, col));
+        if (len > NGX_MAX_INT32_VALUE) { ngx_log_error(NGX_LOG_ERR, log, 0, "arrow: column \"%s\" data length %uz exceeds int32 offsets", PQfname(res, col), len); return 0; }
+        body += ngx_align((ntuples + 1) * 4, 8) + ngx_align(len, 8);
+        nbuffers += 3;
+    }
+    ngx_pq_fb_t fb = { 0, start };
+    ngx_pq_fb_slot_t header;
+    size_t base = ngx_pq_arrow_message(&fb, 3, body, &header);
+    ngx_pq_fb_slot_t batch[] = { { 8, ntuples, 0 }, { 4, 0, 0 }, { 4, 0, 0 } };
+    ngx_pq_fb_patch(&fb, header.pos, ngx_pq_fb_table(&fb, batch, sizeof(batch) / sizeof(batch[0])));
+    ngx_pq_fb_patch(&fb, batch[1].pos, ngx_pq_fb_vector(&fb, nfields, 8));
+    for (int col = 0; col < nfields; col++) {
+        int nulls = 0;
+        for (int row = 0; row < ntuples; row++) nulls += PQgetisnull(res, row, col);
+        ngx_pq_fb_scalar(&fb, ntuples, 8);
+        ngx_pq_fb_scalar(&fb, nulls, 8);
+    }
+    ngx_pq_fb_patch(&fb, batch[2].pos, ngx_pq_fb_vector(&fb, nbuffers, 8));
+    size_t offset = 0;
+    for (int col = 0; col < nfields; col++) {
+        size_t width;
+        Oid oid = PQftype(res, col);
+        ngx_uint_t type = ngx_pq_arrow_type(oid, &width);
+        ngx_pq_fb_scalar(&fb, offset, 8);
+        ngx_pq_fb_scalar(&fb, bitmap, 8);
+        offset += bitmap;
+        if (type == ngx_pq_arrow_bool || width) {
+            size_t len = type == ngx_pq_arrow_bool ? bitmap : ngx_align(ntuples * width, 8);
+            ngx_pq_fb_scalar(&fb, offset, 8);
+            ngx_pq_fb_scalar(&fb, len, 8);
+            offset += len;
+            continue;
+        }
+        size_t len = 0;
+        for (int row = 0; row < ntuples; row++) if (!PQgetisnull(res, row, col)) len += PQgetlength(res, row, col) - (oid == ngx_pq_oid_jsonb && PQgetlength(res, row, col));
+        ngx_pq_fb_scalar(&fb, offset, 8);
+        ngx_pq_fb_scalar(&fb, ngx_align((ntuples + 1) * 4, 8), 8);
+        offset += ngx_align((ntuples + 1) * 4, 8);
+        ngx_pq_fb_scalar(&fb, offset, 8);
+        ngx_pq_fb_scalar(&fb, ngx_align(len, 8), 8);
+        offset += ngx_align(len, 8);
+    }
+    ngx_pq_fb_pad(&fb, 8);
+    if (!start) return fb.pos + body;
+    ngx_pq_fb_write(start + 4, fb.pos - base, 4);
+    u_char *p = start + fb.pos;
+    ngx_memzero(p, body);
+    for (int col = 0; col < nfields; col++) {
+        size_t width;
+        Oid oid = PQftype(res, col);
+        ngx_uint_t type = ngx_pq_arrow_type(oid, &width);
+        u_char *validity = p;
+        for (int row = 0; row < ntuples; row++) if (!PQgetisnull(res, row, col)) validity[row / 8] |= 1 << (row % 8);
+        p += bitmap;
+        if (type == ngx_pq_arrow_bool) {
+            for (int row = 0; row < ntuples; row++) if (!PQgetisnull(res, row, col) && PQgetlength(res, row, col) && *PQgetvalue(res, row, col)) p[row / 8] |= 1 << (row % 8);
+            p += bitmap;
+            continue;
+        }
+        if (width) {
+            u_char *values = p;
+            for (int row = 0; row < ntuples; row++, values += width) if (!PQgetisnull(res, row, col)) ngx_pq_arrow_value(values, oid, (const u_char *)PQgetvalue(res, row, col), width);
+            p += ngx_align(ntuples * width, 8);
+            continue;
+        }
+        u_char *offsets = p;
+        u_char *data = p += ngx_align((ntuples + 1) * 4, 8);
+        uint32_t end = 0;
+        ngx_memcpy(offsets, &end, sizeof(end));
+        for (int row = 0; row < ntuples; row++) {
+            if (!PQgetisnull(res, row, col)) {
+                const u_char *value = (const u_char *)PQgetvalue(res, row, col);
+                size_t len = PQgetlength(res, row, col);
+                if (oid == ngx_pq_oid_jsonb && len) { value++; len--; }
+                data = ngx_cpymem(data, value, len);
+                end += len;
+            }
+            ngx_memcpy(offsets + 4 * (row + 1), &end, sizeof(end));
+        }
+        p += ngx_align(end, 8);
+    }
+    return p - start;
+}
+static ngx_int_t ngx_pq_res_arrow(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_pq_query_queue_t *qq, PGresult *res) {
+    ngx_pq_query_t *query = qq->query;
+    ngx_flag_t first = !qq->not_first;
+    ngx_flag_t last = PQresultStatus(res) == PGRES_TUPLES_OK;
+    int ntuples = PQntuples(res);
+    qq->not_first = 1;
+    size_t len = 0, batch = 0;
+    if (first) len += ngx_pq_arrow_schema(NULL, res);
+    if (ntuples && !(len += batch = ngx_pq_arrow_batch(NULL, res, s->connection->log))) return NGX_ERROR;
+    if (last) len += 8;
+    u_char *p, *start;
+    if (ngx_pq_output_reserve(s, d, query, len, &start) != NGX_OK) return NGX_ERROR;
+    d->row += ntuples;
+    if (!(p = start)) return NGX_OK;
+    if (first) p += ngx_pq_arrow_schema(p, res);
+    if (batch) p += ngx_pq_arrow_batch(p, res, s->connection->log);
+    if (last) {
+        ngx_pq_fb_write(p, 0xffffffff, 4);
+        ngx_pq_fb_write(p + 4, 0, 4);
+    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "arrow %uz bytes of %d rows", len, ntuples);
+    return NGX_OK;
+}
+static uint64_t ngx_pq_pack_read(const u_char *data, size_t width) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++) value = value << 8 | data[i];
+    return value;
+}
+static size_t ngx_pq_pack_raw(u_char *p, uint64_t value, size_t width) {
+    if (p) for (size_t i = width; i; i--) *p++ = (u_char)(value >> (8 * (i - 1)));
+    return width;
+}
+static size_t ngx_pq_pack_be(u_char *p, u_char prefix, uint64_t value, size_t width) {
+    if (p) *p++ = prefix;
+    return 1 + ngx_pq_pack_raw(p, value, width);
+}
+static size_t ngx_pq_pack_cbor(u_char *p, u_char major, uint64_t n) {
+    if (n < 24) return ngx_pq_pack_be(p, major | n, 0, 0);
+    if (n <= 0xff) return ngx_pq_pack_be(p, major | 24, n, 1);
+    if (n <= 0xffff) return ngx_pq_pack_be(p, major | 25, n, 2);
+    if (n <= 0xffffffff) return ngx_pq_pack_be(p, major | 26, n, 4);
+    return ngx_pq_pack_be(p, major | 27, n, 8);
+}
+static size_t ngx_pq_pack_head(u_char *p, ngx_flag_t cbor, ngx_uint_t type, uint64_t n) {
+    switch (type) {
+        case ngx_pq_pack_array:
+            if (cbor) return ngx_pq_pack_cbor(p, 0x80, n);
+            if (n < 16) return ngx_pq_pack_be(p, 0x90 | n, 0, 0);
+            if (n <= 0xffff) return ngx_pq_pack_be(p, 0xdc, n, 2);
+            return ngx_pq_pack_be(p, 0xdd, n, 4);
+        case ngx_pq_pack_bin:
+            if (cbor) return ngx_pq_pack_cbor(p, 0x40, n);
+            if (n <= 0xff) return ngx_pq_pack_be(p, 0xc4, n, 1);
+            if (n <= 0xffff) return ngx_pq_pack_be(p, 0xc5, n, 2);
+            return ngx_pq_pack_be(p, 0xc6, n, 4);
+        default:
+            if (cbor) return ngx_pq_pack_cbor(p, 0x60, n);
+            if (n < 32) return ngx_pq_pack_be(p, 0xa0 | n, 0, 0);
+            if (n <= 0xff) return ngx_pq_pack_be(p, 0xd9, n, 1);
+            if (n <= 0xffff) return ngx_pq_pack_be(p, 0xda, n, 2);
+            return ngx_pq_pack_be(p, 0xdb, n, 4);
+    }
+}
+static size_t ngx_pq_pack_int(u_char *p, ngx_flag_t cbor, int64_t value) {
+    if (cbor) return value < 0 ? ngx_pq_pack_cbor(p, 0x20, -1 - value) : ngx_pq_pack_cbor(p, 0x00, value);
+    if (value >= 0) {
+        if (value < 128) return ngx_pq_pack_be(p, value, 0, 0);
+        if (value <= 0xff) return ngx_pq_pack_be(p, 0xcc, value, 1);
+        if (value <= 0xffff) return ngx_pq_pack_be(p, 0xcd, value, 2);
+        if (value <= 0xffffffff) return ngx_pq_pack_be(p, 0xce, value, 4);
+        return ngx_pq_pack_be(p, 0xcf, value, 8);
+    }
+    if (value >= -32) return ngx_pq_pack_be(p, (u_char)value, 0, 0);
+    if (value >= -0x80) return ngx_pq_pack_be(p, 0xd0, value, 1);
+    if (value >= -0x8000) return ngx_pq_pack_be(p, 0xd1, value, 2);
+    if (value >= -0x80000000LL) return ngx_pq_pack_be(p, 0xd2, value, 4);
+    return ngx_pq_pack_be(p, 0xd3, value, 8);
+}
+static size_t ngx_pq_pack_bytes(u_char *p, ngx_flag_t cbor, ngx_uint_t type, const u_char *data, size_t len) {
+    size_t size = ngx_pq_pack_head(p, cbor, type, len);
+    if (p) ngx_memcpy(p + size, data, len);
+    return size + len;
+}
+static size_t ngx_pq_pack_time(u_char *p, ngx_flag_t cbor, int64_t usec) {
+    if (cbor) {
+        double seconds = (double)usec / 1000000;
+        uint64_t bits;
+        ngx_memcpy(&bits, &seconds, sizeof(bits));
+        size_t size = ngx_pq_pack_cbor(p, 0xc0, 1);
+        return size + ngx_pq_pack_be(p ? p + size : NULL, 0xfb, bits, 8);
+    }
+    int64_t sec = usec / 1000000;
+    int64_t nsec = usec % 1000000 * 1000;
+    if (nsec < 0) { sec--; nsec += 1000000000; }
+    size_t size = ngx_pq_pack_be(p, 0xc7, 12 << 8 | 0xff, 2);
+    size += ngx_pq_pack_raw(p ? p + size : NULL, nsec, 4);
+    return size + ngx_pq_pack_raw(p ? p + size : NULL, sec, 8);
+}
+static size_t ngx_pq_pack_numeric(u_char *p, const u_char *data, size_t len) {
+    if (len < 8) return 0;
+    ngx_int_t ndigits = (int16_t)ngx_pq_pack_read(data, 2);
+    ngx_int_t weight = (int16_t)ngx_pq_pack_read(data + 2, 2);
+    ngx_uint_t sign = ngx_pq_pack_read(data + 4, 2);
+    ngx_int_t dscale = ngx_pq_pack_read(data + 6, 2);
+    if (ndigits < 0 || len != 8 + (size_t)ndigits * 2) return 0;
+    ngx_str_t special = ngx_null_string;
+    switch (sign) {
+        case 0x0000: case 0x4000: break;
+        case 0xc000: ngx_str_set(&special, "NaN"); break;
+        case 0xd000: ngx_str_set(&special, "Infinity"); break;
+        case 0xf000: ngx_str_set(&special, "-Infinity"); break;
+        default: return 0;
+    }
+    if (special.len) {
+        if (p) ngx_memcpy(p, special.data, special.len);
+        return special.len;
+    }
+    size_t size = 0;
+    if (sign == 0x4000) { if (p) p[size] = '-'; size++; }
+    if (weight < 0) { if (p) p[size] = '0'; size++; }
+    for (ngx_int_t i = 0; i <= weight; i++) {
+        ngx_uint_t digit = i < ndigits ? ngx_pq_pack_read(data + 8 + 2 * i, 2) : 0;
+        for (ngx_uint_t scale = 1000; scale; scale /= 10) {
+            if (!i && scale > 1 && digit < scale) continue;
+            if (p) p[size] = '0' + digit / scale % 10;
+            size++;
+        }
+    }
+    if (dscale > 0) { if (p) p[size] = '.'; size++; }
+    for (ngx_int_t i = weight + 1, n = 0; n < dscale; i++) {
+        ngx_uint_t digit = i >= 0 && i < ndigits ? ngx_pq_pack_read(data + 8 + 2 * i, 2) : 0;
+        for (ngx_uint_t scale = 1000; scale && n < dscale; scale /= 10, n++) {
+            if (p) p[size] = '0' + digit / scale % 10;
+            size++;
+        }
+    }
+    return size;
+}
+static size_t ngx_pq_pack_value(u_char *p, ngx_flag_t cbor, Oid oid, const u_char *data, size_t len) {
+    switch (oid) {
+        case ngx_pq_oid_bool: if (len == 1) return ngx_pq_pack_be(p, *data ? (cbor ? 0xf5 : 0xc3) : (cbor ? 0xf4 : 0xc2), 0, 0); break;
+        case ngx_pq_oid_int2: if (len == 2) return ngx_pq_pack_int(p, cbor, (int16_t)ngx_pq_pack_read(data, 2)); break;
+        case ngx_pq_oid_int4: if (len == 4) return ngx_pq_pack_int(p, cbor, (int32_t)ngx_pq_pack_read(data, 4)); break;
+        case ngx_pq_oid_int8: if (len == 8) return ngx_pq_pack_int(p, cbor, (int64_t)ngx_pq_pack_read(data, 8)); break;
+        case ngx_pq_oid_oid: if (len == 4) return ngx_pq_pack_int(p, cbor, ngx_pq_pack_read(data, 4)); break;
+        case ngx_pq_oid_float4: if (len == 4) return ngx_pq_pack_be(p, cbor ? 0xfa : 0xca, ngx_pq_pack_read(data, 4), 4); break;
+        case ngx_pq_oid_float8: if (len == 8) return ngx_pq_pack_be(p, cbor ? 0xfb : 0xcb, ngx_pq_pack_read(data, 8), 8); break;
+        case ngx_pq_oid_date: if (len == 4) {
+            int64_t days = (int32_t)ngx_pq_pack_read(data, 4) + 10957;
+            if (!cbor) return ngx_pq_pack_time(p, cbor, days * 86400 * 1000000);
+            size_t size = ngx_pq_pack_cbor(p, 0xc0, 100);
+            return size + ngx_pq_pack_int(p ? p + size : NULL, cbor, days);
+        } break;
+        case ngx_pq_oid_timestamp: case ngx_pq_oid_timestamptz: if (len == 8) return ngx_pq_pack_time(p, cbor, (int64_t)ngx_pq_pack_read(data, 8) + 946684800000000LL); break;
+        case ngx_pq_oid_numeric: {
+            size_t n = ngx_pq_pack_numeric(NULL, data, len);
+            if (!n) break;
+            size_t size = ngx_pq_pack_head(p, cbor, ngx_pq_pack_str, n);
+            if (p) ngx_pq_pack_numeric(p + size, data, len);
+            return size + n;
+        }
+        case ngx_pq_oid_jsonb: if (len) return ngx_pq_pack_bytes(p, cbor, ngx_pq_pack_str, data + 1, len - 1); break;
+        case ngx_pq_oid_bpchar: case ngx_pq_oid_char: case ngx_pq_oid_json: case ngx_pq_oid_name: case ngx_pq_oid_text: case ngx_pq_oid_varchar: return ngx_pq_pack_bytes(p, cbor, ngx_pq_pack_str, data, len);
+    }
+    return ngx_pq_pack_bytes(p, cbor, ngx_pq_pack_bin, data, len);
+}
+static size_t ngx_pq_pack_rows(u_char *p, ngx_flag_t cbor, ngx_flag_t header, PGresult *res) {
+    int nfields = PQnfields(res);
+    int ntuples = PQntuples(res);
+    size_t size = 0;
+    if (header) {
+        size += ngx_pq_pack_head(p, cbor, ngx_pq_pack_array, nfields);
+        for (int col = 0; col < nfields; col++) {
+            const u_char *data = (const u_char *)PQfname(res, col);
+            size += ngx_pq_pack_bytes(p ? p + size : NULL, cbor, ngx_pq_pack_str, data, ngx_strlen(data));
+        }
+    }
+    for (int row = 0; row < ntuples; row++) {
+        size += ngx_pq_pack_head(p ? p + size : NULL, cbor, ngx_pq_pack_array, nfields);
+        for (int col = 0; col < nfields; col++) {
+            if (PQgetisnull(res, row, col)) size += ngx_pq_pack_be(p ? p + size : NULL, cbor ? 0xf6 : 0xc0, 0, 0);
+            else size += ngx_pq_pack_value(p ? p + size : NULL, cbor, PQftype(res, col), (const u_char *)PQgetvalue(res, row, col), PQgetlength(res, row, col));
+        }
+    }
+    return size;
+}
+static ngx_int_t ngx_pq_res_pack(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_pq_query_queue_t *qq, PGresult *res) {
+    ngx_pq_query_t *query = qq->query;
+    ngx_flag_t cbor = query->output == ngx_pq_output_cbor;
+    ngx_flag_t header = query->header && !qq->not_first;
+    int ntuples = PQntuples(res);
+    qq->not_first = 1;
+    size_t len = ngx_pq_pack_rows(NULL, cbor, header, res);
+    u_char *start;
+    if (ngx_pq_output_reserve(s, d, query, len, &start) != NGX_OK) return NGX_ERROR;
+    d->row += ntuples;
+    if (!start) return NGX_OK;
+    ngx_pq_pack_rows(start, cbor, header, res);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "pack %uz bytes of %d rows", len, ntuples);
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_res_tuples(ngx_pq_save_t *s, ngx_pq_data_t *d, PGresult **hold) {
+    PGresult *res = *hold;
+    char *value;
+    if ((value = PQcmdStatus(res)) && ngx_strlen(value)) switch (PQresultStatus(res)) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_CHUNK and %s", value); break;
+#endif
+        case PGRES_TUPLES_OK: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_OK and %s", value); break;
+        default: break;
+    } else switch (PQresultStatus(res)) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_CHUNK"); break;
+#endif
+        case PGRES_TUPLES_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PGRES_TUPLES_OK"); break;
+        default: break;
+    }
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && s->count) { s->count--; return NGX_OK; }
+    if (!d) return NGX_OK;
+    d->empty |= PQntuples(res) == 0;
+    if (ngx_queue_empty(&d->queue)) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "ngx_queue_empty"); return NGX_ERROR; }
+    ngx_queue_t *q = ngx_queue_head(&d->queue);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK) { ngx_queue_remove(q); }
+    ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
+    ngx_pq_query_t *query = qq->query;
+    d->type = query->type;
+    if (query->prefix) return ngx_pq_res_prefix(d, query, hold);
+    if (query->output == ngx_pq_output_json || query->output == ngx_pq_output_ndjson) return ngx_pq_res_json(s, d, qq, res);
+    if (query->output == ngx_pq_output_arrow) return ngx_pq_res_arrow(s, d, qq, res);
+    if (query->output == ngx_pq_output_msgpack || query->output == ngx_pq_output_cbor) return ngx_pq_res_pack(s, d, qq, res);
+    int nfields = PQnfields(res);
+    int ntuples = PQntuples(res);
+    ngx_flag_t header = query->header && !qq->not_first;
+    qq->not_first |= query->header;
+    if ((query->output == ngx_pq_output_value || query->output == ngx_pq_output_binary) && !query->index && d->type & ngx_pq_type_location && !header && ntuples == 1 && nfields == 1 && !PQgetisnull(res, 0, 0)) {
+        ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(d->request, ngx_pq_module);
+        u_char *data = (u_char *)PQgetvalue(res, 0, 0);
+        size_t len = PQgetlength(res, 0, 0);
+        if (len >= plcf->upstream.buffer_size && ngx_pq_value_size(query, data, len) == len) {
+            d->row++;
+            if (ngx_pq_output_result(d, res, data, len) != NGX_OK) return NGX_ERROR;
+            *hold = NULL;
+            return NGX_OK;
+        }
+    }
+    size_t len = 0;
+    if (header) {
+        if (d->type & ngx_pq_type_location && d->row > 0) len += sizeof("\n") - 1;
+        for (int col = 0; col < nfields; col++) {
+            if (col > 0) len += sizeof(query->delimiter);
+            const u_char *data = (const u_char *)PQfname(res, col);
+            len += ngx_pq_value_size(query, data, ngx_strlen(data));
+        }
+    }
+    for (int row = 0; row < ntuples; row++) {
+        if (row > 0 || query->header) len += sizeof("\n") - 1;
+        for (int col = 0; col < nfields; col++) {
+            if (col > 0) len += sizeof(query->delimiter);
+            if (PQgetisnull(res, row, col)) len += query->null.len;
+            else len += ngx_pq_value_size(query, (const u_char *)PQgetvalue(res, row, col), PQgetlength(res, row, col));
+        }
+    }
+    u_char *p, *start;
+    if (ngx_pq_output_reserve(s, d, query, len, &start) != NGX_OK) return NGX_ERROR;
+    if (!(p = start)) { d->row += ntuples; return NGX_OK; }
+    if (header) {
+        if (d->type & ngx_pq_type_location && d->row > 0) *p++ = '\n';
+        for (int col = 0; col < nfields; col++) {
+            if (col > 0) *p++ = query->delimiter;
+            const u_char *data = (const u_char *)PQfname(res, col);
+            p = ngx_pq_value_copy(p, query, data, ngx_strlen(data));
+        }
+    }
+    for (int row = 0; row < ntuples; row++, d->row++) {
+        if (row > 0 || query->header) *p++ = '\n';
+        for (int col = 0; col < nfields; col++) {
+            if (col > 0) *p++ = query->delimiter;
+            if (PQgetisnull(res, row, col)) p = ngx_copy(p, query->null.data, query->null.len);
+            else p = ngx_pq_value_copy(p, query, (const u_char *)PQgetvalue(res, row, col), PQgetlength(res, row, col));
+        }
+    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%*s", (int)(p - start), start);
+    return NGX_OK;
+}
+static void ngx_pq_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    for (ngx_rbtree_node_t **p;; temp = *p) {
+        if (node->key < temp->key) p = &temp->left;
+        else if (node->key > temp->key) p = &temp->right;
+        else p = ngx_memcmp(((ngx_pq_cache_node_t *)node)->key, ((ngx_pq_cache_node_t *)temp)->key, sizeof(((ngx_pq_cache_node_t *)node)->key)) < 0 ? &temp->left : &temp->right;
+        if (*p == sentinel) {
+            *p = node;
+            node->parent = temp;
+            node->left = sentinel;
+            node->right = sentinel;
+            ngx_rbt_red(node);
+            return;
+        }
+    }
+}
+static ngx_pq_cache_node_t *ngx_pq_cache_lookup(ngx_pq_cache_sh_t *sh, u_char *key) {
+    ngx_rbtree_key_t node_key;
+    ngx_memcpy(&node_key, key, sizeof(node_key));
+    for (ngx_rbtree_node_t *node = sh->rbtree.root, *sentinel = sh->rbtree.sentinel; node != sentinel; ) {
+        if (node_key < node->key) { node = node->left; continue; }
+        if (node_key > node->key) { node = node->right; continue; }
+        ngx_pq_cache_node_t *cn = (ngx_pq_cache_node_t *)node;
+        ngx_int_t rc = ngx_memcmp(key, cn->key, sizeof(cn->key));
+        if (!rc) return cn;
+        node = rc < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+static void ngx_pq_cache_delete(ngx_pq_cache_zone_t *ctx, ngx_pq_cache_node_t *cn) {
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(ctx->shpool, cn);
+}
+static void ngx_pq_cache_md5(ngx_md5_t *md5, const u_char *data, size_t len) {
+    ngx_md5_update(md5, &len, sizeof(len));
+    ngx_md5_update(md5, data, len);
+}
+static ngx_int_t ngx_pq_cache_key(ngx_http_request_t *r, ngx_pq_loc_conf_t *plcf, u_char *key) {
+    ngx_md5_t md5;
+    ngx_str_t value;
+    ngx_md5_init(&md5);
+    if (plcf->complex.value.data) {
+        if (ngx_http_complex_value(r, &plcf->complex, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+        ngx_pq_cache_md5(&md5, value.data, value.len);
+    } else if (plcf->upstream.upstream) ngx_pq_cache_md5(&md5, plcf->upstream.upstream->host.data, plcf->upstream.upstream->host.len);
+    ngx_pq_query_t *query = plcf->queries.elts;
+    for (ngx_uint_t i = 0; i < plcf->queries.nelts; i++) {
+        ngx_md5_update(&md5, &query[i].type, sizeof(query[i].type));
+        ngx_md5_update(&md5, &query[i].output, sizeof(query[i].output));
+        ngx_md5_update(&md5, &query[i].header, sizeof(query[i].header));
+        ngx_md5_update(&md5, &query[i].string, sizeof(query[i].string));
+        ngx_md5_update(&md5, &query[i].resultFormat, sizeof(query[i].resultFormat));
+        ngx_md5_update(&md5, &query[i].delimiter, sizeof(query[i].delimiter));
+        ngx_md5_update(&md5, &query[i].escape, sizeof(query[i].escape));
+        ngx_md5_update(&md5, &query[i].quote, sizeof(query[i].quote));
+        ngx_pq_cache_md5(&md5, query[i].null.data, query[i].null.len);
+        if (query[i].name.complex.value.data) {
+            if (ngx_http_complex_value(r, &query[i].name.complex, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+            ngx_pq_cache_md5(&md5, value.data, value.len);
+        } else ngx_pq_cache_md5(&md5, query[i].name.str.data, query[i].name.str.len);
+        ngx_pq_command_t *command = query[i].commands.elts;
+        for (ngx_uint_t j = 0; j < query[i].commands.nelts; j++) if (command[j].index) {
+            ngx_http_variable_value_t *v;
+            if (!(v = ngx_http_get_indexed_variable(r, command[j].index))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_http_get_indexed_variable"); return NGX_ERROR; }
+            ngx_pq_cache_md5(&md5, v->data, v->len);
+        } else ngx_pq_cache_md5(&md5, command[j].str.data, command[j].str.len);
+        ngx_pq_argument_t *argument = query[i].arguments.elts;
+        for (ngx_uint_t j = 0; j < query[i].arguments.nelts; j++) {
+            if (argument[j].oid.complex.value.data) {
+                if (ngx_http_complex_value(r, &argument[j].oid.complex, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+                ngx_pq_cache_md5(&md5, value.data, value.len);
+            } else ngx_md5_update(&md5, &argument[j].oid.value, sizeof(argument[j].oid.value));
+            if (argument[j].value.complex.value.data) {
+                if (ngx_http_complex_value(r, &argument[j].value.complex, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return NGX_ERROR; }
+                ngx_pq_cache_md5(&md5, value.data, value.len);
+            } else ngx_pq_cache_md5(&md5, argument[j].value.str.data, argument[j].value.str.len);
+        }
+    }
+    ngx_md5_final(key, &md5);
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_send_buf(ngx_http_request_t *r, ngx_buf_t *b) {
+    if (r->headers_out.content_length_n && !b) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_create_temp_buf"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+    if (!b) return ngx_http_send_special(r, NGX_HTTP_LAST);
+    b->last_buf = (r == r->main);
+    b->last_in_chain = 1;
+    ngx_chain_t out = {b, NULL};
+    return ngx_http_output_filter(r, &out);
+}
+static ngx_int_t ngx_pq_cache_get(ngx_http_request_t *r, ngx_pq_loc_conf_t *plcf) {
+    ngx_pq_cache_zone_t *ctx = plcf->cache.zone->data;
+    ngx_pq_data_t *d;
+    if (!(d = ngx_pcalloc(r->pool, sizeof(*d)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (ngx_pq_cache_key(r, plcf, d->cache.key) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_http_set_ctx(r, d, ngx_pq_module);
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_pq_cache_node_t *cn = ngx_pq_cache_lookup(ctx->sh, d->cache.key);
+    if (cn && (cn->expire <= ngx_time() || cn->generation != ctx->sh->generation)) { ngx_pq_cache_delete(ctx, cn); cn = NULL; }
+    if (!cn) {
+        d->cache.generation = ctx->sh->generation;
+        d->cache.on = 1;
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "pq cache miss");
+        return NGX_DECLINED;
+    }
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+    ngx_buf_t *b = NULL;
+    if (cn->len && (b = ngx_create_temp_buf(r->pool, cn->len))) b->last = ngx_copy(b->last, cn->data, cn->len);
+    r->headers_out.status = cn->status;
+    r->headers_out.content_length_n = cn->len;
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "pq cache hit");
+    return ngx_pq_send_buf(r, b);
+}
+static void ngx_pq_cache_set(ngx_http_request_t *r, ngx_pq_data_t *d) {
+    ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+    ngx_pq_cache_zone_t *ctx = plcf->cache.zone->data;
+    ngx_http_upstream_t *u = r->upstream;
+    size_t len = r->headers_out.content_length_n;
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    if (d->cache.generation != ctx->sh->generation) goto unlock;
+    ngx_pq_cache_node_t *cn = ngx_pq_cache_lookup(ctx->sh, d->cache.key);
+    if (cn) ngx_pq_cache_delete(ctx, cn);
+    for (ngx_uint_t i = 0; i < 2 && !ngx_queue_empty(&ctx->sh->queue); i++) {
+        cn = ngx_queue_data(ngx_queue_last(&ctx->sh->queue), ngx_pq_cache_node_t, queue);
+        if (cn->expire > ngx_time() && cn->generation == ctx->sh->generation) break;
+        ngx_pq_cache_delete(ctx, cn);
+    }
+    while (!(cn = ngx_slab_alloc_locked(ctx->shpool, offsetof(ngx_pq_cache_node_t, data) + len))) {
+        if (ngx_queue_empty(&ctx->sh->queue)) { ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "response of %uz bytes does not fit in pq_cache zone \"%V\"", len, &plcf->cache.zone->shm.name); goto unlock; }
+        ngx_pq_cache_delete(ctx, ngx_queue_data(ngx_queue_last(&ctx->sh->queue), ngx_pq_cache_node_t, queue));
+    }
+    ngx_memcpy(cn->key, d->cache.key, sizeof(cn->key));
+    ngx_memcpy(&cn->node.key, cn->key, sizeof(cn->node.key));
+    cn->expire = ngx_time() + plcf->cache.ttl;
+    cn->generation = d->cache.generation;
+    cn->len = len;
+    cn->status = r->headers_out.status;
+    u_char *p = cn->data;
+    for (ngx_chain_t *cl = u->out_bufs; cl; cl = cl->next) p = ngx_copy(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    ngx_rbtree_insert(&ctx->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+unlock:
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+static void ngx_pq_cache_invalidate(ngx_log_t *log, ngx_str_t *channel) {
+    ngx_pq_main_conf_t *pmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_pq_module);
+    if (!pmcf) return;
+    ngx_shm_zone_t **zone = pmcf->caches.elts;
+    for (ngx_uint_t i = 0; i < pmcf->caches.nelts; i++) {
+        ngx_pq_cache_zone_t *ctx = zone[i]->data;
+        if (ctx->channel.len != channel->len || ngx_strncmp(ctx->channel.data, channel->data, channel->len)) continue;
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "invalidate pq_cache zone \"%V\" on channel \"%V\"", &zone[i]->shm.name, channel);
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ctx->sh->generation++;
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
+}
+static ngx_int_t ngx_pq_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_pq_cache_zone_t *octx = data;
+    ngx_pq_cache_zone_t *ctx = shm_zone->data;
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return NGX_OK;
+    }
+    ctx->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+        return NGX_OK;
+    }
+    if (!(ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(*ctx->sh)))) { ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "!ngx_slab_alloc"); return NGX_ERROR; }
+    ctx->shpool->data = ctx->sh;
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel, ngx_pq_cache_rbtree_insert_value);
+    ngx_queue_init(&ctx->sh->queue);
+    ctx->sh->generation = 0;
+    size_t len = sizeof(" in pq_cache zone \"\"") + shm_zone->shm.name.len;
+    if (!(ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len))) { ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "!ngx_slab_alloc"); return NGX_ERROR; }
+    (void)ngx_sprintf(ctx->shpool->log_ctx, " in pq_cache zone \"%V\"%Z", &shm_zone->shm.name);
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_upstream(ngx_http_request_t *r);
+static ngx_int_t ngx_pq_coalesce_send(ngx_http_request_t *r, ngx_http_request_t *w) {
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_buf_t *b = NULL;
+    w->headers_out.status = r->headers_out.status;
+    w->headers_out.content_length_n = r->headers_out.content_length_n;
+    if (r->headers_out.content_length_n && (b = ngx_create_temp_buf(w->pool, r->headers_out.content_length_n))) for (ngx_chain_t *cl = u->out_bufs; cl; cl = cl->next) b->last = ngx_copy(b->last, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    return ngx_pq_send_buf(w, b);
+}
+static void ngx_pq_coalesce_done(ngx_http_request_t *r, ngx_pq_data_t *d, ngx_int_t rc) {
+    if (!d->coalesce.on) return;
+    ngx_pq_main_conf_t *pmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_pq_module);
+    ngx_rbtree_delete(&pmcf->coalesce.rbtree, &d->coalesce.node.node);
+    d->coalesce.on = 0;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "rc = %i", rc);
+    if (ngx_queue_empty(&d->coalesce.waiters)) return;
+    if (rc != NGX_OK && (rc < NGX_HTTP_SPECIAL_RESPONSE || rc == NGX_HTTP_CLIENT_CLOSED_REQUEST)) {
+        ngx_queue_t *q = ngx_queue_head(&d->coalesce.waiters);
+        ngx_queue_remove(q);
+        ngx_pq_data_t *w = ngx_queue_data(q, ngx_pq_data_t, coalesce.queue);
+        ngx_http_request_t *wr = w->request;
+        ngx_connection_t *c = wr->connection;
+        ngx_queue_init(&w->coalesce.waiters);
+        if (!ngx_queue_empty(&d->coalesce.waiters)) {
+            ngx_queue_add(&w->coalesce.waiters, &d->coalesce.waiters);
+            ngx_queue_init(&d->coalesce.waiters);
+        }
+        for (q = ngx_queue_head(&w->coalesce.waiters); q != ngx_queue_sentinel(&w->coalesce.waiters); q = ngx_queue_next(q)) {
+            ngx_pq_data_t *waiter = ngx_queue_data(q, ngx_pq_data_t, coalesce.queue);
+            waiter->coalesce.leader = wr;
+        }
+        w->coalesce.leader = NULL;
+        w->coalesce.node.node.key = d->coalesce.node.node.key;
+        w->coalesce.node.str.data = w->cache.key;
+        w->coalesce.node.str.len = sizeof(w->cache.key);
+        w->coalesce.on = 1;
+        ngx_rbtree_insert(&pmcf->coalesce.rbtree, &w->coalesce.node.node);
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "pq coalesce promote");
+        ngx_http_finalize_request(wr, ngx_pq_upstream(wr));
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+    while (!ngx_queue_empty(&d->coalesce.waiters)) {
+        ngx_queue_t *q = ngx_queue_head(&d->coalesce.waiters);
+        ngx_queue_remove(q);
+        ngx_pq_data_t *w = ngx_queue_data(q, ngx_pq_data_t, coalesce.queue);
+        ngx_http_request_t *wr = w->request;
+        ngx_connection_t *c = wr->connection;
+        w->coalesce.leader = NULL;
+        ngx_http_finalize_request(wr, rc == NGX_OK ? ngx_pq_coalesce_send(r, wr) : rc);
+        ngx_http_run_posted_requests(c);
+    }
+}
+static void ngx_pq_coalesce_cln_handler(void *data) {
+    ngx_pq_data_t *d = data;
+    if (d->coalesce.leader) {
+        ngx_queue_remove(&d->coalesce.queue);
+        d->coalesce.leader = NULL;
+    }
+    ngx_pq_coalesce_done(d->request, d, NGX_ERROR);
+}
+static ngx_int_t ngx_pq_coalesce(ngx_http_request_t *r, ngx_pq_loc_conf_t *plcf) {
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    if (!d) {
+        if (!(d = ngx_pcalloc(r->pool, sizeof(*d)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        if (ngx_pq_cache_key(r, plcf, d->cache.key) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_http_set_ctx(r, d, ngx_pq_module);
+    }
+    d->request = r;
+    ngx_http_cleanup_t *cln;
+    if (!(cln = ngx_http_cleanup_add(r, 0))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_http_cleanup_add"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    cln->data = d;
+    cln->handler = ngx_pq_coalesce_cln_handler;
+    ngx_pq_main_conf_t *pmcf = ngx_http_get_module_main_conf(r, ngx_pq_module);
+    ngx_str_t key = {sizeof(d->cache.key), d->cache.key};
+    uint32_t hash;
+    ngx_memcpy(&hash, key.data, sizeof(hash));
+    ngx_str_node_t *sn = ngx_str_rbtree_lookup(&pmcf->coalesce.rbtree, &key, hash);
+    if (sn) {
+        ngx_pq_data_t *leader = (ngx_pq_data_t *)((u_char *)sn - offsetof(ngx_pq_data_t, coalesce.node));
+        if (ngx_http_get_module_loc_conf(leader->request, ngx_pq_module) != plcf) return NGX_DECLINED;
+        d->coalesce.leader = leader->request;
+        ngx_queue_insert_tail(&leader->coalesce.waiters, &d->coalesce.queue);
+        r->main->count++;
+        r->read_event_handler = ngx_http_test_reading;
+        r->write_event_handler = ngx_http_request_empty_handler;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "pq coalesce wait");
+        return NGX_DONE;
+    }
+    d->coalesce.node.node.key = hash;
+    d->coalesce.node.str = key;
+    d->coalesce.on = 1;
+    ngx_queue_init(&d->coalesce.waiters);
+    ngx_rbtree_insert(&pmcf->coalesce.rbtree, &d->coalesce.node.node);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "pq coalesce lead");
+    return NGX_DECLINED;
+}
+static ngx_int_t ngx_pq_notify(ngx_pq_save_t *s) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%s", __func__);
+    ngx_int_t rc = NGX_OK;
+    ngx_pool_t *p;
+#ifdef LIBPQ_HAS_PIPELINING
+    ngx_flag_t sync = 0;
+#endif
+    for (PGnotify *notify; (notify = PQnotifies(s->conn)); PQfreemem(notify)) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "relname=%s, extra=%s, be_pid=%i", notify->relname, notify->extra, notify->be_pid);
+        ngx_str_t id = { ngx_strlen(notify->relname), (u_char *)notify->relname };
+        ngx_pq_cache_invalidate(s->connection->log, &id);
+        if (!ngx_http_push_stream_add_msg_to_channel_my) continue;
+        ngx_str_t text = { ngx_strlen(notify->extra), (u_char *)notify->extra };
+        if (!(p = ngx_create_pool(4096 + id.len + text.len, s->connection->log))) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "!ngx_create_pool"); rc = NGX_ERROR; continue; }
+        if (rc == NGX_OK) switch ((rc = ngx_http_push_stream_add_msg_to_channel_my(s->connection->log, &id, &text, NULL, NULL, 1, p))) {
+            case NGX_ERROR: ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_ERROR"); break;
+            case NGX_DECLINED: ngx_log_error(NGX_LOG_WARN, s->connection->log, 0, "ngx_http_push_stream_add_msg_to_channel_my == NGX_DECLINED"); {
+                for (ngx_queue_t *q = ngx_queue_head(&s->queue), *_; q != ngx_queue_sentinel(&s->queue) && (_ = ngx_queue_next(q)); q = _) {
+                    ngx_pq_channel_queue_t *cq = ngx_queue_data(q, ngx_pq_channel_queue_t, queue);
+                    if (cq->channel.len != id.len || ngx_strncmp(cq->channel.data, id.data, id.len)) continue;
+                    ngx_queue_remove(q);
+                    break;
+                }
+#ifdef LIBPQ_HAS_PIPELINING
+                if (PQpipelineStatus(s->conn) == PQ_PIPELINE_OFF) {
+                    if (!PQenterPipelineMode(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQenterPipelineMode"); rc = NGX_ERROR; goto destroy; }
+                    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQenterPipelineMode");
+                }
+                if (s->multiplex.pscf && !sync && !ngx_pq_multiplex_slot(s, NULL, 0)) { rc = NGX_ERROR; goto destroy; }
+                sync = 1;
+#endif
+                PQExpBufferData sql;
+                initPQExpBuffer(&sql);
+                appendPQExpBufferStr(&sql, "UNLISTEN ");
+                char *str;
+                if (!(str = PQescapeIdentifier(s->conn, (char *)id.data, id.len))) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQescapeIdentifier"); rc = NGX_ERROR; goto term; }
+                appendPQExpBufferStr(&sql, str);
+                PQfreemem(str);
+                if (PQExpBufferDataBroken(sql)) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "PQExpBufferDataBroken"); rc = NGX_ERROR; goto term; }
+                if (!PQsendQueryParams(s->conn, sql.data, 0, NULL, NULL, NULL, NULL, 0)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQsendQueryParams"); rc = NGX_ERROR; goto term; }
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQsendQueryParams('%s')", sql.data);
+                if (!s->multiplex.pscf) s->count++;
+                rc = NGX_OK;
 term:
                 termPQExpBuffer(&sql);
             } break;
@@ -477,13 +1950,84 @@ destroy:
         ngx_destroy_pool(p);
     }
 #ifdef LIBPQ_HAS_PIPELINING
-    if (PQpipelineStatus(s->conn) == PQ_PIPELINE_ON) {
+    if (sync && PQpipelineStatus(s->conn) == PQ_PIPELINE_ON) {
         if (!PQpipelineSync(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, s->connection->log, 0, PQerrorMessage(s->conn), "!PQpipelineSync"); rc = NGX_ERROR; }
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "PQpipelineSync");
     }
 #endif
     return rc;
 }
+static ngx_int_t ngx_pq_argument_binary(ngx_pool_t *pool, Oid oid, ngx_str_t *value, ngx_str_t *binary) {
+    u_char *data = value->data;
+    size_t len = value->len;
+    uint64_t u = 0;
+    size_t size;
+    switch (oid) {
+        case ngx_pq_oid_bytea: {
+            *binary = *value;
+            if (!binary->data) binary->data = (u_char *)"";
+        } return NGX_OK;
+        case ngx_pq_oid_bool: {
+            static const ngx_conf_enum_t e[] = { { ngx_string("f"), 0 }, { ngx_string("false"), 0 }, { ngx_string("n"), 0 }, { ngx_string("no"), 0 }, { ngx_string("off"), 0 }, { ngx_string("0"), 0 }, { ngx_string("t"), 1 }, { ngx_string("true"), 1 }, { ngx_string("y"), 1 }, { ngx_string("yes"), 1 }, { ngx_string("on"), 1 }, { ngx_string("1"), 1 }, { ngx_null_string, 0 } };
+            ngx_uint_t j;
+            for (j = 0; e[j].name.len; j++) if (e[j].name.len == len && !ngx_strncasecmp(e[j].name.data, data, len)) break;
+            if (!e[j].name.len) return NGX_ERROR;
+            u = e[j].value;
+            size = 1;
+        } break;
+        case ngx_pq_oid_int2: case ngx_pq_oid_int4: case ngx_pq_oid_int8: case ngx_pq_oid_oid: {
+            size = oid == ngx_pq_oid_int2 ? 2 : oid == ngx_pq_oid_int8 ? 8 : 4;
+            ngx_flag_t minus = len && *data == '-';
+            if (minus || (len && *data == '+')) { data++; len--; }
+            if (!len) return NGX_ERROR;
+            uint64_t max = oid == ngx_pq_oid_oid ? UINT32_MAX : oid == ngx_pq_oid_int2 ? (uint64_t)INT16_MAX + minus : oid == ngx_pq_oid_int4 ? (uint64_t)INT32_MAX + minus : (uint64_t)INT64_MAX + minus;
+            if (minus && oid == ngx_pq_oid_oid) return NGX_ERROR;
+            for (; len; data++, len--) {
+                if (*data < '0' || *data > '9') return NGX_ERROR;
+                if (u > (max - (*data - '0')) / 10) return NGX_ERROR;
+                u = u * 10 + (*data - '0');
+            }
+            if (minus) u = -u;
+        } break;
+        case ngx_pq_oid_float4: case ngx_pq_oid_float8: {
+            char buf[64], *end;
+            if (!len || len >= sizeof(buf)) return NGX_ERROR;
+            ngx_memcpy(buf, data, len);
+            buf[len] = '\0';
+            if (oid == ngx_pq_oid_float4) {
+                float f = strtof(buf, &end);
+                uint32_t u32;
+                ngx_memcpy(&u32, &f, sizeof(u32));
+                u = u32;
+                size = 4;
+            } else {
+                double f = strtod(buf, &end);
+                ngx_memcpy(&u, &f, sizeof(u));
+                size = 8;
+            }
+            if (end != buf + len) return NGX_ERROR;
+        } break;
+        case ngx_pq_oid_uuid: {
+            u_char *p;
+            if (!(p = binary->data = ngx_pnalloc(pool, 16))) return NGX_ERROR;
+            binary->len = 16;
+            for (ngx_uint_t n = 0; n < 32; n++) {
+                if (len && *data == '-' && n && !(n % 4)) { data++; len--; }
+                if (!len) return NGX_ERROR;
+                ngx_int_t x = ngx_hextoi(data++, 1);
+                len--;
+                if (x == NGX_ERROR) return NGX_ERROR;
+                if (n % 2) *p++ |= x; else *p = x << 4;
+            }
+            if (len) return NGX_ERROR;
+        } return NGX_OK;
+        default: return NGX_ERROR;
+    }
+    if (!(binary->data = ngx_pnalloc(pool, size))) return NGX_ERROR;
+    binary->len = size;
+    for (u_char *p = binary->data + size; p > binary->data; u >>= 8) *--p = (u_char)u;
+    return NGX_OK;
+}
 static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t type) {
     ngx_http_request_t *r = d->request;
     ngx_http_upstream_t *u = r->upstream;
@@ -492,10 +2036,9 @@ static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t t
     if (c->read->timer_set) ngx_del_timer(c->read);
     if (c->write->timer_set) ngx_del_timer(c->write);
     ngx_int_t rc = NGX_ERROR;
-    PQExpBufferData name;
-    PQExpBufferData sql;
-    initPQExpBuffer(&name);
-    initPQExpBuffer(&sql);
+    if (!s->multiplex.pscf) s->rc = NGX_OK;
+    PQExpBufferData name = {0};
+    PQExpBufferData sql = {0};
     ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
     ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
     ngx_array_t *queries = &plcf->queries;
@@ -503,23 +2046,55 @@ static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t t
         ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
         if (pscf->queries.elts) queries = &pscf->queries;
     }
+    ngx_uint_t start = d->copy.next, end = queries->nelts;
+    d->copy.next = 0;
+    if (queries != &plcf->queries && !start) ngx_pq_variables_reset(s);
     if (!queries->nelts) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!queries->nelts"); goto ret; }
+    ngx_pq_query_t *query = queries->elts;
+    /* backend accepts only copy data until COPY FROM STDIN ends, so it is sent alone outside of pipeline and next queries after its result */
+    ngx_flag_t copy = !s->multiplex.pscf && query[start].copy;
+    if (copy) end = start + 1;
+    else if (!s->multiplex.pscf) for (ngx_uint_t i = start + 1; i < end; i++) if (query[i].copy) { end = i; break; }
+    if (end < queries->nelts) {
+        d->copy.next = end;
+        d->copy.type = type;
+    }
 #ifdef LIBPQ_HAS_PIPELINING
-    if (queries->nelts > 1 && PQpipelineStatus(s->conn) == PQ_PIPELINE_OFF) {
+    ngx_flag_t pipeline = !copy && (s->multiplex.pscf || end - start > 1 || !ngx_queue_empty(&s->statements.deallocate));
+    for (ngx_uint_t i = start; !pipeline && !copy && i < end; i++) pipeline = query[i].cache;
+    if (pipeline && PQpipelineStatus(s->conn) == PQ_PIPELINE_OFF) {
         if (!PQenterPipelineMode(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQenterPipelineMode"); goto ret; }
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQenterPipelineMode");
     }
+    if (pipeline && !ngx_queue_empty(&s->statements.deallocate) && (rc = ngx_pq_statement_deallocate(s)) != NGX_OK) goto ret;
+    rc = NGX_ERROR;
+    if (s->multiplex.pscf && !ngx_pq_multiplex_slot(s, d, queries != &plcf->queries)) goto ret;
 #endif
-    ngx_pq_query_t *query = queries->elts;
-    for (ngx_uint_t i = 0; i < queries->nelts; i++) {
-        ngx_pq_query_queue_t *qq;
-        if (!(qq = ngx_pcalloc(r->pool, sizeof(*qq)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pcalloc"); goto ret; }
+    size_t size = 0;
+    for (ngx_uint_t i = start; i < end; i++) size += query[i].size;
+    u_char *arena;
+    if (!(arena = ngx_pcalloc(r->pool, size))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pcalloc"); goto ret; }
+    for (ngx_uint_t i = start; i < end; i++) {
+        ngx_uint_t nelts = query[i].arguments.nelts;
+        ngx_pq_query_queue_t *qq = (ngx_pq_query_queue_t *)arena;
+        arena += ngx_align(sizeof(*qq), NGX_ALIGNMENT);
+        qq->paramValues = (const char **)arena;
+        arena += ngx_align(nelts * sizeof(*qq->paramValues), NGX_ALIGNMENT);
+        qq->paramTypes = (Oid *)arena;
+        arena += ngx_align(nelts * sizeof(*qq->paramTypes), NGX_ALIGNMENT);
+        int *paramFormats = NULL;
+        int *paramLengths = NULL;
+        if (query[i].binary) {
+            paramFormats = (int *)arena;
+            arena += ngx_align(nelts * sizeof(*paramFormats), NGX_ALIGNMENT);
+            paramLengths = (int *)arena;
+            arena += ngx_align(nelts * sizeof(*paramLengths), NGX_ALIGNMENT);
+        }
         qq->query = &query[i];
         ngx_queue_insert_tail(&d->queue, &qq->queue);
         ngx_pq_argument_t *argument = query[i].arguments.elts;
-        if (!(qq->paramTypes = ngx_pcalloc(r->pool, query[i].arguments.nelts * sizeof(*qq->paramTypes)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pcalloc"); goto ret; }
-        if (!(qq->paramValues = ngx_pcalloc(r->pool, query[i].arguments.nelts * sizeof(*qq->paramValues)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pcalloc"); goto ret; }
-        for (ngx_uint_t j = 0; j < query[i].arguments.nelts; j++) {
+        size_t len = 0;
+        for (ngx_uint_t j = 0; j < nelts; j++) {
             if (query[i].type & (ngx_pq_type_query|ngx_pq_type_prepare)) {
                 if (argument[j].oid.complex.value.data) {
                     ngx_str_t value;
@@ -536,24 +2111,64 @@ static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t t
                     if (ngx_http_complex_value(r, &argument[j].value.complex, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_complex_value != NGX_OK"); goto ret; }
                     argument[j].value.str = value;
                 }
-                if (!(qq->paramValues[j] = ngx_pnalloc(r->pool, argument[j].value.str.len + 1))) { ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "!ngx_pnalloc"); goto ret; }
-                (void)ngx_cpystrn((u_char *)qq->paramValues[j], argument[j].value.str.data, argument[j].value.str.len + 1);
+                if (argument[j].binary) {
+                    ngx_str_t value = argument[j].value.str;
+                    if (argument[j].value.complex.value.data && ngx_pq_argument_binary(r->pool, argument[j].oid.value, &value, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_pq_argument_binary != NGX_OK"); goto ret; }
+                    qq->paramValues[j] = (const char *)value.data;
+                    paramLengths[j] = value.len;
+                    paramFormats[j] = 1;
+                    continue;
+                }
+                if (argument[j].value.complex.value.data) len += argument[j].value.str.len + 1;
+                else qq->paramValues[j] = (const char *)argument[j].value.str.data;
             }
         }
-        resetPQExpBuffer(&sql);
-        ngx_pq_command_t *command = query[i].commands.elts;
-        for (ngx_uint_t j = 0; j < query[i].commands.nelts; j++) if (command[j].index) {
-            char *str;
-            ngx_http_variable_value_t *value;
-            if (!(value = ngx_http_get_indexed_variable(r, command[j].index))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_http_get_indexed_variable"); goto ret; }
-            if (!(str = PQescapeIdentifier(s->conn, (char *)value->data, value->len))) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQescapeIdentifier"); goto ret; }
-            appendPQExpBufferStr(&sql, str);
-            PQfreemem(str);
-        } else appendBinaryPQExpBuffer(&sql, (char *)command[j].str.data, command[j].str.len);
-        if (PQExpBufferDataBroken(sql)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "PQExpBufferDataBroken"); goto ret; }
+        if (len) {
+            u_char *p;
+            if (!(p = ngx_pnalloc(r->pool, len))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pnalloc"); goto ret; }
+            for (ngx_uint_t j = 0; j < nelts; j++) if (argument[j].value.complex.value.data && !argument[j].binary) {
+                qq->paramValues[j] = (const char *)p;
+                p = ngx_cpymem(p, argument[j].value.str.data, argument[j].value.str.len);
+                *p++ = '\0';
+            }
+        }
+        char *text = (char *)query[i].sql.data;
+        if (!text && query[i].commands.nelts) {
+            if (sql.data) resetPQExpBuffer(&sql); else initPQExpBuffer(&sql);
+            ngx_pq_command_t *command = query[i].commands.elts;
+            for (ngx_uint_t j = 0; j < query[i].commands.nelts; j++) if (command[j].index) {
+                char *str;
+                ngx_http_variable_value_t *value;
+                if (!(value = ngx_http_get_indexed_variable(r, command[j].index))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_http_get_indexed_variable"); goto ret; }
+                if (!(str = PQescapeIdentifier(s->conn, (char *)value->data, value->len))) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQescapeIdentifier"); goto ret; }
+                appendPQExpBufferStr(&sql, str);
+                PQfreemem(str);
+            } else appendBinaryPQExpBuffer(&sql, (char *)command[j].str.data, command[j].str.len);
+            if (PQExpBufferDataBroken(sql)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "PQExpBufferDataBroken"); goto ret; }
+            text = sql.data;
+        }
         if (query[i].type & ngx_pq_type_query) {
-            if (!PQsendQueryParams(s->conn, sql.data, query[i].arguments.nelts, qq->paramTypes, qq->paramValues, NULL, NULL, query->output == ngx_pq_output_binary)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryParams"); rc = NGX_DECLINED; goto ret; }
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryParams('%s')", sql.data);
+            ngx_flag_t prepare = 0;
+            ngx_pq_statement_t *statement = NULL;
+#ifdef LIBPQ_HAS_PIPELINING
+            if (query[i].cache && !copy) statement = ngx_pq_statement_get(s, text, query[i].arguments.nelts, qq->paramTypes, &prepare);
+#endif
+            if (prepare) {
+                ngx_pq_query_queue_t *pq;
+                if (!(pq = ngx_pcalloc(r->pool, sizeof(*pq)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pcalloc"); goto ret; }
+                pq->query = &query[i];
+                pq->statement = statement;
+                ngx_queue_insert_tail(&qq->queue, &pq->queue);
+                if (!PQsendPrepare(s->conn, (char *)statement->name, text, query[i].arguments.nelts, qq->paramTypes)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendPrepare"); rc = NGX_DECLINED; goto ret; }
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendPrepare('%s', '%s')", statement->name, text);
+            }
+            if (statement) {
+                if (!PQsendQueryPrepared(s->conn, (char *)statement->name, query[i].arguments.nelts, qq->paramValues, paramLengths, paramFormats, query[i].resultFormat)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryPrepared"); rc = NGX_DECLINED; goto ret; }
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryPrepared('%s')", statement->name);
+            } else {
+                if (!PQsendQueryParams(s->conn, text, query[i].arguments.nelts, qq->paramTypes, qq->paramValues, paramLengths, paramFormats, query[i].resultFormat)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryParams"); rc = NGX_DECLINED; goto ret; }
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryParams('%s')", text);
+            }
 #ifdef LIBPQ_HAS_CHUNK_MODE
             if (query[i].chunkSize > 0) {
                 if (!PQsetChunkedRowsMode(s->conn, query[i].chunkSize)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsetChunkedRowsMode"); rc = NGX_DECLINED; goto ret; }
@@ -561,19 +2176,21 @@ static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t t
             }
 #endif
         } else {
-            resetPQExpBuffer(&name);
+            char *statement_name = (char *)query[i].name.str.data;
             if (query[i].name.complex.value.data) {
                 ngx_str_t value;
                 if (ngx_http_complex_value(r, &query[i].name.complex, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_complex_value != NGX_OK"); goto ret; }
+                if (name.data) resetPQExpBuffer(&name); else initPQExpBuffer(&name);
                 appendBinaryPQExpBuffer(&name, (char *)value.data, value.len);
-            } else appendBinaryPQExpBuffer(&name, (char *)query[i].name.str.data, query[i].name.str.len);
-            if (PQExpBufferDataBroken(name)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "PQExpBufferDataBroken"); goto ret; }
+                if (PQExpBufferDataBroken(name)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "PQExpBufferDataBroken"); goto ret; }
+                statement_name = name.data;
+            }
             if (query[i].type & ngx_pq_type_prepare) {
-                if (!PQsendPrepare(s->conn, name.data, sql.data, query[i].arguments.nelts, qq->paramTypes)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendPrepare"); rc = NGX_DECLINED; goto ret; }
-                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendPrepare('%s', '%s')", name.data, sql.data);
+                if (!PQsendPrepare(s->conn, statement_name, text, query[i].arguments.nelts, qq->paramTypes)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendPrepare"); rc = NGX_DECLINED; goto ret; }
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendPrepare('%s', '%s')", statement_name, text);
             } else if (query[i].type & ngx_pq_type_execute) {
-                if (!PQsendQueryPrepared(s->conn, name.data, query[i].arguments.nelts, qq->paramValues, NULL, NULL, query->output == ngx_pq_output_binary)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryPrepared"); rc = NGX_DECLINED; goto ret; }
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryPrepared('%s')", name.data);
+                if (!PQsendQueryPrepared(s->conn, statement_name, query[i].arguments.nelts, qq->paramValues, paramLengths, paramFormats, query[i].resultFormat)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryPrepared"); rc = NGX_DECLINED; goto ret; }
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryPrepared('%s')", statement_name);
 #ifdef LIBPQ_HAS_CHUNK_MODE
                 if (query[i].chunkSize > 0) {
                     if (!PQsetChunkedRowsMode(s->conn, query[i].chunkSize)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsetChunkedRowsMode"); rc = NGX_DECLINED; goto ret; }
@@ -584,7 +2201,7 @@ static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t t
         }
     }
 #ifdef LIBPQ_HAS_PIPELINING
-    if (queries->nelts > 1 && PQpipelineStatus(s->conn) == PQ_PIPELINE_ON) {
+    if (pipeline && PQpipelineStatus(s->conn) == PQ_PIPELINE_ON) {
         if (!PQpipelineSync(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQpipelineSync"); goto ret; }
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQpipelineSync");
     }
@@ -595,6 +2212,11 @@ static ngx_int_t ngx_pq_queries(ngx_pq_save_t *s, ngx_pq_data_t *d, ngx_uint_t t
         case 1: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQflush == 1"); c->write->active = 1; break;
         case -1: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); goto ret;
     }
+    if (d->balance.stat && !d->balance.sent) {
+        d->balance.end = 0;
+        d->balance.sent = 1;
+        d->balance.start = ngx_current_msec;
+    }
     rc = NGX_AGAIN;
 ret:
     termPQExpBuffer(&name);
@@ -603,6 +2225,103 @@ ret:
     return rc;
 }
 
+static ngx_atomic_uint_t ngx_pq_stat_now(void) {
+    ngx_time_t *tp = ngx_timeofday();
+    return (ngx_atomic_uint_t)tp->sec * 1000 + tp->msec;
+}
+static ngx_uint_t ngx_pq_breaker_state(ngx_pq_srv_conf_t *pscf, ngx_pq_stat_t *stat, ngx_atomic_uint_t now) {
+    if (stat->state == ngx_pq_breaker_open && now - stat->opened >= pscf->breaker.open) (void)ngx_atomic_cmp_set(&stat->state, ngx_pq_breaker_open, ngx_pq_breaker_half_open);
+    return stat->state;
+}
+static ngx_flag_t ngx_pq_breaker_blocked(ngx_pq_srv_conf_t *pscf, ngx_pq_stat_t *stat, ngx_atomic_uint_t now) {
+    switch (ngx_pq_breaker_state(pscf, stat, now)) {
+        case ngx_pq_breaker_open: return 1;
+        case ngx_pq_breaker_half_open: return stat->probes >= pscf->breaker.probes;
+        default: return 0;
+    }
+}
+static void ngx_pq_breaker_done(ngx_pq_data_t *d, ngx_flag_t ok) {
+    ngx_pq_stat_t *stat = d->breaker.stat;
+    if (!stat) return;
+    d->breaker.stat = NULL;
+    ngx_pq_srv_conf_t *pscf = d->breaker.pscf;
+    ngx_log_t *log = d->request->connection->log;
+    ngx_atomic_uint_t now = ngx_pq_stat_now();
+    ngx_flag_t failed = !ok || (pscf->breaker.latency && now - d->breaker.start >= pscf->breaker.latency);
+    if (d->breaker.probe) {
+        (void)ngx_atomic_fetch_add(&stat->probes, -1);
+        if (failed) {
+            stat->opened = now;
+            if (ngx_atomic_cmp_set(&stat->state, ngx_pq_breaker_half_open, ngx_pq_breaker_open)) ngx_log_error(NGX_LOG_WARN, log, 0, "%V circuit breaker reopened", d->breaker.name);
+        } else if (ngx_atomic_cmp_set(&stat->state, ngx_pq_breaker_half_open, ngx_pq_breaker_closed)) {
+            stat->errors = 0;
+            stat->requests = 0;
+            stat->window = now;
+            ngx_log_error(NGX_LOG_NOTICE, log, 0, "%V circuit breaker closed", d->breaker.name);
+        }
+        return;
+    }
+    if (stat->state != ngx_pq_breaker_closed) return;
+    if (now - stat->window >= pscf->breaker.window) {
+        stat->window = now;
+        stat->errors = 0;
+        stat->requests = 0;
+    }
+    ngx_atomic_uint_t requests = ngx_atomic_fetch_add(&stat->requests, 1) + 1;
+    ngx_atomic_uint_t errors = failed ? ngx_atomic_fetch_add(&stat->errors, 1) + 1 : stat->errors;
+    if (requests < pscf->breaker.min || errors * 100 < requests * pscf->breaker.errors) return;
+    stat->opened = now;
+    if (ngx_atomic_cmp_set(&stat->state, ngx_pq_breaker_closed, ngx_pq_breaker_open)) ngx_log_error(NGX_LOG_WARN, log, 0, "%V circuit breaker opened, %uA of %uA requests failed", d->breaker.name, errors, requests);
+}
+static void ngx_pq_balance_done(ngx_pq_data_t *d, ngx_flag_t ok) {
+    ngx_pq_stat_t *stat = d->balance.stat;
+    if (!stat) return;
+    d->balance.stat = NULL;
+    (void)ngx_atomic_fetch_add(&stat->queries, -1);
+    if (!d->balance.sent) return;
+    /* latency is kept in 1/16 ms as 7/8 moving average, failed statements may only raise it */
+    ngx_atomic_uint_t latency = (ngx_atomic_uint_t)((d->balance.end ? d->balance.end : ngx_current_msec) - d->balance.start) << 4, average = stat->latency;
+    if (!ok && latency <= average) return;
+    stat->latency = average ? average - average / 8 + latency / 8 : latency;
+}
+static uint64_t ngx_pq_lsn_parse(const u_char *data, size_t len) {
+    const u_char *p = ngx_strlchr((u_char *)data, (u_char *)data + len, '/');
+    if (!p) return 0;
+    ngx_int_t hi = ngx_hextoi((u_char *)data, p - data);
+    ngx_int_t lo = ngx_hextoi((u_char *)p + 1, data + len - p - 1);
+    if (hi == NGX_ERROR || lo == NGX_ERROR) return 0;
+    return (uint64_t)hi << 32 | (uint64_t)lo;
+}
+static ngx_int_t ngx_pq_lsn_send(ngx_pq_save_t *s, ngx_pq_data_t *d) {
+    ngx_connection_t *c = s->connection;
+    if (!PQsendQuery(s->conn, "SELECT pg_current_wal_lsn()")) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQuery"); return NGX_DECLINED; }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQuery('SELECT pg_current_wal_lsn()')");
+    d->lsn.sent = 1;
+    switch (PQflush(s->conn)) {
+        case 0: c->write->active = 0; break;
+        case 1: c->write->active = 1; break;
+        case -1: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return NGX_DECLINED;
+    }
+    return NGX_AGAIN;
+}
+static ngx_int_t ngx_pq_multiplex_flush(ngx_pq_save_t *s);
+static ngx_uint_t ngx_pq_role_get(ngx_pq_conninfo_t *ci) {
+    if (!ci) return 0;
+    if (ci->stat && ci->peers && *ci->peers) return (*ci->peers)[ci->stat - 1].role;
+    return ci->role;
+}
+static void ngx_pq_role(ngx_pq_save_t *s) {
+    ngx_pq_conninfo_t *ci = s->conninfo;
+    if (!ci || PQstatus(s->conn) != CONNECTION_OK) return;
+    const char *standby = PQparameterStatus(s->conn, "in_hot_standby");
+    const char *read_only = PQparameterStatus(s->conn, "default_transaction_read_only");
+    if (!standby) return; /* not reported before PostgreSQL 14, role stays unknown */
+    ngx_uint_t role = !ngx_strcmp(standby, "on") || (read_only && !ngx_strcmp(read_only, "on")) ? ngx_pq_role_standby : ngx_pq_role_primary;
+    if (ngx_pq_role_get(ci) == role) return;
+    ngx_log_error(NGX_LOG_NOTICE, s->connection->log, 0, "%V is %s", &s->connection->addr_text, role == ngx_pq_role_primary ? "primary" : "standby");
+    ci->role = role;
+    if (ci->stat && ci->peers && *ci->peers) (*ci->peers)[ci->stat - 1].role = role;
+}
 static ngx_int_t ngx_pq_poll(ngx_pq_save_t *s, ngx_pq_data_t *d) {
     ngx_connection_t *c = s->connection;
     ngx_flag_t started = (PQstatus(s->conn) == CONNECTION_STARTED);
@@ -612,11 +2331,14 @@ again:
         case PGRES_POLLING_FAILED: {
             const char *message = PQerrorMessage(s->conn);
             ngx_uint_t log_level = NGX_LOG_ERR;
-            ngx_http_request_t *r = d->request;
-            ngx_http_upstream_t *u = r->upstream;
-            ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
-            if (uscf->srv_conf) {
-                ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
+            ngx_pq_srv_conf_t *pscf = s->multiplex.pscf ? s->multiplex.pscf : s->pool.pscf ? s->pool.pscf : s->health.pscf;
+            if (!pscf && d) {
+                ngx_http_request_t *r = d->request;
+                ngx_http_upstream_t *u = r->upstream;
+                ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
+                if (uscf->srv_conf) pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
+            }
+            if (pscf) {
                 ngx_array_t *levels = &pscf->levels;
                 ngx_pq_level_t *level = levels->elts;
                 for (ngx_uint_t i = 0; i < levels->nelts; i++) if (!ngx_strcmp((u_char *)message, level[i].message.data)) { log_level = level[i].level; break; }
@@ -624,7 +2346,7 @@ again:
             ngx_pq_log_error(log_level, c->log, 0, message, "PGRES_POLLING_FAILED");
             return NGX_DECLINED;
         }
-        case PGRES_POLLING_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_POLLING_OK"); return ngx_pq_queries(s, d, ngx_pq_type_location|ngx_pq_type_upstream);
+        case PGRES_POLLING_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_POLLING_OK"); ngx_pq_role(s); if (s->multiplex.pscf) return ngx_pq_multiplex_flush(s); if (!d) return NGX_OK; return ngx_pq_queries(s, d, ngx_pq_type_location|ngx_pq_type_upstream);
         case PGRES_POLLING_READING: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_POLLING_READING"); c->read->active = 1; c->write->active = 0; break;
         case PGRES_POLLING_WRITING: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_POLLING_WRITING"); if (started) goto again; c->read->active = 0; c->write->active = 1; break;
     }
@@ -644,27 +2366,161 @@ again:
     }
     return NGX_AGAIN;
 }
-#endif
+#endif
+static void ngx_pq_downstream_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_pq_stream(ngx_pq_data_t *d) {
+    ngx_http_request_t *r = d->request;
+    ngx_http_upstream_t *u = r->upstream;
+    if (u->buffering) return NGX_OK;
+    ngx_connection_t *c = r->connection;
+    if (u->out_bufs) {
+        if (!u->header_sent) {
+            if (!r->headers_out.status) r->headers_out.status = NGX_HTTP_OK;
+            r->headers_out.content_length_n = -1;
+            ngx_int_t rc = ngx_http_send_header(r);
+            if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_send_header = %i", rc); return NGX_ERROR; }
+            u->header_sent = 1;
+            r->write_event_handler = ngx_pq_downstream_handler;
+        }
+        if (ngx_http_output_filter(r, u->out_bufs) == NGX_ERROR) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_http_output_filter == NGX_ERROR"); return NGX_ERROR; }
+        ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs, &u->out_bufs, u->output.tag);
+    }
+    if (!u->header_sent) return NGX_OK;
+    ngx_http_core_loc_conf_t *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_handle_write_event != NGX_OK"); return NGX_ERROR; }
+    if (c->write->active && !c->write->ready) ngx_add_timer(c->write, clcf->send_timeout);
+    else if (c->write->timer_set) ngx_del_timer(c->write);
+    return u->busy_bufs ? NGX_AGAIN : NGX_OK;
+}
+static void ngx_pq_multiplex_done(ngx_pq_data_t *d, ngx_int_t rc) {
+    ngx_http_request_t *r = d->request;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "rc = %i", rc);
+    d->balance.end = ngx_current_msec;
+    d->multiplex.done = 1;
+    d->multiplex.rc = rc;
+    if (u->peer.connection) ngx_post_event(u->peer.connection->read, &ngx_posted_events);
+}
+static ngx_int_t ngx_pq_multiplex_flush(ngx_pq_save_t *s) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection->log, 0, "%s", __func__);
+    if (PQstatus(s->conn) != CONNECTION_OK || s->multiplex.init) return NGX_AGAIN;
+    for (ngx_queue_t *q = ngx_queue_head(&s->multiplex.requests); q != ngx_queue_sentinel(&s->multiplex.requests); q = ngx_queue_next(q)) {
+        ngx_pq_data_t *d = ngx_queue_data(q, ngx_pq_data_t, multiplex.queue);
+        if (d->multiplex.sent) continue;
+        if (!s->multiplex.ready) {
+            s->multiplex.init = 1;
+            return ngx_pq_queries(s, d, ngx_pq_type_location|ngx_pq_type_upstream);
+        }
+        d->multiplex.sent = 1;
+        ngx_connection_t *c = d->request->upstream->peer.connection;
+        if (c && c->write->timer_set) ngx_del_timer(c->write);
+        ngx_int_t rc = ngx_pq_queries(s, d, ngx_pq_type_location);
+        if (rc != NGX_AGAIN) return rc;
+    }
+    return NGX_AGAIN;
+}
+static ngx_int_t ngx_pq_multiplex_sync(ngx_pq_save_t *s) {
+    ngx_connection_t *c = s->connection;
+    ngx_int_t rc = s->rc;
+    s->rc = NGX_OK;
+    if (ngx_queue_empty(&s->multiplex.slots)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_queue_empty"); return NGX_ERROR; }
+    ngx_queue_t *q = ngx_queue_head(&s->multiplex.slots);
+    ngx_queue_remove(q);
+    ngx_queue_insert_tail(&s->multiplex.free, q);
+    ngx_pq_slot_t *slot = ngx_queue_data(q, ngx_pq_slot_t, queue);
+    ngx_pq_data_t *d = slot->data;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "init = %i, rc = %i", slot->init, rc);
+    if (s->conn->xactStatus != PQTRANS_IDLE) {
+        if (!s->multiplex.retire) ngx_log_error(NGX_LOG_ERR, c->log, 0, "%V transaction left open on multiplexed connection, it is not shared with new requests anymore", &c->addr_text);
+        s->multiplex.retire = 1;
+        if (rc == NGX_OK) rc = NGX_HTTP_BAD_GATEWAY;
+    }
+    if (slot->init) {
+        s->multiplex.init = 0;
+        if (rc != NGX_OK) return rc;
+        s->multiplex.ready = 1;
+        return ngx_pq_multiplex_flush(s);
+    }
+    if (!d) return NGX_AGAIN;
+    if (rc == NGX_OK && !ngx_queue_empty(&d->queue)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_queue_empty"); rc = NGX_HTTP_BAD_GATEWAY; }
+    ngx_pq_multiplex_done(d, rc);
+    return NGX_AGAIN;
+}
 static ngx_int_t ngx_pq_result(ngx_pq_save_t *s, ngx_pq_data_t *d) {
     ngx_connection_t *c = s->connection;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
     if (!PQconsumeInput(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQconsumeInput"); return NGX_DECLINED; }
-    ngx_int_t rc = NGX_OK;
-    for (PGresult *res; ((res = PQgetResult(s->conn)) || (res = PQgetResult(s->conn))) && PQstatus(s->conn) == CONNECTION_OK; PQclear(res)) switch (PQresultStatus(res)) {
-        case PGRES_COMMAND_OK: rc = ngx_pq_res_command_ok(s, d, res); break;
-        case PGRES_COPY_OUT: rc = ngx_pq_res_copy_out(s, d); break;
-        case PGRES_FATAL_ERROR: rc = ngx_pq_res_fatal_error(s, d, res); break;
+    ngx_pq_role(s);
+    for (ngx_flag_t null = 0;;) {
+        if (PQisBusy(s->conn)) {
+            int avail = s->conn->inEnd - s->conn->inStart;
+            if (!PQconsumeInput(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQconsumeInput"); return NGX_DECLINED; }
+            if (s->conn->inEnd - s->conn->inStart > avail) continue;
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQisBusy");
+            return NGX_AGAIN;
+        }
+        PGresult *res;
+        if (!(res = PQgetResult(s->conn))) { if (null) break; null = 1; continue; }
+        null = 0;
+        if (PQstatus(s->conn) != CONNECTION_OK) { PQclear(res); break; }
+        if (s->multiplex.pscf) d = ngx_queue_empty(&s->multiplex.slots) ? NULL : ((ngx_pq_slot_t *)ngx_queue_data(ngx_queue_head(&s->multiplex.slots), ngx_pq_slot_t, queue))->data;
+        if (d && d->lsn.sent) {
+            if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 && PQnfields(res) == 1 && !PQgetisnull(res, 0, 0)) {
+                d->lsn.value.len = PQgetlength(res, 0, 0);
+                if (!(d->lsn.value.data = ngx_pnalloc(d->request->pool, d->lsn.value.len))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_pnalloc"); d->lsn.value.len = 0; }
+                else ngx_memcpy(d->lsn.value.data, PQgetvalue(res, 0, 0), d->lsn.value.len);
+            }
+            PQclear(res);
+            continue;
+        }
+        ngx_flag_t again = 0;
+        ngx_int_t rc;
+        switch (PQresultStatus(res)) {
+            case PGRES_COMMAND_OK: s->rc = ngx_pq_res_command_ok(s, d, res); break;
+            case PGRES_COPY_OUT: switch ((rc = ngx_pq_res_copy_out(s, d))) {
+                case NGX_AGAIN: again = 1; break;
+                case NGX_DECLINED: PQclear(res); return rc;
+                default: s->rc = rc; break;
+            } break;
+            case PGRES_COPY_IN: switch ((rc = ngx_pq_res_copy_in(s, d))) {
+                case NGX_AGAIN: again = 1; break;
+                case NGX_DECLINED: PQclear(res); return rc;
+                default: break;
+            } break;
+            case PGRES_FATAL_ERROR: s->rc = ngx_pq_res_fatal_error(s, d, &res); break;
 #ifdef LIBPQ_HAS_PIPELINING
-        case PGRES_PIPELINE_SYNC: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_PIPELINE_SYNC"); break;
+            case PGRES_PIPELINE_SYNC: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "PGRES_PIPELINE_SYNC"); if (s->multiplex.pscf) {
+                rc = ngx_pq_multiplex_sync(s);
+                if (rc != NGX_AGAIN) { PQclear(res); return rc; }
+            } break;
 #endif
-        case PGRES_TUPLES_OK:
+            case PGRES_TUPLES_OK:
 #ifdef LIBPQ_HAS_CHUNK_MODE
-        case PGRES_TUPLES_CHUNK:
+            case PGRES_TUPLES_CHUNK:
 #endif
-            rc = ngx_pq_res_tuples(s, d, res);
-            break;
-        default: rc = ngx_pq_res_default(s, d, res); break;
+                s->rc = ngx_pq_res_tuples(s, d, &res);
+                break;
+            default: s->rc = ngx_pq_res_default(s, d, res); break;
+        }
+        PQclear(res);
+        if (d && !s->multiplex.pscf) switch (ngx_pq_stream(d)) {
+            case NGX_OK: break;
+            case NGX_AGAIN: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "ngx_pq_stream == NGX_AGAIN"); return NGX_AGAIN;
+            default: return NGX_ERROR;
+        }
+        if (again) return NGX_AGAIN;
+    }
+    if (s->multiplex.pscf) {
+        if (PQstatus(s->conn) != CONNECTION_OK) return NGX_DECLINED;
+        ngx_int_t rc = ngx_pq_notify(s);
+        if (rc != NGX_OK) return rc;
+        if (PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return NGX_DECLINED; }
+        return NGX_AGAIN;
     }
+    /* last result is consumed, so client transfer after it does not count in balance latency */
+    if (d) d->balance.end = ngx_current_msec;
+    ngx_int_t rc = s->rc;
+    s->rc = NGX_OK;
 #ifdef LIBPQ_HAS_PIPELINING
     if (PQpipelineStatus(s->conn) == PQ_PIPELINE_ON) {
         if (PQstatus(s->conn) == CONNECTION_OK && !PQexitPipelineMode(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQexitPipelineMode"); return NGX_DECLINED; }
@@ -675,7 +2531,11 @@ static ngx_int_t ngx_pq_result(ngx_pq_save_t *s, ngx_pq_data_t *d) {
     if (s->count) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "s->count = %i", s->count); return NGX_HTTP_BAD_GATEWAY; }
     if (d) {
         if (!ngx_queue_empty(&d->queue)) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_queue_empty"); return NGX_HTTP_BAD_GATEWAY; }
+        if (rc == NGX_OK && d->copy.next) return ngx_pq_queries(s, d, d->copy.type);
         if (rc == NGX_OK && d->type & ngx_pq_type_upstream) return ngx_pq_queries(s, d, ngx_pq_type_location);
+        if (rc == NGX_OK && !d->lsn.sent && PQtransactionStatus(s->conn) == PQTRANS_IDLE && ((ngx_pq_loc_conf_t *)ngx_http_get_module_loc_conf(d->request, ngx_pq_module))->lsn) return ngx_pq_lsn_send(s, d);
+        ngx_pq_balance_done(d, rc == NGX_OK);
+        ngx_pq_breaker_done(d, rc == NGX_OK);
     } else if (!s->keepalive) {
         ngx_destroy_pool(c->pool);
         ngx_close_connection(c);
@@ -690,6 +2550,84 @@ static ngx_int_t ngx_pq_result(ngx_pq_save_t *s, ngx_pq_data_t *d) {
     }
     return rc;
 }
+static void ngx_pq_multiplex_fail(ngx_pq_save_t *s, ngx_int_t rc) {
+    ngx_connection_t *c = s->connection;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V rc = %i", &c->addr_text, rc);
+    ngx_queue_remove(&s->multiplex.queue);
+    while (!ngx_queue_empty(&s->multiplex.requests)) {
+        ngx_queue_t *q = ngx_queue_head(&s->multiplex.requests);
+        ngx_queue_remove(q);
+        ngx_pq_data_t *d = ngx_queue_data(q, ngx_pq_data_t, multiplex.queue);
+        d->save = NULL;
+        if (!d->multiplex.done) ngx_pq_multiplex_done(d, rc);
+    }
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+static void ngx_pq_multiplex_handler(ngx_event_t *ev) {
+    ngx_connection_t *c = ev->data;
+    ngx_pq_save_t *s = c->data;
+    ngx_int_t rc;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
+    if (c->idle && (c->close || ev->timedout)) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "idle"); rc = NGX_DONE; goto ret; }
+    if (ev->timedout) { ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out"); rc = NGX_DECLINED; goto ret; }
+    switch (PQstatus(s->conn)) {
+        case CONNECTION_BAD: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "CONNECTION_BAD"); rc = NGX_DECLINED; goto ret;
+        case CONNECTION_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "CONNECTION_OK");
+            if (ev->write && PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); rc = NGX_DECLINED; goto ret; }
+            rc = ngx_pq_result(s, NULL);
+            goto ret;
+        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQstatus = %i", PQstatus(s->conn)); break;
+    }
+    rc = ngx_pq_poll(s, NULL);
+ret:
+    switch (rc) {
+        case NGX_AGAIN: break;
+        case NGX_OK: break;
+        default: ngx_pq_multiplex_fail(s, rc); break;
+    }
+}
+static void ngx_pq_multiplex_idle(ngx_pq_save_t *s) {
+    ngx_pq_srv_conf_t *pscf = s->multiplex.pscf;
+    ngx_connection_t *c = s->connection;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
+    if (s->multiplex.retire || ngx_terminate || ngx_exiting) return ngx_pq_multiplex_fail(s, NGX_DONE);
+    c->idle = 1;
+    if (pscf->multiplex.idle_timeout) ngx_add_timer(c->read, pscf->multiplex.idle_timeout);
+}
+/* placeholder without fd lives in request pool, so it never reaches ngx_get_connection or ngx_free_connection and their files[fd] */
+static ngx_connection_t *ngx_pq_multiplex_connection(ngx_peer_connection_t *pc, ngx_pool_t *pool) {
+    ngx_connection_t *c = ngx_pcalloc(pool, sizeof(*c) + 2 * sizeof(ngx_event_t));
+    if (!c) return NULL;
+    c->read = (ngx_event_t *)(c + 1);
+    c->write = c->read + 1;
+    c->addr_text = *pc->name;
+    c->fd = (ngx_socket_t)-1;
+    c->log = pc->log;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c->read->data = c;
+    c->read->index = NGX_INVALID_INDEX;
+    c->read->log = pc->log;
+    c->start_time = ngx_current_msec;
+    c->type = pc->type ? pc->type : SOCK_STREAM;
+    c->write->data = c;
+    c->write->index = NGX_INVALID_INDEX;
+    c->write->log = pc->log;
+    c->write->write = 1;
+    return c;
+}
+static void ngx_pq_multiplex_close(ngx_connection_t *c) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
+    if (c->read->timer_set) ngx_del_timer(c->read);
+    if (c->write->timer_set) ngx_del_timer(c->write);
+    if (c->read->posted) ngx_delete_posted_event(c->read);
+    if (c->write->posted) ngx_delete_posted_event(c->write);
+    if (c->pool) ngx_destroy_pool(c->pool);
+    c->pool = NULL;
+    c->destroyed = 1;
+    c->read->closed = 1;
+    c->write->closed = 1;
+}
 
 static void ngx_pq_save_cln_handler(void *data) {
     ngx_pq_save_t *s = data;
@@ -703,6 +2641,21 @@ static void ngx_pq_save_cln_handler(void *data) {
     }
     if (s->conn) PQfinish(s->conn);
     s->conn = NULL;
+    if (s->pool.pscf) {
+        ngx_pq_srv_conf_t *pscf = s->pool.pscf;
+        if (s->pool.idle) {
+            ngx_queue_remove(&s->pool.queue);
+            pscf->pool.idle--;
+            s->pool.idle = 0;
+        }
+        pscf->pool.count--;
+        s->pool.pscf = NULL;
+        if (!ngx_queue_empty(&pscf->pool.waiters) && !pscf->pool.event.posted) ngx_post_event(&pscf->pool.event, &ngx_posted_events);
+    }
+    if (s->variables) ngx_pq_variables_release(s->variables);
+    s->variables = NULL;
+    while (!ngx_queue_empty(&s->statements.queue)) ngx_pq_statement_free(s, ngx_queue_data(ngx_queue_head(&s->statements.queue), ngx_pq_statement_t, queue));
+    ngx_pq_statement_reset(s);
     if (!ngx_terminate && !ngx_exiting && !c->error) while (!ngx_queue_empty(&s->queue)) {
         ngx_queue_t *q = ngx_queue_head(&s->queue);
         ngx_queue_remove(q);
@@ -731,60 +2684,73 @@ static void ngx_pq_notice_processor(void *arg, const char *message) {
     ngx_pq_log_error(NGX_LOG_NOTICE, s->connection->log, 0, message, "PGRES_NONFATAL_ERROR");
 }
 
-static ngx_int_t ngx_pq_peer_open(ngx_peer_connection_t *pc, void *data) {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", __func__);
-    ngx_pq_data_t *d = data;
-    ngx_pq_save_t *s;
-    ngx_http_request_t *r = d->request;
-    ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
-    size_t buffer_size = plcf->upstream.buffer_size;
-    ngx_http_upstream_t *u = r->upstream;
-    ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
-    ngx_pq_connect_t *connect = &plcf->connect;
-    if (uscf->srv_conf) {
-        ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
-        buffer_size = pscf->buffer_size;
-        connect = &pscf->connect;
+static ngx_int_t ngx_pq_conninfo(ngx_pool_t *pool, ngx_pq_connect_t *connect, ngx_str_t host, ngx_str_t name, int family, ngx_str_t *conninfo) {
+    if (family == AF_UNIX && name.len >= sizeof("unix:") - 1) {
+        name.data += sizeof("unix:") - 1;
+        name.len -= sizeof("unix:") - 1;
     }
-    plcf->upstream.connect_timeout = connect->timeout;
-    PQExpBufferData conninfo;
-    initPQExpBuffer(&conninfo);
-    ngx_str_t *option = connect->options.elts;
-    for (ngx_uint_t i = 0; i < connect->options.nelts; i++) {
-        if (i) appendPQExpBufferChar(&conninfo, ' ');
-        appendBinaryPQExpBuffer(&conninfo, (char *)option[i].data, option[i].len);
+    ngx_str_t port = ngx_null_string;
+    for (size_t i = name.len; i; i--) if (name.data[i - 1] == ':') {
+        port.data = name.data + i;
+        port.len = name.len - i;
+        name.len = i - 1;
+        break;
+    }
+    if (family != AF_UNIX) {
+        for (size_t i = host.len; i; i--) if (host.data[i - 1] == ':') { host.len = i - 1; break; }
+        if (name.len > 1 && name.data[0] == '[' && name.data[name.len - 1] == ']') {
+            name.data++;
+            name.len -= 2;
+        }
     }
-    if (pc->sockaddr->sa_family != AF_UNIX) {
-        appendPQExpBufferStr(&conninfo, " host=");
-        ngx_http_upstream_server_t *us = uscf->servers->elts;
+    size_t len = connect->conninfo.len + sizeof(" host= hostaddr= port=") - 1 + host.len + name.len + port.len;
+    u_char *p;
+    if (!(p = conninfo->data = ngx_pnalloc(pool, len + 1))) return NGX_ERROR;
+    p = ngx_copy(p, connect->conninfo.data, connect->conninfo.len);
+    if (family == AF_UNIX) p = ngx_sprintf(p, " host=%V", &name);
+    else p = ngx_sprintf(p, " host=%V hostaddr=%V", &host, &name);
+    if (port.len) p = ngx_sprintf(p, " port=%V", &port);
+    *p = '\0';
+    conninfo->len = p - conninfo->data;
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_conninfo_init(ngx_conf_t *cf, ngx_pq_connect_t *connect, ngx_http_upstream_srv_conf_t *uscf) {
+    if (!uscf->servers || connect->conninfos.elts) return NGX_OK;
+    ngx_http_upstream_server_t *us = uscf->servers->elts;
+    ngx_uint_t n = 0;
+    for (ngx_uint_t i = 0; i < uscf->servers->nelts; i++) n += us[i].naddrs;
+    if (!n) return NGX_OK;
+    ngx_pq_conninfo_t *conninfo;
+    if (ngx_array_init(&connect->conninfos, cf->pool, n, sizeof(*conninfo)) != NGX_OK) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "ngx_array_init != NGX_OK"); return NGX_ERROR; }
+    for (ngx_uint_t i = 0; i < uscf->servers->nelts; i++) for (ngx_uint_t j = 0; j < us[i].naddrs; j++) {
+        if (!(conninfo = ngx_array_push(&connect->conninfos))) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "!ngx_array_push"); return NGX_ERROR; }
+        conninfo->sockaddr = us[i].addrs[j].sockaddr;
+        conninfo->socklen = us[i].addrs[j].socklen;
+        if (ngx_pq_conninfo(cf->pool, connect, us[i].name.data ? us[i].name : uscf->host, us[i].addrs[j].name, conninfo->sockaddr->sa_family, &conninfo->conninfo) != NGX_OK) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "ngx_pq_conninfo != NGX_OK"); return NGX_ERROR; }
+    }
+    return NGX_OK;
+}
+static ngx_pq_conninfo_t *ngx_pq_conninfo_find(ngx_pq_connect_t *connect, struct sockaddr *sockaddr, socklen_t socklen) {
+    ngx_pq_conninfo_t *ci = connect->conninfos.elts;
+    for (ngx_uint_t i = 0; i < connect->conninfos.nelts; i++) if (ci[i].sockaddr == sockaddr) return &ci[i];
+    for (ngx_uint_t i = 0; i < connect->conninfos.nelts; i++) if (ngx_cmp_sockaddr(ci[i].sockaddr, ci[i].socklen, sockaddr, socklen, 1) == NGX_OK) return &ci[i];
+    return NULL;
+}
+static ngx_int_t ngx_pq_peer_connect(ngx_peer_connection_t *pc, ngx_pool_t *pool, ngx_http_upstream_srv_conf_t *uscf, ngx_pq_connect_t *connect, size_t buffer_size, ngx_pq_save_t **save) {
+    ngx_pq_save_t *s;
+    ngx_str_t conninfo = ngx_null_string;
+    ngx_pq_conninfo_t *ci = ngx_pq_conninfo_find(connect, pc->sockaddr, pc->socklen);
+    if (ci) conninfo = ci->conninfo;
+    else {
         ngx_str_t host = uscf->host;
-        for (ngx_uint_t j = 0; j < uscf->servers->nelts; j++) if (us[j].name.data) for (ngx_uint_t k = 0; k < us[j].naddrs; k++) if (pc->sockaddr == us[j].addrs[k].sockaddr) { host = us[j].name; goto found; }
+        ngx_http_upstream_server_t *us = uscf->servers ? uscf->servers->elts : NULL;
+        for (ngx_uint_t j = 0; us && j < uscf->servers->nelts; j++) if (us[j].name.data) for (ngx_uint_t k = 0; k < us[j].naddrs; k++) if (pc->sockaddr == us[j].addrs[k].sockaddr) { host = us[j].name; goto found; }
 found:
-        while (host.len--) if (host.data[host.len] == ':') break;
-        appendBinaryPQExpBuffer(&conninfo, (char *)host.data, host.len);
-    }
-    ngx_str_t host = *pc->name;
-    ngx_str_t port = host;
-    while (host.len--) if (host.data[host.len] == ':') break;
-    port.data += host.len + 1;
-    port.len -= host.len + 1;
-    if (pc->sockaddr->sa_family != AF_UNIX) {
-        appendPQExpBufferStr(&conninfo, " hostaddr=");
-        if (host.data[0] == '[' && host.data[host.len - 1] == ']') {
-            host.data++;
-            host.len -= 2;
-        }
-        appendBinaryPQExpBuffer(&conninfo, (char *)host.data, host.len);
-    } else {
-        appendPQExpBufferStr(&conninfo, " host=");
-        appendBinaryPQExpBuffer(&conninfo, (char *)host.data + 5, host.len - 5);
+        if (ngx_pq_conninfo(pool, connect, host, *pc->name, pc->sockaddr->sa_family, &conninfo) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "ngx_pq_conninfo != NGX_OK"); return NGX_ERROR; }
     }
-    appendPQExpBufferStr(&conninfo, " port=");
-    appendBinaryPQExpBuffer(&conninfo, (char *)port.data, port.len);
     ngx_int_t rc = NGX_ERROR;
-    if (PQExpBufferDataBroken(conninfo)) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "PQExpBufferDataBroken"); goto term; }
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", conninfo.data);
-    PGconn *conn = PQconnectStart(conninfo.data);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%V", &conninfo);
+    PGconn *conn = PQconnectStart((char *)conninfo.data);
     if (PQstatus(conn) == CONNECTION_BAD) { ngx_pq_log_error(NGX_LOG_ERR, pc->log, 0, PQerrorMessage(conn), "CONNECTION_BAD"); goto finish; }
     (void)PQsetErrorContextVisibility(conn, connect->show_context);
     (void)PQsetErrorVerbosity(conn, connect->errors);
@@ -801,10 +2767,14 @@ found:
     c->type = pc->type ? pc->type : SOCK_STREAM;
     c->write->log = pc->log;
     if (!c->pool && !(c->pool = ngx_create_pool(128, pc->log))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_create_pool"); goto close; }
-    if (!(s = d->save = ngx_pcalloc(c->pool, sizeof(*s)))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_pcalloc"); goto destroy; }
+    if (!(s = *save = ngx_pcalloc(c->pool, sizeof(*s)))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_pcalloc"); goto destroy; }
+    s->conninfo = ci;
     s->inBufSize = ngx_max(conn->inBufSize, (int)buffer_size);
     (void)PQsetNoticeProcessor(conn, ngx_pq_notice_processor, s);
     ngx_queue_init(&s->queue);
+    ngx_queue_init(&s->statements.deallocate);
+    ngx_queue_init(&s->statements.queue);
+    s->statements.max = connect->statements;
     ngx_pool_cleanup_t *cln;
     if (!(cln = ngx_pool_cleanup_add(c->pool, 0))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_pool_cleanup_add"); goto destroy; }
     cln->data = s;
@@ -827,10 +2797,588 @@ close:
 finish:
     PQfinish(conn);
 term:
-    termPQExpBuffer(&conninfo);
     return rc;
 }
+static ngx_int_t ngx_pq_peer_open(ngx_peer_connection_t *pc, void *data) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", __func__);
+    ngx_pq_data_t *d = data;
+    ngx_http_request_t *r = d->request;
+    ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+    size_t buffer_size = plcf->upstream.buffer_size;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
+    ngx_pq_connect_t *connect = &plcf->connect;
+    if (uscf->srv_conf) {
+        ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
+        buffer_size = pscf->buffer_size;
+        connect = &pscf->connect;
+    }
+    plcf->upstream.connect_timeout = connect->timeout;
+    return ngx_pq_peer_connect(pc, r->pool, uscf, connect, buffer_size, &d->save);
+}
 
+static ngx_int_t ngx_pq_multiplex_get(ngx_peer_connection_t *pc, ngx_pq_data_t *d, ngx_pq_srv_conf_t *pscf) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", __func__);
+    ngx_http_request_t *r = d->request;
+    ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+    ngx_pq_save_t *s = NULL;
+    ngx_connection_t *c;
+    ngx_int_t rc;
+    for (ngx_queue_t *q = ngx_queue_head(&pscf->multiplex.queue); q != ngx_queue_sentinel(&pscf->multiplex.queue); q = ngx_queue_next(q)) {
+        ngx_pq_save_t *save = ngx_queue_data(q, ngx_pq_save_t, multiplex.queue);
+        c = save->connection;
+        if (save->multiplex.count >= pscf->multiplex.max || save->multiplex.retire || PQstatus(save->conn) == CONNECTION_BAD) continue;
+        if (c->addr_text.len != pc->name->len || ngx_strncmp(c->addr_text.data, pc->name->data, pc->name->len)) continue;
+        s = save;
+        break;
+    }
+    if (!s) {
+        if ((rc = ngx_pq_peer_open(pc, d)) != NGX_AGAIN) return rc;
+        s = d->save;
+        c = pc->connection;
+        ngx_log_t *log = pscf->log ? pscf->log : ngx_cycle->log;
+        c->data = s;
+        c->log = log;
+        c->pool->log = log;
+        c->read->handler = ngx_pq_multiplex_handler;
+        c->read->log = log;
+        c->write->handler = ngx_pq_multiplex_handler;
+        c->write->log = log;
+        s->multiplex.pscf = pscf;
+        s->multiplex.ready = !pscf->queries.nelts;
+        ngx_queue_init(&s->multiplex.free);
+        ngx_queue_init(&s->multiplex.requests);
+        ngx_queue_init(&s->multiplex.slots);
+        ngx_queue_insert_tail(&pscf->multiplex.queue, &s->multiplex.queue);
+        if (pscf->connect.timeout) ngx_add_timer(c->write, pscf->connect.timeout);
+        pc->connection = NULL;
+    }
+    c = s->connection;
+    if (!(pc->connection = ngx_pq_multiplex_connection(pc, r->pool))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_pq_multiplex_connection"); if (!s->multiplex.count) ngx_pq_multiplex_idle(s); return NGX_ERROR; }
+    if (c->read->timer_set) ngx_del_timer(c->read);
+    c->idle = 0;
+    plcf->upstream.connect_timeout = pscf->connect.timeout;
+    d->save = s;
+    d->multiplex.done = 0;
+    d->multiplex.on = 1;
+    d->multiplex.sent = 0;
+    ngx_queue_init(&d->queue);
+    ngx_queue_insert_tail(&s->multiplex.requests, &d->multiplex.queue);
+    s->multiplex.count++;
+    switch ((rc = ngx_pq_multiplex_flush(s))) {
+        case NGX_AGAIN: break;
+        case NGX_OK: break;
+        default: ngx_pq_multiplex_fail(s, rc); break;
+    }
+    return NGX_AGAIN;
+}
+static ngx_int_t ngx_pq_pool_expire(ngx_pq_save_t *s) {
+    ngx_pq_srv_conf_t *pscf = s->pool.pscf;
+    ngx_connection_t *c = s->connection;
+    ngx_msec_t timer = 0;
+    if (pscf->pool.lifetime) {
+        if (ngx_current_msec - s->pool.start >= pscf->pool.lifetime) return NGX_DECLINED;
+        timer = pscf->pool.lifetime - (ngx_current_msec - s->pool.start);
+    }
+    if (pscf->pool.idle_timeout) {
+        ngx_msec_t idle = ngx_current_msec - s->pool.used;
+        if (idle >= pscf->pool.idle_timeout && pscf->pool.count > pscf->pool.min) return NGX_DECLINED;
+        idle = idle < pscf->pool.idle_timeout ? pscf->pool.idle_timeout - idle : pscf->pool.idle_timeout;
+        if (!timer || idle < timer) timer = idle;
+    }
+    if (timer) ngx_add_timer(c->read, timer);
+    return NGX_OK;
+}
+static void ngx_pq_pool_handler(ngx_event_t *ev);
+static ngx_int_t ngx_pq_pool_put(ngx_pq_save_t *s) {
+    ngx_pq_srv_conf_t *pscf = s->pool.pscf;
+    ngx_connection_t *c = s->connection;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
+    if (ngx_terminate || ngx_exiting) return NGX_DECLINED;
+    if (PQstatus(s->conn) != CONNECTION_OK || PQtransactionStatus(s->conn) != PQTRANS_IDLE) return NGX_DECLINED;
+    if (c->read->timer_set) ngx_del_timer(c->read);
+    if (c->write->timer_set) ngx_del_timer(c->write);
+    if (!s->pool.sample) s->pool.used = ngx_current_msec;
+    if (ngx_pq_pool_expire(s) != NGX_OK) return NGX_DECLINED;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "ngx_handle_read_event != NGX_OK"); return NGX_ERROR; }
+    ngx_log_t *log = pscf->log ? pscf->log : ngx_cycle->log;
+    c->data = s;
+    c->idle = 1;
+    c->log = log;
+    c->pool->log = log;
+    c->read->handler = ngx_pq_pool_handler;
+    c->read->log = log;
+    c->write->handler = ngx_pq_pool_handler;
+    c->write->log = log;
+    s->keepalive = 1;
+    s->pool.idle = 1;
+    ngx_queue_insert_head(&pscf->pool.free, &s->pool.queue);
+    pscf->pool.idle++;
+    if (!ngx_queue_empty(&pscf->pool.waiters) && !pscf->pool.event.posted) ngx_post_event(&pscf->pool.event, &ngx_posted_events);
+    if (c->read->ready) ngx_post_event(c->read, &ngx_posted_events);
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_pool_sample_result(ngx_pq_save_t *s) {
+    ngx_connection_t *c = s->connection;
+    if (!PQconsumeInput(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQconsumeInput"); return NGX_DECLINED; }
+    ngx_pq_role(s);
+    for (PGresult *res; !PQisBusy(s->conn); PQclear(res)) {
+        if (!(res = PQgetResult(s->conn))) return NGX_OK;
+        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1 || PQnfields(res) != 1 || PQgetisnull(res, 0, 0)) continue;
+        uint64_t lsn = ngx_pq_lsn_parse((u_char *)PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0));
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V replay lsn = %uL", &c->addr_text, lsn);
+        if (lsn) s->pool.pscf->stat.peers[s->conninfo->stat - 1].lsn = lsn;
+    }
+    return NGX_AGAIN;
+}
+static ngx_flag_t ngx_pq_pool_static(ngx_array_t *queries) {
+    ngx_pq_query_t *query = queries->elts;
+#ifndef LIBPQ_HAS_PIPELINING
+    if (queries->nelts > 1) return 0;
+#endif
+    for (ngx_uint_t i = 0; i < queries->nelts; i++) {
+        if (query[i].index || query[i].binary || query[i].copy || !query[i].sql.data || query[i].name.complex.value.data) return 0;
+        ngx_pq_argument_t *argument = query[i].arguments.elts;
+        for (ngx_uint_t j = 0; j < query[i].arguments.nelts; j++) if (argument[j].oid.complex.value.data || argument[j].value.complex.value.data) return 0;
+    }
+    return 1;
+}
+static ngx_int_t ngx_pq_pool_queries(ngx_pq_save_t *s) {
+    ngx_pq_srv_conf_t *pscf = s->pool.pscf;
+    ngx_connection_t *c = s->connection;
+    ngx_pq_query_t *query = pscf->queries.elts;
+#ifdef LIBPQ_HAS_PIPELINING
+    if (!PQenterPipelineMode(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQenterPipelineMode"); return NGX_ERROR; }
+#endif
+    for (ngx_uint_t i = 0; i < pscf->queries.nelts; i++) {
+        ngx_uint_t nelts = query[i].arguments.nelts;
+        ngx_pq_argument_t *argument = query[i].arguments.elts;
+        const char **paramValues = NULL;
+        Oid *paramTypes = NULL;
+        if (nelts) {
+            if (!(paramValues = ngx_palloc(c->pool, nelts * sizeof(*paramValues)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_palloc"); return NGX_ERROR; }
+            if (!(paramTypes = ngx_palloc(c->pool, nelts * sizeof(*paramTypes)))) { ngx_log_error(NGX_LOG_ERR, c->log, 0, "!ngx_palloc"); return NGX_ERROR; }
+        }
+        for (ngx_uint_t j = 0; j < nelts; j++) {
+            paramTypes[j] = argument[j].oid.value;
+            paramValues[j] = (const char *)argument[j].value.str.data;
+        }
+        char *text = (char *)query[i].sql.data;
+        char *statement_name = (char *)query[i].name.str.data;
+        if (query[i].type & ngx_pq_type_query) {
+            if (!PQsendQueryParams(s->conn, text, nelts, paramTypes, paramValues, NULL, NULL, query[i].resultFormat)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryParams"); return NGX_ERROR; }
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryParams('%s')", text);
+        } else if (query[i].type & ngx_pq_type_prepare) {
+            if (!PQsendPrepare(s->conn, statement_name, text, nelts, paramTypes)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendPrepare"); return NGX_ERROR; }
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendPrepare('%s', '%s')", statement_name, text);
+        } else if (query[i].type & ngx_pq_type_execute) {
+            if (!PQsendQueryPrepared(s->conn, statement_name, nelts, paramValues, NULL, NULL, query[i].resultFormat)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQueryPrepared"); return NGX_ERROR; }
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQueryPrepared('%s')", statement_name);
+        }
+    }
+#ifdef LIBPQ_HAS_PIPELINING
+    if (!PQpipelineSync(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQpipelineSync"); return NGX_ERROR; }
+#endif
+    if (PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return NGX_ERROR; }
+    if (c->write->timer_set) ngx_del_timer(c->write);
+    ngx_add_timer(c->read, pscf->connect.timeout ? pscf->connect.timeout : 60 * 1000);
+    s->pool.prewarm = 1;
+    s->rc = NGX_OK;
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_pool_queries_result(ngx_pq_save_t *s) {
+    ngx_connection_t *c = s->connection;
+    if (!PQconsumeInput(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQconsumeInput"); return NGX_DECLINED; }
+    ngx_pq_role(s);
+    for (PGresult *res; !PQisBusy(s->conn); PQclear(res)) {
+        if (!(res = PQgetResult(s->conn))) {
+#ifdef LIBPQ_HAS_PIPELINING
+            continue;
+#else
+            return s->rc;
+#endif
+        }
+        switch (PQresultStatus(res)) {
+            case PGRES_COMMAND_OK: case PGRES_TUPLES_OK: break;
+#ifdef LIBPQ_HAS_PIPELINING
+            case PGRES_PIPELINE_SYNC:
+                PQclear(res);
+                if (!PQexitPipelineMode(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQexitPipelineMode"); return NGX_DECLINED; }
+                return s->rc;
+#endif
+            default: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQresultErrorMessage(res), "%s", PQresStatus(PQresultStatus(res))); s->rc = NGX_DECLINED; break;
+        }
+    }
+    return NGX_AGAIN;
+}
+static void ngx_pq_pool_handler(ngx_event_t *ev) {
+    ngx_connection_t *c = ev->data;
+    ngx_pq_save_t *s = c->data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
+    if (c->close || ngx_terminate || ngx_exiting) goto close;
+    if (ev->timedout) {
+        if (!s->pool.idle) { ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out"); goto close; }
+        ev->timedout = 0;
+        if (ngx_pq_pool_expire(s) != NGX_OK) goto close;
+        return;
+    }
+    switch (PQstatus(s->conn)) {
+        case CONNECTION_BAD: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "CONNECTION_BAD"); goto close;
+        case CONNECTION_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "CONNECTION_OK");
+            if (ev->write && PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); goto close; }
+            if (s->pool.prewarm) switch (ngx_pq_pool_queries_result(s)) {
+                case NGX_AGAIN: return;
+                case NGX_OK:
+                    s->pool.prewarm = 0;
+                    s->pool.ready = 1;
+                    if (ngx_pq_pool_put(s) == NGX_OK) return;
+                    goto close;
+                default: goto close;
+            }
+            if (s->pool.sample) switch (ngx_pq_pool_sample_result(s)) {
+                case NGX_AGAIN: return;
+                case NGX_OK: {
+                    ngx_int_t rc = ngx_pq_pool_put(s);
+                    s->pool.sample = 0;
+                    if (rc == NGX_OK) return;
+                } goto close;
+                default: goto close;
+            }
+            switch (ngx_pq_result(s, NULL)) {
+                case NGX_AGAIN: return;
+                case NGX_OK: return;
+                default: goto close;
+            }
+        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQstatus = %i", PQstatus(s->conn)); break;
+    }
+    switch (ngx_pq_poll(s, NULL)) {
+        case NGX_AGAIN: return;
+        case NGX_OK:
+            if (!s->pool.ready && ngx_pq_pool_static(&s->pool.pscf->queries)) { if (ngx_pq_pool_queries(s) == NGX_OK) return; break; }
+            if (ngx_pq_pool_put(s) == NGX_OK) return;
+            break;
+        default: break;
+    }
+close:
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+static ngx_int_t ngx_pq_pool_open(ngx_pq_srv_conf_t *pscf, ngx_addr_t *addr) {
+    ngx_log_t *log = pscf->log ? pscf->log : ngx_cycle->log;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "%V", &addr->name);
+    ngx_peer_connection_t pc;
+    ngx_memzero(&pc, sizeof(pc));
+    pc.log = log;
+    pc.name = &addr->name;
+    pc.sockaddr = addr->sockaddr;
+    pc.socklen = addr->socklen;
+    ngx_pq_save_t *s;
+    if (ngx_pq_peer_connect(&pc, ngx_cycle->pool, pscf->pool.upstream, &pscf->connect, pscf->buffer_size, &s) != NGX_AGAIN) return NGX_ERROR;
+    ngx_connection_t *c = pc.connection;
+    c->data = s;
+    c->idle = 1;
+    c->log = log;
+    c->pool->log = log;
+    c->read->handler = ngx_pq_pool_handler;
+    c->write->handler = ngx_pq_pool_handler;
+    s->pool.pscf = pscf;
+    s->pool.ready = !pscf->queries.nelts;
+    s->pool.start = ngx_current_msec;
+    pscf->pool.count++;
+    if (pscf->connect.timeout) ngx_add_timer(c->write, pscf->connect.timeout);
+    return NGX_OK;
+}
+static void ngx_pq_pool_prewarm(ngx_pq_srv_conf_t *pscf) {
+    ngx_http_upstream_srv_conf_t *uscf = pscf->pool.upstream;
+    if (ngx_terminate || ngx_exiting || !uscf->servers) return;
+    ngx_http_upstream_server_t *us = uscf->servers->elts;
+    ngx_uint_t n = 0;
+    for (ngx_uint_t i = 0; i < uscf->servers->nelts; i++) if (!us[i].backup && !us[i].down) n += us[i].naddrs;
+    while (n && pscf->pool.count < pscf->pool.min) {
+        ngx_uint_t i, k = pscf->pool.next++ % n;
+        for (i = 0; i < uscf->servers->nelts; i++) if (!us[i].backup && !us[i].down) {
+            if (k < us[i].naddrs) break;
+            k -= us[i].naddrs;
+        }
+        if (ngx_pq_pool_open(pscf, &us[i].addrs[k]) != NGX_OK) return;
+    }
+}
+static void ngx_pq_pool_sample(ngx_pq_srv_conf_t *pscf) {
+    if (ngx_terminate || ngx_exiting || !pscf->pool.lsn_interval || !pscf->stat.peers) return;
+    ngx_atomic_uint_t now = ngx_pq_stat_now();
+    for (ngx_queue_t *q = ngx_queue_head(&pscf->pool.free), *next; q != ngx_queue_sentinel(&pscf->pool.free); q = next) {
+        next = ngx_queue_next(q);
+        ngx_pq_save_t *s = ngx_queue_data(q, ngx_pq_save_t, pool.queue);
+        ngx_pq_conninfo_t *ci = s->conninfo;
+        if (!ci || !ci->stat || ngx_pq_role_get(ci) == ngx_pq_role_primary) continue;
+        /* one sample per server and interval for all workers */
+        ngx_pq_stat_t *stat = &pscf->stat.peers[ci->stat - 1];
+        ngx_atomic_uint_t sampled = stat->sampled;
+        if (now - sampled < pscf->pool.lsn_interval || !ngx_atomic_cmp_set(&stat->sampled, sampled, now)) continue;
+        ngx_connection_t *c = s->connection;
+        ngx_queue_remove(q);
+        pscf->pool.idle--;
+        s->pool.idle = 0;
+        if (c->read->timer_set) ngx_del_timer(c->read);
+        if (!PQsendQuery(s->conn, "SELECT pg_last_wal_replay_lsn()")) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQuery"); goto close; }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V PQsendQuery('SELECT pg_last_wal_replay_lsn()')", &c->addr_text);
+        if (PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); goto close; }
+        s->pool.sample = 1;
+        ngx_add_timer(c->read, pscf->connect.timeout ? pscf->connect.timeout : 60 * 1000);
+        continue;
+close:
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+    }
+}
+static void ngx_pq_pool_timer_handler(ngx_event_t *ev) {
+    ngx_pq_srv_conf_t *pscf = ev->data;
+    ngx_pq_pool_prewarm(pscf);
+    ngx_pq_pool_sample(pscf);
+    if (!ngx_terminate && !ngx_exiting) ngx_add_timer(ev, pscf->pool.lsn_interval && pscf->pool.lsn_interval < 1000 ? pscf->pool.lsn_interval : 1000);
+}
+static void ngx_pq_pool_resume(ngx_pq_data_t *d, ngx_pq_srv_conf_t *pscf);
+static void ngx_pq_pool_event_handler(ngx_event_t *ev) {
+    ngx_pq_srv_conf_t *pscf = ev->data;
+    while (!ngx_queue_empty(&pscf->pool.waiters) && (pscf->pool.idle || pscf->pool.count < pscf->pool.max)) {
+        ngx_queue_t *q = ngx_queue_head(&pscf->pool.waiters);
+        ngx_queue_remove(q);
+        pscf->pool.waiting--;
+        ngx_pq_data_t *w = ngx_queue_data(q, ngx_pq_data_t, pool.queue);
+        ngx_http_request_t *wr = w->request;
+        ngx_connection_t *c = wr->connection;
+        w->pool.pscf = NULL;
+        if (w->pool.event.timer_set) ngx_del_timer(&w->pool.event);
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "pq pool resume");
+        if (w->pool.connection) ngx_pq_pool_resume(w, pscf);
+        else ngx_http_finalize_request(wr, ngx_pq_upstream(wr));
+        ngx_http_run_posted_requests(c);
+    }
+}
+static ngx_int_t ngx_pq_pool_get(ngx_peer_connection_t *pc, ngx_pq_data_t *d, ngx_pq_srv_conf_t *pscf) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", __func__);
+    ngx_pq_save_t *evict = NULL;
+    for (ngx_queue_t *q = ngx_queue_head(&pscf->pool.free); q != ngx_queue_sentinel(&pscf->pool.free); q = ngx_queue_next(q)) {
+        ngx_pq_save_t *s = ngx_queue_data(q, ngx_pq_save_t, pool.queue);
+        ngx_connection_t *c = s->connection;
+        if (c->addr_text.len != pc->name->len || ngx_strncmp(c->addr_text.data, pc->name->data, pc->name->len)) { evict = s; continue; }
+        ngx_queue_remove(q);
+        pscf->pool.idle--;
+        s->pool.idle = 0;
+        if (c->read->timer_set) ngx_del_timer(c->read);
+        if (c->write->timer_set) ngx_del_timer(c->write);
+        if (c->read->posted) ngx_delete_posted_event(c->read);
+        c->idle = 0;
+        c->log = pc->log;
+        c->pool->log = pc->log;
+        c->read->log = pc->log;
+        c->write->log = pc->log;
+        pc->cached = 1;
+        pc->connection = c;
+        return NGX_DONE;
+    }
+    if (pscf->pool.count >= pscf->pool.max) {
+        if (!evict) {
+            /* e.g. upstream retry after ngx_pq_pool_wait, wait in queue on a connection without fd */
+            if (pscf->pool.waiting >= pscf->pool.queue) { ngx_log_error(NGX_LOG_WARN, pc->log, 0, "pq_pool max %ui reached", pscf->pool.max); return NGX_BUSY; }
+            ngx_http_request_t *r = d->request;
+            ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+            if (!(pc->connection = ngx_pq_multiplex_connection(pc, r->pool))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_pq_multiplex_connection"); return NGX_ERROR; }
+            plcf->upstream.connect_timeout = pscf->pool.timeout ? pscf->pool.timeout : pscf->connect.timeout;
+            d->pool.connection = pc->connection;
+            d->pool.pscf = pscf;
+            d->save = NULL;
+            ngx_queue_insert_tail(&pscf->pool.waiters, &d->pool.queue);
+            pscf->pool.waiting++;
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "pq pool wait");
+            return NGX_AGAIN;
+        }
+        ngx_connection_t *c = evict->connection;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "evict %V", &c->addr_text);
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+    }
+    ngx_int_t rc;
+    if ((rc = ngx_pq_peer_open(pc, d)) != NGX_AGAIN) return rc;
+    ngx_pq_save_t *s = d->save;
+    s->pool.pscf = pscf;
+    s->pool.ready = 1;
+    s->pool.start = ngx_current_msec;
+    pscf->pool.count++;
+    return NGX_AGAIN;
+}
+static ngx_int_t ngx_pq_peer_save(ngx_peer_connection_t *pc, ngx_pq_data_t *d);
+static void ngx_http_upstream_next_my(ngx_http_request_t *r, ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static void ngx_pq_pool_resume(ngx_pq_data_t *d, ngx_pq_srv_conf_t *pscf) {
+    ngx_http_request_t *r = d->request;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_peer_connection_t *pc = &u->peer;
+    ngx_connection_t *w = d->pool.connection;
+    ngx_int_t rc;
+    d->pool.connection = NULL;
+    pc->connection = NULL;
+    if ((rc = ngx_pq_pool_get(pc, d, pscf)) == NGX_DONE) rc = ngx_pq_peer_save(pc, d);
+    ngx_connection_t *c = pc->connection;
+    if (c) {
+        c->data = w->data;
+        c->log = w->log;
+        c->pool->log = w->log;
+        c->read->handler = w->read->handler;
+        c->read->log = w->log;
+        c->requests++;
+        c->write->handler = w->write->handler;
+        c->write->log = w->log;
+        u->writer.connection = c;
+        if (rc == NGX_AGAIN) ngx_add_timer(c->write, u->conf->connect_timeout);
+    }
+    ngx_pq_multiplex_close(w);
+    switch (rc) {
+        case NGX_AGAIN: break;
+        case NGX_BUSY: ngx_http_upstream_next_my(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE); break;
+        case NGX_DECLINED: ngx_http_upstream_next_my(r, u, NGX_HTTP_UPSTREAM_FT_ERROR); break;
+        case NGX_ERROR: ngx_http_upstream_next_my(r, u, NGX_HTTP_UPSTREAM_FT_ERROR); break;
+        default: ngx_http_upstream_finalize_request(r, u, rc); break;
+    }
+}
+static void ngx_pq_pool_wait_handler(ngx_event_t *ev) {
+    ngx_pq_data_t *d = ev->data;
+    ngx_http_request_t *r = d->request;
+    ngx_connection_t *c = r->connection;
+    ngx_pq_srv_conf_t *pscf = d->pool.pscf;
+    ngx_queue_remove(&d->pool.queue);
+    pscf->pool.waiting--;
+    d->pool.pscf = NULL;
+    ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "pq_pool queue timed out");
+    ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+    ngx_http_run_posted_requests(c);
+}
+static void ngx_pq_pool_cln_handler(void *data) {
+    ngx_pq_data_t *d = data;
+    if (d->pool.event.timer_set) ngx_del_timer(&d->pool.event);
+    if (!d->pool.pscf) return;
+    ngx_queue_remove(&d->pool.queue);
+    d->pool.pscf->pool.waiting--;
+    d->pool.pscf = NULL;
+}
+static ngx_int_t ngx_pq_pool_wait(ngx_http_request_t *r, ngx_pq_loc_conf_t *plcf) {
+    ngx_http_upstream_srv_conf_t *uscf = plcf->upstream.upstream;
+    if (!uscf || !uscf->srv_conf) return NGX_DECLINED;
+    ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
+    if (!pscf->pool.max || (ngx_queue_empty(&pscf->pool.waiters) && (pscf->pool.idle || pscf->pool.count < pscf->pool.max))) return NGX_DECLINED;
+    if (pscf->pool.waiting >= pscf->pool.queue) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "pq_pool queue is full"); return NGX_HTTP_SERVICE_UNAVAILABLE; }
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    if (!d) {
+        if (!(d = ngx_pcalloc(r->pool, sizeof(*d)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+        ngx_http_set_ctx(r, d, ngx_pq_module);
+    }
+    d->request = r;
+    ngx_http_cleanup_t *cln;
+    if (!(cln = ngx_http_cleanup_add(r, 0))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_http_cleanup_add"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    cln->data = d;
+    cln->handler = ngx_pq_pool_cln_handler;
+    d->pool.event.data = d;
+    d->pool.event.handler = ngx_pq_pool_wait_handler;
+    d->pool.event.log = r->connection->log;
+    d->pool.pscf = pscf;
+    ngx_queue_insert_tail(&pscf->pool.waiters, &d->pool.queue);
+    pscf->pool.waiting++;
+    if (pscf->pool.timeout) ngx_add_timer(&d->pool.event, pscf->pool.timeout);
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "pq pool wait");
+    return NGX_DONE;
+}
+static void ngx_pq_health_done(ngx_pq_save_t *s, ngx_flag_t ok) {
+    ngx_pq_srv_conf_t *pscf = s->health.pscf;
+    ngx_pq_stat_t *stat = s->health.stat;
+    ngx_connection_t *c = s->connection;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V ok = %i", &c->addr_text, ok);
+    if (ok) {
+        stat->fails = 0;
+        if (stat->down && ++stat->passes >= pscf->health.passes) {
+            ngx_log_error(NGX_LOG_NOTICE, c->log, 0, "%V is up", &c->addr_text);
+            stat->down = 0;
+        }
+    } else {
+        stat->passes = 0;
+        if (!stat->down && ++stat->fails >= pscf->health.fails) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0, "%V is down", &c->addr_text);
+            stat->down = 1;
+        }
+    }
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+static void ngx_pq_health_handler(ngx_event_t *ev) {
+    ngx_connection_t *c = ev->data;
+    ngx_pq_save_t *s = c->data;
+    ngx_pq_srv_conf_t *pscf = s->health.pscf;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
+    if (ngx_terminate || ngx_exiting) { ngx_destroy_pool(c->pool); ngx_close_connection(c); return; }
+    if (c->read->timedout || c->write->timedout) { ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "health check timed out"); return ngx_pq_health_done(s, 0); }
+    if (PQstatus(s->conn) != CONNECTION_OK) switch (ngx_pq_poll(s, NULL)) {
+        case NGX_AGAIN: return;
+        case NGX_OK: break;
+        default: return ngx_pq_health_done(s, 0);
+    }
+    if (!s->health.sent) {
+        if (!pscf->health.query.len) return ngx_pq_health_done(s, 1);
+        if (!PQsendQuery(s->conn, (char *)pscf->health.query.data)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQsendQuery"); return ngx_pq_health_done(s, 0); }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQsendQuery('%V')", &pscf->health.query);
+        s->health.sent = 1;
+    }
+    if (PQflush(s->conn) == -1) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "PQflush == -1"); return ngx_pq_health_done(s, 0); }
+    if (!PQconsumeInput(s->conn)) { ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "!PQconsumeInput"); return ngx_pq_health_done(s, 0); }
+    for (PGresult *res; !PQisBusy(s->conn); PQclear(res)) {
+        if (!(res = PQgetResult(s->conn))) return ngx_pq_health_done(s, !s->health.failed);
+        switch (PQresultStatus(res)) {
+            case PGRES_BAD_RESPONSE:
+            case PGRES_FATAL_ERROR: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQresultErrorMessage(res), "health check failed"); s->health.failed = 1; break;
+            default: break;
+        }
+    }
+}
+static void ngx_pq_health_check(ngx_pq_srv_conf_t *pscf) {
+    ngx_http_upstream_srv_conf_t *uscf = pscf->pool.upstream;
+    ngx_http_upstream_rr_peers_t *peers = uscf->peer.data;
+    if (ngx_terminate || ngx_exiting || !pscf->stat.peers || !peers) return;
+    ngx_log_t *log = pscf->log ? pscf->log : ngx_cycle->log;
+    ngx_atomic_uint_t now = ngx_pq_stat_now();
+    ngx_uint_t i = 0;
+    for (ngx_http_upstream_rr_peer_t *peer = peers->peer; peer && i < pscf->stat.number; peer = peer->next, i++) {
+        /* one probe per server and interval for all workers */
+        ngx_pq_stat_t *stat = &pscf->stat.peers[i];
+        ngx_atomic_uint_t checked = stat->checked;
+        if (now - checked < pscf->health.interval || !ngx_atomic_cmp_set(&stat->checked, checked, now)) continue;
+        ngx_peer_connection_t pc;
+        ngx_memzero(&pc, sizeof(pc));
+        pc.log = log;
+        pc.name = &peer->name;
+        pc.sockaddr = peer->sockaddr;
+        pc.socklen = peer->socklen;
+        ngx_pq_save_t *s;
+        if (ngx_pq_peer_connect(&pc, ngx_cycle->pool, uscf, &pscf->connect, pscf->buffer_size, &s) != NGX_AGAIN) {
+            stat->passes = 0;
+            if (!stat->down && ++stat->fails >= pscf->health.fails) { ngx_log_error(NGX_LOG_WARN, log, 0, "%V is down", &peer->name); stat->down = 1; }
+            continue;
+        }
+        ngx_connection_t *c = pc.connection;
+        c->data = s;
+        c->log = log;
+        c->pool->log = log;
+        c->read->handler = ngx_pq_health_handler;
+        c->write->handler = ngx_pq_health_handler;
+        s->health.pscf = pscf;
+        s->health.stat = stat;
+        ngx_add_timer(c->read, pscf->connect.timeout ? pscf->connect.timeout : pscf->health.interval);
+    }
+}
+static void ngx_pq_health_timer_handler(ngx_event_t *ev) {
+    ngx_pq_srv_conf_t *pscf = ev->data;
+    ngx_pq_health_check(pscf);
+    if (!ngx_terminate && !ngx_exiting) ngx_add_timer(ev, pscf->health.interval);
+}
 static void ngx_pq_read_handler(ngx_event_t *ev) {
     ngx_connection_t *c = ev->data;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%V", &c->addr_text);
@@ -838,7 +3386,11 @@ static void ngx_pq_read_handler(ngx_event_t *ev) {
         ngx_pq_save_t *s = cln->data;
         if (!ngx_terminate && !ngx_exiting && !c->error && !ev->error && !ev->timedout) {
             if (s->timeout) ngx_add_timer(c->read, s->timeout);
-            if (ngx_pq_result(s, NULL) == NGX_OK) return;
+            switch (ngx_pq_result(s, NULL)) {
+                case NGX_AGAIN: return;
+                case NGX_OK: return;
+                default: break;
+            }
         }
         return s->read(ev);
     }
@@ -871,20 +3423,174 @@ ret:
 }
 #endif
 
+static void ngx_pq_route_peers(ngx_pq_data_t *d) {
+    ngx_http_request_t *r = d->request;
+    ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+    if (d->peer.get != ngx_http_upstream_get_round_robin_peer) return;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
+    ngx_pq_connect_t *connect = &plcf->connect;
+    ngx_pq_srv_conf_t *pscf = NULL;
+    if (uscf->srv_conf) {
+        pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
+        connect = &pscf->connect;
+    }
+    ngx_http_upstream_rr_peer_data_t *rrp = d->peer.data;
+    ngx_http_upstream_rr_peers_t *peers = rrp->peers;
+    if (peers->single) return;
+    /* stats are kept for primary servers only, rrp->peers is the backup list after round robin fell over to it */
+    ngx_flag_t stat = pscf && pscf->stat.peers && peers == uscf->peer.data;
+    ngx_flag_t health = stat && pscf->health.interval;
+    ngx_flag_t breaker = stat && pscf->breaker.status;
+    if (!plcf->route.type && !health && !breaker) return;
+    uint64_t lsn = 0;
+    if (plcf->route.lsn) {
+        ngx_str_t value;
+        if (ngx_http_complex_value(r, plcf->route.lsn, &value) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_complex_value != NGX_OK"); return; }
+        if (value.len && !(lsn = ngx_pq_lsn_parse(value.data, value.len))) ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "invalid lsn \"%V\"", &value);
+    }
+    /* tier 0 is preferred, higher tiers are used only when no untried peer of a lower tier is left, servers marked down by health checks come last */
+    ngx_uint_t min = NGX_MAX_UINT32_VALUE;
+    ngx_atomic_uint_t now = ngx_pq_stat_now();
+    ngx_http_upstream_rr_peers_rlock(peers);
+    for (ngx_uint_t pass = 0; pass < 2; pass++) {
+        ngx_uint_t i = 0;
+        for (ngx_http_upstream_rr_peer_t *peer = peers->peer; peer; peer = peer->next, i++) {
+            uintptr_t m = (uintptr_t)1 << i % (8 * sizeof(uintptr_t));
+            if (rrp->tried[i / (8 * sizeof(uintptr_t))] & m) continue;
+            if (breaker && i < pscf->stat.number && ngx_pq_breaker_blocked(pscf, &pscf->stat.peers[i], now)) { rrp->tried[i / (8 * sizeof(uintptr_t))] |= m; continue; }
+            ngx_pq_conninfo_t *ci = ngx_pq_conninfo_find(connect, peer->sockaddr, peer->socklen);
+            ngx_uint_t role = ngx_pq_role_get(ci), tier;
+            if (health && i < pscf->stat.number && pscf->stat.peers[i].down) tier = 3;
+            else if (!plcf->route.type) tier = 0;
+            else if (plcf->route.type == ngx_pq_route_write) tier = role == ngx_pq_role_standby;
+            else if (!lsn) tier = role == ngx_pq_role_primary;
+            else if (role != ngx_pq_role_primary && stat && i < pscf->stat.number && pscf->stat.peers[i].lsn >= lsn) tier = 0;
+            else tier = role == ngx_pq_role_standby ? 2 : 1;
+            if (!pass) { if (tier < min) min = tier; }
+            else if (tier > min) rrp->tried[i / (8 * sizeof(uintptr_t))] |= m;
+        }
+    }
+    ngx_http_upstream_rr_peers_unlock(peers);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "route = %ui, lsn = %uL, tier = %ui", plcf->route.type, lsn, min);
+}
+static ngx_int_t ngx_pq_balance_get(ngx_peer_connection_t *pc, ngx_pq_data_t *d, ngx_pq_srv_conf_t *pscf) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", __func__);
+    if (d->peer.get != ngx_http_upstream_get_round_robin_peer || !pscf->stat.peers) return d->peer.get(pc, d->peer.data);
+    ngx_http_upstream_rr_peer_data_t *rrp = d->peer.data;
+    ngx_http_upstream_rr_peers_t *peers = rrp->peers;
+    if (peers->single || peers != pscf->pool.upstream->peer.data) return d->peer.get(pc, d->peer.data);
+    ngx_http_upstream_rr_peer_t *best = NULL;
+    ngx_uint_t b = 0, n = peers->number, next = pscf->balance.next++ % n;
+    uint64_t wait = 0;
+    time_t now = ngx_time();
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_uint_t i = 0;
+    for (ngx_http_upstream_rr_peer_t *peer = peers->peer; peer; peer = peer->next, i++) {
+        if (rrp->tried[i / (8 * sizeof(uintptr_t))] & ((uintptr_t)1 << i % (8 * sizeof(uintptr_t)))) continue;
+        if (peer->down) continue;
+        if (peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout) continue;
+        if (peer->max_conns && peer->conns >= peer->max_conns) continue;
+        uint64_t w = 16;
+        if (i < pscf->stat.number) w = (uint64_t)(pscf->stat.peers[i].queries + 1) * (pscf->stat.peers[i].latency + 16);
+        if (best) {
+            uint64_t x = w * best->weight, y = wait * peer->weight;
+            if (x > y || (x == y && (i + n - next) % n > (b + n - next) % n)) continue;
+        }
+        best = peer;
+        b = i;
+        wait = w;
+    }
+    ngx_http_upstream_rr_peers_unlock(peers);
+    if (!best) return d->peer.get(pc, d->peer.data);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0, "best = %V, wait = %uL", &best->name, wait);
+    ngx_uint_t words = (n + (8 * sizeof(uintptr_t)) - 1) / (8 * sizeof(uintptr_t));
+    uintptr_t one, *tried = &one;
+    if (words > 1 && !(tried = ngx_pnalloc(d->request->pool, words * sizeof(*tried)))) { ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    ngx_memcpy(tried, rrp->tried, words * sizeof(*tried));
+    for (i = 0; i < n; i++) if (i != b) rrp->tried[i / (8 * sizeof(uintptr_t))] |= (uintptr_t)1 << i % (8 * sizeof(uintptr_t));
+    ngx_int_t rc = d->peer.get(pc, d->peer.data);
+    if (rrp->peers != peers) return rc; /* switched to backup servers, tried now belongs to them */
+    for (i = 0; i < words; i++) rrp->tried[i] = tried[i] | (rc == NGX_OK && i == b / (8 * sizeof(uintptr_t)) ? (uintptr_t)1 << b % (8 * sizeof(uintptr_t)) : 0);
+    if (rc != NGX_OK || b >= pscf->stat.number) return rc;
+    d->balance.sent = 0;
+    d->balance.stat = &pscf->stat.peers[b];
+    (void)ngx_atomic_fetch_add(&d->balance.stat->queries, 1);
+    return rc;
+}
+static ngx_int_t ngx_pq_breaker_start(ngx_peer_connection_t *pc, ngx_pq_data_t *d, ngx_pq_srv_conf_t *pscf) {
+    ngx_http_upstream_rr_peers_t *peers = pscf->pool.upstream->peer.data;
+    if (!pscf->stat.peers || !peers) return NGX_OK;
+    ngx_uint_t i = 0;
+    ngx_http_upstream_rr_peer_t *peer;
+    for (peer = peers->peer; peer && peer->sockaddr != pc->sockaddr; peer = peer->next) i++;
+    if (!peer || i >= pscf->stat.number) return NGX_OK;
+    ngx_pq_stat_t *stat = &pscf->stat.peers[i];
+    ngx_atomic_uint_t probes;
+    switch (ngx_pq_breaker_state(pscf, stat, ngx_pq_stat_now())) {
+        case ngx_pq_breaker_open: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%V circuit breaker is open", pc->name); return NGX_BUSY;
+        case ngx_pq_breaker_half_open:
+            /* routing only saw a free probe slot, take it here since other requests may have taken it since */
+            do if ((probes = stat->probes) >= pscf->breaker.probes) { ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%V no probe slot", pc->name); return NGX_BUSY; } while (!ngx_atomic_cmp_set(&stat->probes, probes, probes + 1));
+            d->breaker.probe = 1;
+            break;
+        default: d->breaker.probe = 0; break;
+    }
+    d->breaker.name = pc->name;
+    d->breaker.pscf = pscf;
+    d->breaker.start = ngx_pq_stat_now();
+    d->breaker.stat = stat;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%V probe = %i", pc->name, d->breaker.probe);
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_breaker_check(ngx_http_request_t *r, ngx_pq_loc_conf_t *plcf) {
+    ngx_http_upstream_srv_conf_t *uscf = plcf->upstream.upstream;
+    if (!uscf || !uscf->srv_conf) return NGX_DECLINED;
+    ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
+    if (!pscf->breaker.status || !pscf->stat.peers) return NGX_DECLINED;
+    ngx_atomic_uint_t now = ngx_pq_stat_now();
+    for (ngx_uint_t i = 0; i < pscf->stat.number; i++) if (!ngx_pq_breaker_blocked(pscf, &pscf->stat.peers[i], now)) return NGX_DECLINED;
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "circuit breaker is open for all servers of upstream \"%V\"", &uscf->host);
+    return pscf->breaker.status;
+}
 static ngx_int_t ngx_pq_peer_get(ngx_peer_connection_t *pc, void *data) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "%s", __func__);
     ngx_pq_data_t *d = data;
+    ngx_http_request_t *r = d->request;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_http_upstream_srv_conf_t *uscf = u->conf->upstream;
+    ngx_pq_srv_conf_t *pscf = uscf->srv_conf ? ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module) : NULL;
     ngx_int_t rc;
-    switch ((rc = d->peer.get(pc, d->peer.data))) {
-        case NGX_DONE: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "peer.get = NGX_DONE"); break;
-        case NGX_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "peer.get = NGX_OK"); break;
-        default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "peer.get = %i", rc); return rc;
+    for (;;) {
+        ngx_pq_route_peers(d);
+        switch ((rc = pscf && pscf->balance.method ? ngx_pq_balance_get(pc, d, pscf) : d->peer.get(pc, d->peer.data))) {
+            case NGX_DONE: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "peer.get = NGX_DONE"); break;
+            case NGX_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "peer.get = NGX_OK"); break;
+            default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "peer.get = %i", rc); return rc;
+        }
+        if (!pscf || !pscf->breaker.status || ngx_pq_breaker_start(pc, d, pscf) == NGX_OK) break;
+        /* round robin marked the peer tried, so the next round picks another one or gives up, a single peer is never marked */
+        ngx_pq_balance_done(d, 1);
+        d->peer.free(pc, d->peer.data, 0);
+        if (((ngx_http_upstream_rr_peer_data_t *)d->peer.data)->peers->single) return NGX_BUSY;
+        pc->tries++;
+    }
+    if (!pc->connection) {
+        if (pscf && pscf->multiplex.max) return ngx_pq_multiplex_get(pc, d, pscf);
+        if (!pscf || !pscf->pool.max) return ngx_pq_peer_open(pc, data);
+        if ((rc = ngx_pq_pool_get(pc, d, pscf)) != NGX_DONE) return rc;
     }
-    if (!pc->connection) return ngx_pq_peer_open(pc, data);
+    return ngx_pq_peer_save(pc, d);
+}
+static ngx_int_t ngx_pq_peer_save(ngx_peer_connection_t *pc, ngx_pq_data_t *d) {
     ngx_connection_t *c = pc->connection;
     for (ngx_pool_cleanup_t *cln = c->pool->cleanup; cln; cln = cln->next) if (cln->handler == ngx_pq_save_cln_handler) {
         ngx_pq_save_t *s = d->save = cln->data;
         if (PQstatus(s->conn) != CONNECTION_OK) { ngx_pq_log_error(NGX_LOG_ERR, pc->log, 0, PQerrorMessage(s->conn), "CONNECTION_BAD"); return NGX_DECLINED; }
+        if (s->pool.pscf && !s->pool.ready) {
+            s->pool.ready = 1;
+            return ngx_pq_queries(s, d, ngx_pq_type_location|ngx_pq_type_upstream);
+        }
         return ngx_pq_queries(s, d, ngx_pq_type_location);
     }
     ngx_log_error(NGX_LOG_ERR, pc->log, 0, "!s");
@@ -893,14 +3599,67 @@ static ngx_int_t ngx_pq_peer_get(ngx_peer_connection_t *pc, void *data) {
 static void ngx_pq_peer_free(ngx_peer_connection_t *pc, void *data, ngx_uint_t state) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0, "state = %ui", state);
     ngx_pq_data_t *d = data;
-    d->peer.free(pc, d->peer.data, state);
     ngx_pq_save_t *s = d->save;
+    ngx_pq_balance_done(d, !(state & NGX_PEER_FAILED) && ngx_queue_empty(&d->queue));
+    ngx_pq_breaker_done(d, !(state & NGX_PEER_FAILED));
+    if (d->pool.connection) {
+        ngx_queue_remove(&d->pool.queue);
+        d->pool.pscf->pool.waiting--;
+        d->pool.pscf = NULL;
+        d->peer.free(pc, d->peer.data, state);
+        ngx_pq_multiplex_close(d->pool.connection);
+        d->pool.connection = pc->connection = NULL;
+        return;
+    }
+    if (d->multiplex.on) {
+        ngx_http_request_t *r = d->request;
+        ngx_http_upstream_t *u = r->upstream;
+        u->keepalive = 0;
+        d->peer.free(pc, d->peer.data, state);
+        d->multiplex.on = 0;
+        if (pc->connection) ngx_pq_multiplex_close(pc->connection);
+        pc->connection = NULL;
+        if (!s) return;
+        ngx_queue_remove(&d->multiplex.queue);
+        s->multiplex.count--;
+        for (ngx_queue_t *q = ngx_queue_head(&s->multiplex.slots); q != ngx_queue_sentinel(&s->multiplex.slots); q = ngx_queue_next(q)) {
+            ngx_pq_slot_t *slot = ngx_queue_data(q, ngx_pq_slot_t, queue);
+            if (slot->data == d) slot->data = NULL;
+        }
+        while (!ngx_queue_empty(&d->queue)) {
+            ngx_queue_t *q = ngx_queue_head(&d->queue);
+            ngx_queue_remove(q);
+            ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
+            if (!qq->statement) continue;
+            ngx_queue_remove(&qq->statement->queue);
+            ngx_queue_insert_tail(&s->statements.deallocate, &qq->statement->queue);
+            s->statements.count--;
+        }
+        d->save = NULL;
+        if (!s->multiplex.count) ngx_pq_multiplex_idle(s);
+        return;
+    }
+    if (s && s->pool.pscf) {
+        ngx_http_request_t *r = d->request;
+        ngx_http_upstream_t *u = r->upstream;
+        ngx_connection_t *c = pc->connection;
+        if (c && u->keepalive && !(state & NGX_PEER_FAILED) && ngx_queue_empty(&d->queue) && !c->read->eof && !c->read->error && !c->read->timedout && !c->write->error && !c->write->timedout && ngx_pq_pool_put(s) == NGX_OK) pc->connection = NULL;
+        u->keepalive = 0;
+        d->peer.free(pc, d->peer.data, state);
+        if (!pc->connection) { d->save = NULL; return; }
+    } else d->peer.free(pc, d->peer.data, state);
     if (!s) return;
     s->keepalive = (pc->connection == NULL);
     if (!ngx_queue_empty(&d->queue)) {
         while (!ngx_queue_empty(&d->queue)) {
             ngx_queue_t *q = ngx_queue_head(&d->queue);
             ngx_queue_remove(q);
+            ngx_pq_query_queue_t *qq = ngx_queue_data(q, ngx_pq_query_queue_t, queue);
+            if (qq->statement) {
+                ngx_queue_remove(&qq->statement->queue);
+                ngx_queue_insert_tail(&s->statements.deallocate, &qq->statement->queue);
+                s->statements.count--;
+            }
             s->count++;
         }
 #ifdef LIBPQ_HAS_ASYNC_CANCEL
@@ -990,8 +3749,8 @@ cont:;
 
 static ngx_int_t ngx_pq_peer_init(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "srv_conf = %s", uscf->srv_conf ? "true" : "false");
-    ngx_pq_data_t *d;
-    if (!(d = ngx_pcalloc(r->pool, sizeof(*d)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    if (!d && !(d = ngx_pcalloc(r->pool, sizeof(*d)))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pcalloc"); return NGX_ERROR; }
     ngx_queue_init(&d->queue);
     if (uscf->srv_conf) {
         ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
@@ -1010,12 +3769,78 @@ static ngx_int_t ngx_pq_peer_init(ngx_http_request_t *r, ngx_http_upstream_srv_c
     return NGX_OK;
 }
 
+static ngx_int_t ngx_pq_stat_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_pq_srv_conf_t *opscf = data;
+    ngx_pq_srv_conf_t *pscf = shm_zone->data;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (opscf && opscf->stat.number == pscf->stat.number && opscf->stat.hash == pscf->stat.hash) {
+        pscf->stat.peers = opscf->stat.peers;
+        return NGX_OK;
+    }
+    if (shm_zone->shm.exists) {
+        pscf->stat.peers = shpool->data;
+        return NGX_OK;
+    }
+    if (opscf && opscf->stat.peers) ngx_slab_free(shpool, opscf->stat.peers);
+    if (!(pscf->stat.peers = ngx_slab_calloc(shpool, pscf->stat.number * sizeof(*pscf->stat.peers)))) { ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "!ngx_slab_calloc"); return NGX_ERROR; }
+    shpool->data = pscf->stat.peers;
+    return NGX_OK;
+}
+static ngx_int_t ngx_pq_stat_init(ngx_conf_t *cf, ngx_pq_srv_conf_t *pscf, ngx_http_upstream_srv_conf_t *uscf) {
+    ngx_http_upstream_rr_peers_t *peers = uscf->peer.data;
+    if (!peers || !peers->number) return NGX_OK;
+    pscf->stat.number = peers->number;
+    /* stats are reused on reload only for the same servers in the same order */
+    ngx_crc32_init(pscf->stat.hash);
+    for (ngx_http_upstream_rr_peer_t *peer = peers->peer; peer; peer = peer->next) ngx_crc32_update(&pscf->stat.hash, (u_char *)peer->sockaddr, peer->socklen);
+    ngx_crc32_final(pscf->stat.hash);
+    ngx_str_t name;
+    name.len = sizeof("pq:") - 1 + uscf->host.len;
+    if (!(name.data = ngx_pnalloc(cf->pool, name.len))) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    (void)ngx_sprintf(name.data, "pq:%V", &uscf->host);
+    size_t size = ngx_align(8 * ngx_pagesize + pscf->stat.number * sizeof(*pscf->stat.peers), ngx_pagesize);
+    if (!(pscf->stat.zone = ngx_shared_memory_add(cf, &name, size, &ngx_pq_module))) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "!ngx_shared_memory_add"); return NGX_ERROR; }
+    if (pscf->stat.zone->data) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "duplicate zone \"%V\"", &name); return NGX_ERROR; }
+    pscf->stat.zone->data = pscf;
+    pscf->stat.zone->init = ngx_pq_stat_init_zone;
+    ngx_uint_t i = 0;
+    for (ngx_http_upstream_rr_peer_t *peer = peers->peer; peer; peer = peer->next, i++) {
+        ngx_pq_conninfo_t *ci = ngx_pq_conninfo_find(&pscf->connect, peer->sockaddr, peer->socklen);
+        if (!ci || ci->stat) continue;
+        ci->peers = &pscf->stat.peers;
+        ci->stat = i + 1;
+    }
+    return NGX_OK;
+}
 static ngx_int_t ngx_pq_peer_init_upstream(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *uscf) {
     if (uscf->srv_conf) {
         ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_pq_module);
         if (pscf->peer.init_upstream(cf, uscf) != NGX_OK) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "peer.init_upstream != NGX_OK"); return NGX_ERROR; }
+        if (ngx_pq_conninfo_init(cf, &pscf->connect, uscf) != NGX_OK) return NGX_ERROR;
+        if (ngx_pq_stat_init(cf, pscf, uscf) != NGX_OK) return NGX_ERROR;
         pscf->peer.init = uscf->peer.init ? uscf->peer.init : ngx_http_upstream_init_round_robin_peer;
         ngx_conf_init_size_value(pscf->buffer_size, (size_t)ngx_pagesize);
+        ngx_conf_init_uint_value(pscf->multiplex.max, 0);
+        ngx_conf_init_msec_value(pscf->multiplex.idle_timeout, 60 * 1000);
+        ngx_queue_init(&pscf->multiplex.queue);
+        if (pscf->multiplex.max && pscf->pool.max) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "pq_pool is incompatible with pq_multiplex"); return NGX_ERROR; }
+        /* keepalive declared before pq_pool is wrapped by ngx_pq_peer_init_upstream and would keep pool connections */
+        if (pscf->pool.max && pscf->peer.init != ngx_http_upstream_init_round_robin_peer) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "pq_pool requires round-robin balancing"); return NGX_ERROR; }
+        /* health check and circuit breaker exclusion steer the round robin tried bitmap, other balancers and keepalive would ignore it */
+        if (pscf->health.interval && pscf->peer.init != ngx_http_upstream_init_round_robin_peer) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "pq_health_check requires round-robin balancing"); return NGX_ERROR; }
+        if (pscf->breaker.status && pscf->peer.init != ngx_http_upstream_init_round_robin_peer) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "pq_circuit_breaker requires round-robin balancing"); return NGX_ERROR; }
+        pscf->pool.upstream = uscf;
+        pscf->pool.event.data = pscf;
+        pscf->pool.event.handler = ngx_pq_pool_event_handler;
+        pscf->pool.event.log = cf->log;
+        pscf->pool.timer.cancelable = 1;
+        pscf->pool.timer.data = pscf;
+        pscf->pool.timer.handler = ngx_pq_pool_timer_handler;
+        pscf->pool.timer.log = cf->log;
+        pscf->health.timer.cancelable = 1;
+        pscf->health.timer.data = pscf;
+        pscf->health.timer.handler = ngx_pq_health_timer_handler;
+        pscf->health.timer.log = cf->log;
     } else {
         if (ngx_http_upstream_init_round_robin(cf, uscf) != NGX_OK) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "ngx_http_upstream_init_round_robin != NGX_OK"); return NGX_ERROR; }
     }
@@ -1024,6 +3849,7 @@ static ngx_int_t ngx_pq_peer_init_upstream(ngx_conf_t *cf, ngx_http_upstream_srv
 }
 
 static void ngx_http_upstream_next_my(ngx_http_request_t *r, ngx_http_upstream_t *u, ngx_uint_t ft_type) {
+    if (u->header_sent) return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
     ngx_http_upstream_handler_pt read_event_handler = u->read_event_handler;
     ngx_http_upstream_handler_pt write_event_handler = u->write_event_handler;
     ngx_http_upstream_next(r, u, ft_type);
@@ -1033,13 +3859,27 @@ static void ngx_http_upstream_next_my(ngx_http_request_t *r, ngx_http_upstream_t
 
 static void ngx_pq_event_handler(ngx_http_request_t *r, ngx_http_upstream_t *u) {
     ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    ngx_int_t rc = NGX_AGAIN;
+    if (d->pool.connection) {
+        ngx_connection_t *c = u->peer.connection;
+        if (!c->write->timedout) return;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT, "pq_pool queue timed out");
+        return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+    }
+    if (d->multiplex.on) {
+        ngx_connection_t *c = u->peer.connection;
+        if (c->read->timedout || c->write->timedout) return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+        if (!d->multiplex.done) return;
+        rc = d->multiplex.rc;
+        goto ret;
+    }
     ngx_pq_save_t *s = d->save;
     ngx_connection_t *c = s->connection;
-    ngx_int_t rc = NGX_AGAIN;
     switch (PQstatus(s->conn)) {
         case CONNECTION_BAD: ngx_pq_log_error(NGX_LOG_ERR, c->log, 0, PQerrorMessage(s->conn), "CONNECTION_BAD"); rc = NGX_DECLINED; goto ret;
         case CONNECTION_OK: ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "CONNECTION_OK");
             if (c->read->timedout || c->write->timedout) return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+            if (!u->buffering && u->busy_bufs) { ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "u->busy_bufs"); return; }
             rc = ngx_pq_result(s, d);
             goto ret;
         default: ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "PQstatus = %i", PQstatus(s->conn)); break;
@@ -1056,6 +3896,34 @@ ret:
     }
 }
 
+static void ngx_pq_downstream_handler(ngx_http_request_t *r) {
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_connection_t *c = r->connection;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "%s", __func__);
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        return ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+    }
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) return ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+    ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs, &u->out_bufs, u->output.tag);
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    switch (ngx_pq_stream(d)) {
+        case NGX_OK: break;
+        case NGX_AGAIN: return;
+        default: return ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+    }
+    if (!u->peer.connection) return;
+    ngx_pq_event_handler(r, u);
+}
+
+static void ngx_pq_request_body_handler(ngx_http_request_t *r) {
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    if (!u->peer.connection) return;
+    ngx_pq_event_handler(r, u);
+}
+
 static void ngx_pq_abort_request(ngx_http_request_t *r) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
 }
@@ -1082,21 +3950,25 @@ static void ngx_pq_finalize_request(ngx_http_request_t *r, ngx_int_t rc) {
     u->request_body_sent = 1;
     ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
     ngx_pq_save_t *s = d->save;
-    if (!s) return;
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) return;
-    if (!r->headers_out.status) {
-        if (d->empty) {
-            ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
-            r->headers_out.status = plcf->empty;
-        } else {
-            r->headers_out.status = NGX_HTTP_OK;
+    /* a leader failing before it got a connection still hands its status to the waiters */
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE || (!s && !d->multiplex.on)) { ngx_pq_coalesce_done(r, d, rc); return; }
+    if (!u->header_sent) {
+        if (!r->headers_out.status) {
+            if (d->empty) {
+                ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
+                r->headers_out.status = plcf->empty;
+            } else {
+                r->headers_out.status = NGX_HTTP_OK;
+            }
         }
+        r->headers_out.content_length_n = 0;
+        for (ngx_chain_t *cl = u->out_bufs; cl; cl = cl->next) r->headers_out.content_length_n += cl->buf->last - cl->buf->pos;
+        if (d->cache.on && rc == NGX_OK && r->headers_out.status == NGX_HTTP_OK) ngx_pq_cache_set(r, d);
+        ngx_pq_coalesce_done(r, d, rc);
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return;
+        u->header_sent = 1;
     }
-    r->headers_out.content_length_n = 0;
-    for (ngx_chain_t *cl = u->out_bufs; cl; cl = cl->next) r->headers_out.content_length_n += cl->buf->last - cl->buf->pos;
-    rc = ngx_http_send_header(r);
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return;
-    u->header_sent = 1;
     if (!u->out_bufs) return;
     if (ngx_http_output_filter(r, u->out_bufs) != NGX_OK) return;
     ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs, &u->out_bufs, u->output.tag);
@@ -1105,9 +3977,37 @@ static ngx_int_t ngx_pq_process_header(ngx_http_request_t *r) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
     return NGX_OK;
 }
+static ngx_int_t ngx_pq_prefix_get_handler(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_pq_reinit_request(ngx_http_request_t *r) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
     ngx_http_upstream_t *u = r->upstream;
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    if (d && d->copy.started && !r->request_body_no_buffering) {
+        off_t file_pos = 0;
+        for (ngx_chain_t *cl = r->request_body->bufs; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->start;
+            if (!cl->buf->in_file) continue;
+            cl->buf->file_pos = file_pos;
+            file_pos = cl->buf->file_last;
+        }
+    }
+    if (d) {
+        d->copy.in = NULL;
+        d->copy.next = 0;
+        d->copy.started = 0;
+        d->lsn.sent = 0;
+        ngx_str_null(&d->lsn.value);
+        if (d->prefix) ngx_pq_prefix_cleanup_handler(d);
+        ngx_http_core_main_conf_t *cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+        ngx_http_variable_t *variable = cmcf->variables.elts;
+        for (ngx_uint_t i = 0; i < cmcf->variables.nelts; i++) if (variable[i].get_handler == ngx_pq_prefix_get_handler) r->variables[i].valid = r->variables[i].not_found = 0;
+        if (d->variables) {
+            ngx_pq_main_conf_t *pmcf = ngx_http_get_module_main_conf(r, ngx_pq_module);
+            ngx_int_t *index = pmcf->variables.elts;
+            for (ngx_uint_t i = 0; i < pmcf->variables.nelts; i++) r->variables[index[i]].valid = r->variables[index[i]].not_found = 0;
+            d->variables = NULL;
+        }
+    }
     r->state = 0;
     u->read_event_handler = ngx_pq_event_handler;
     u->write_event_handler = ngx_pq_event_handler;
@@ -1116,35 +4016,55 @@ static ngx_int_t ngx_pq_reinit_request(ngx_http_request_t *r) {
 
 static ngx_int_t ngx_pq_variable_get_handler(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    v->no_cacheable = 1;
     v->not_found = 1;
     ngx_http_upstream_t *u = r->upstream;
     if (!u) return NGX_OK;
     ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
     if (!d) return NGX_OK;
+    ngx_pq_variables_t *variables = d->variables;
     ngx_pq_save_t *s = d->save;
-    if (!s) return NGX_OK;
-    ngx_int_t index = data;
-    ngx_array_t *variables;
-    ngx_pq_variable_t *variable;
-    variables = &d->variables;
-    variable = variables->elts;
-    for (ngx_uint_t i = 0; i < variables->nelts; i++) if (variable[i].index == index) {
-        for (ngx_chain_t *cl = variable[i].cl; cl; cl = cl->next) v->len += cl->buf->last - cl->buf->pos;
-        u_char *p;
-        if (!(p = v->data = ngx_pnalloc(r->pool, v->len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
-        for (ngx_chain_t *cl = variable[i].cl; cl; cl = cl->next) p = ngx_copy(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
-        v->no_cacheable = 0;
-        v->not_found = 0;
-        v->valid = 1;
-        return NGX_OK;
+    if (u->peer.connection && s && s->variables && s->variables != variables) {
+        ngx_pool_cleanup_t *cln;
+        if (!(cln = ngx_pool_cleanup_add(r->pool, 0))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pool_cleanup_add"); return NGX_ERROR; }
+        variables = d->variables = s->variables;
+        variables->count++;
+        cln->handler = ngx_pq_variables_release;
+        cln->data = variables;
     }
-    variables = &s->variables;
-    variable = variables->elts;
-    for (ngx_uint_t i = 0; i < variables->nelts; i++) if (variable[i].index == index) {
-        for (ngx_chain_t *cl = variable[i].cl; cl; cl = cl->next) v->len += cl->buf->last - cl->buf->pos;
-        u_char *p;
-        if (!(p = v->data = ngx_pnalloc(r->pool, v->len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
-        for (ngx_chain_t *cl = variable[i].cl; cl; cl = cl->next) p = ngx_copy(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    if (!variables || data >= variables->nelts) return NGX_OK;
+    ngx_pq_variable_t *variable = &variables->variables[data];
+    if (!variable->value.data) return NGX_OK;
+    v->data = variable->value.data;
+    v->len = variable->value.len;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->valid = 1;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_pq_prefix_get_handler(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    v->no_cacheable = 1;
+    v->not_found = 1;
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    if (!d || !d->prefix) return NGX_OK;
+    ngx_str_t *name = (ngx_str_t *)data;
+    ngx_pq_main_conf_t *pmcf = ngx_http_get_module_main_conf(r, ngx_pq_module);
+    ngx_str_t *prefix = pmcf->prefixes.elts;
+    ngx_uint_t slot = pmcf->prefixes.nelts;
+    for (ngx_uint_t i = 0; i < pmcf->prefixes.nelts; i++) if (name->len > prefix[i].len && !ngx_strncasecmp(name->data, prefix[i].data, prefix[i].len) && (slot == pmcf->prefixes.nelts || prefix[i].len > prefix[slot].len)) slot = i;
+    if (slot == pmcf->prefixes.nelts) return NGX_OK;
+    PGresult *res = d->prefix[slot];
+    if (!res || !PQntuples(res)) return NGX_OK;
+    u_char *column = name->data + prefix[slot].len;
+    size_t len = name->len - prefix[slot].len;
+    for (int col = 0; col < PQnfields(res); col++) {
+        const char *fname = PQfname(res, col);
+        if (ngx_strlen(fname) != len || ngx_strncasecmp((u_char *)fname, column, len)) continue;
+        if (PQgetisnull(res, 0, col)) return NGX_OK;
+        v->data = (u_char *)PQgetvalue(res, 0, col);
+        v->len = PQgetlength(res, 0, col);
         v->no_cacheable = 0;
         v->not_found = 0;
         v->valid = 1;
@@ -1178,11 +4098,15 @@ static ngx_int_t ngx_pq_error_get_handler(ngx_http_request_t *r, ngx_http_variab
     if (!u) return NGX_OK;
     ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
     if (!d) return NGX_OK;
-    ngx_str_t *error = (ngx_str_t *)((u_char *)&d->error + data);
-    v->data = error->data;
-    if (!(v->len = error->len)) return NGX_OK;
+    if (!d->error.res) return NGX_OK;
+    char *err;
+    if (!(err = PQresultErrorField(d->error.res, data))) return NGX_OK;
+    if (!(v->len = ngx_strlen(err))) return NGX_OK;
+    /* d->error.res is cleared when next error replaces it, so value is copied and never cached */
+    if (!(v->data = ngx_pnalloc(r->pool, v->len))) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "!ngx_pnalloc"); return NGX_ERROR; }
+    ngx_memcpy(v->data, err, v->len);
     v->valid = 1;
-    v->no_cacheable = 0;
+    v->no_cacheable = 1;
     v->not_found = 0;
     return NGX_OK;
 }
@@ -1202,6 +4126,18 @@ static ngx_int_t ngx_pq_parameter_status_get_handler(ngx_http_request_t *r, ngx_
     v->not_found = 0;
     return NGX_OK;
 }
+static ngx_int_t ngx_pq_lsn_get_handler(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    v->not_found = 1;
+    ngx_pq_data_t *d = ngx_http_get_module_ctx(r, ngx_pq_module);
+    if (!d || !d->lsn.value.len) return NGX_OK;
+    v->data = d->lsn.value.data;
+    v->len = d->lsn.value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    return NGX_OK;
+}
 static ngx_int_t ngx_pq_pid_get_handler(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
     v->not_found = 1;
@@ -1260,11 +4196,11 @@ static ngx_http_variable_t ngx_pq_variables[] = {
   { ngx_string("pq_application_name"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"application_name", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_cipher"), NULL, ngx_pq_ssl_attribute_get_handler, (uintptr_t)"key_cipher", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_client_encoding"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"client_encoding", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_column_name"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, column_name), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_column_name"), NULL, ngx_pq_error_get_handler, PG_DIAG_COLUMN_NAME, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_compression"), NULL, ngx_pq_ssl_attribute_get_handler, (uintptr_t)"key_compression", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_constraint_name"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, constraint_name), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_context"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, context), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_datatype_name"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, datatype_name), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_constraint_name"), NULL, ngx_pq_error_get_handler, PG_DIAG_CONSTRAINT_NAME, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_context"), NULL, ngx_pq_error_get_handler, PG_DIAG_CONTEXT, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_datatype_name"), NULL, ngx_pq_error_get_handler, PG_DIAG_DATATYPE_NAME, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_datestyle"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"DateStyle", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_db"), NULL, ngx_pq_conn_get_handler, (uintptr_t)PQdb, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_default_transaction_read_only"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"default_transaction_read_only", NGX_HTTP_VAR_CHANGEABLE, 0 },
@@ -1272,32 +4208,33 @@ static ngx_http_variable_t ngx_pq_variables[] = {
   { ngx_string("pq_host"), NULL, ngx_pq_conn_get_handler, (uintptr_t)PQhost, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_in_hot_standby"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"in_hot_standby", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_integer_datetimes"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"integer_datetimes", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_internal_position"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, internal_position), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_internal_query"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, internal_query), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_internal_position"), NULL, ngx_pq_error_get_handler, PG_DIAG_INTERNAL_POSITION, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_internal_query"), NULL, ngx_pq_error_get_handler, PG_DIAG_INTERNAL_QUERY, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_intervalstyle"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"IntervalStyle", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_is_superuser"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"is_superuser", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_key_bits"), NULL, ngx_pq_ssl_attribute_get_handler, (uintptr_t)"key_bits", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_library"), NULL, ngx_pq_ssl_attribute_get_handler, (uintptr_t)"library", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_message_detail"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, message_detail), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_message_hint"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, message_hint), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_message_primary"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, message_primary), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_lsn"), NULL, ngx_pq_lsn_get_handler, 0, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_message_detail"), NULL, ngx_pq_error_get_handler, PG_DIAG_MESSAGE_DETAIL, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_message_hint"), NULL, ngx_pq_error_get_handler, PG_DIAG_MESSAGE_HINT, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_message_primary"), NULL, ngx_pq_error_get_handler, PG_DIAG_MESSAGE_PRIMARY, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_options"), NULL, ngx_pq_conn_get_handler, (uintptr_t)PQoptions, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_pid"), NULL, ngx_pq_pid_get_handler, 0, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_port"), NULL, ngx_pq_conn_get_handler, (uintptr_t)PQport, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_protocol"), NULL, ngx_pq_ssl_attribute_get_handler, (uintptr_t)"protocol", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_schema_name"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, schema_name), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_schema_name"), NULL, ngx_pq_error_get_handler, PG_DIAG_SCHEMA_NAME, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_server_encoding"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"server_encoding", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_server_version"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"server_version", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_session_authorization"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"session_authorization", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_severity_nonlocalized"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, severity_nonlocalized), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_severity"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, severity), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_source_file"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, source_file), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_source_function"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, source_function), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_source_line"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, source_line), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_sqlstate"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, sqlstate), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_severity_nonlocalized"), NULL, ngx_pq_error_get_handler, PG_DIAG_SEVERITY_NONLOCALIZED, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_severity"), NULL, ngx_pq_error_get_handler, PG_DIAG_SEVERITY, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_source_file"), NULL, ngx_pq_error_get_handler, PG_DIAG_SOURCE_FILE, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_source_function"), NULL, ngx_pq_error_get_handler, PG_DIAG_SOURCE_FUNCTION, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_source_line"), NULL, ngx_pq_error_get_handler, PG_DIAG_SOURCE_LINE, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_sqlstate"), NULL, ngx_pq_error_get_handler, PG_DIAG_SQLSTATE, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_standard_conforming_strings"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"standard_conforming_strings", NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_statement_position"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, statement_position), NGX_HTTP_VAR_CHANGEABLE, 0 },
-  { ngx_string("pq_table_name"), NULL, ngx_pq_error_get_handler, offsetof(ngx_pq_error_t, table_name), NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_statement_position"), NULL, ngx_pq_error_get_handler, PG_DIAG_STATEMENT_POSITION, NGX_HTTP_VAR_CHANGEABLE, 0 },
+  { ngx_string("pq_table_name"), NULL, ngx_pq_error_get_handler, PG_DIAG_TABLE_NAME, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_timezone"), NULL, ngx_pq_parameter_status_get_handler, (uintptr_t)"TimeZone", NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_transaction_status"), NULL, ngx_pq_transaction_status_get_handler, 0, NGX_HTTP_VAR_CHANGEABLE, 0 },
   { ngx_string("pq_user"), NULL, ngx_pq_conn_get_handler, (uintptr_t)PQuser, NGX_HTTP_VAR_CHANGEABLE, 0 },
@@ -1310,6 +4247,16 @@ static ngx_int_t ngx_pq_handler(ngx_http_request_t *r) {
     ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
     if (!plcf->upstream.pass_request_body && (rc = ngx_http_discard_request_body(r)) != NGX_OK) return rc;
     if (ngx_http_set_content_type(r) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_set_content_type != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
+    if (plcf->cache.zone && !plcf->upstream.pass_request_body && (rc = ngx_pq_cache_get(r, plcf)) != NGX_DECLINED) return rc;
+    if (plcf->coalesce && plcf->upstream.buffering && !plcf->upstream.pass_request_body && (rc = ngx_pq_coalesce(r, plcf)) != NGX_DECLINED) return rc;
+    if ((rc = ngx_pq_breaker_check(r, plcf)) != NGX_DECLINED) return rc;
+    if ((rc = ngx_pq_pool_wait(r, plcf)) != NGX_DECLINED) return rc;
+    return ngx_pq_upstream(r);
+}
+static ngx_int_t ngx_pq_upstream(ngx_http_request_t *r) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%s", __func__);
+    ngx_int_t rc;
+    ngx_pq_loc_conf_t *plcf = ngx_http_get_module_loc_conf(r, ngx_pq_module);
     if (ngx_http_upstream_create(r) != NGX_OK) { ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_http_upstream_create != NGX_OK"); return NGX_HTTP_INTERNAL_SERVER_ERROR; }
     ngx_http_upstream_t *u = r->upstream;
     ngx_str_set(&u->schema, "pq://");
@@ -1322,7 +4269,7 @@ static ngx_int_t ngx_pq_handler(ngx_http_request_t *r) {
     u->process_header = ngx_pq_process_header;
     u->reinit_request = ngx_pq_reinit_request;
     u->buffering = u->conf->buffering;
-    if (!u->conf->request_buffering && u->conf->pass_request_body && !r->headers_in.chunked) r->request_body_no_buffering = 1;
+    if (!u->conf->request_buffering && u->conf->pass_request_body) r->request_body_no_buffering = 1;
     if ((rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init)) >= NGX_HTTP_SPECIAL_RESPONSE) return rc;
     return NGX_DONE;
 }
@@ -1354,6 +4301,30 @@ static char *ngx_pq_argument_output_loc_conf(ngx_conf_t *cf, ngx_pq_query_t *que
             continue;
         }
         if (str[i].len > sizeof("output=") - 1 && !ngx_strncasecmp(str[i].data, (u_char *)"output=", sizeof("output=") - 1)) {
+            if (str[i].data[sizeof("output=") - 1] == '$' && str[i].data[str[i].len - 1] == '*') {
+                if (!(query->type & ngx_pq_type_location)) return "prefix output allowed only in location";
+                if (str[i].len - (sizeof("output=") - 1) < sizeof("$*")) return "empty prefix";
+                ngx_str_t name;
+                name.len = str[i].len - (sizeof("output=") - 1) - sizeof("$*") + 1;
+                if (!(name.data = ngx_pnalloc(cf->pool, name.len + 1))) return "!ngx_pnalloc";
+                ngx_memcpy(name.data, str[i].data + sizeof("output=") - 1 + 1, name.len);
+                if (name.data[name.len - 1] != '_') name.data[name.len++] = '_';
+                ngx_strlow(name.data, name.data, name.len);
+                ngx_pq_main_conf_t *pmcf = ngx_http_conf_get_module_main_conf(cf, ngx_pq_module);
+                ngx_str_t *prefix = pmcf->prefixes.elts;
+                for (query->slot = 0; query->slot < pmcf->prefixes.nelts; query->slot++) if (prefix[query->slot].len == name.len && !ngx_strncmp(prefix[query->slot].data, name.data, name.len)) break;
+                if (query->slot == pmcf->prefixes.nelts) {
+                    ngx_http_variable_t *variable;
+                    if (!(variable = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_PREFIX))) return "!ngx_http_add_variable";
+                    variable->get_handler = ngx_pq_prefix_get_handler;
+                    if (!(prefix = ngx_array_push(&pmcf->prefixes))) return "!ngx_array_push";
+                    *prefix = name;
+                }
+                query->prefix = 1;
+                query->output = 0;
+                query->resultFormat = 0;
+                continue;
+            }
             if (str[i].data[sizeof("output=") - 1] == '$' && query->type & ngx_pq_type_upstream) {
                 ngx_str_t name = str[i];
                 name.data += sizeof("output=") - 1 + 1;
@@ -1361,16 +4332,24 @@ static char *ngx_pq_argument_output_loc_conf(ngx_conf_t *cf, ngx_pq_query_t *que
                 ngx_http_variable_t *variable;
                 if (!(variable = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_CHANGEABLE))) return "!ngx_http_add_variable";
                 if ((query->index = ngx_http_get_variable_index(cf, &name)) == NGX_ERROR) return "ngx_http_get_variable_index == NGX_ERROR";
+                ngx_pq_main_conf_t *pmcf = ngx_http_conf_get_module_main_conf(cf, ngx_pq_module);
+                ngx_int_t *index = pmcf->variables.elts;
+                for (query->slot = 0; query->slot < pmcf->variables.nelts; query->slot++) if (index[query->slot] == query->index) break;
+                if (query->slot == pmcf->variables.nelts) {
+                    if (!(index = ngx_array_push(&pmcf->variables))) return "!ngx_array_push";
+                    *index = query->index;
+                }
                 variable->get_handler = ngx_pq_variable_get_handler;
-                variable->data = query->index;
+                variable->data = query->slot;
                 continue;
             }
             if (!(query->type & ngx_pq_type_output)) return "output not allowed";
             ngx_uint_t j;
-            static const ngx_conf_enum_t e[] = { { ngx_string("csv"), ngx_pq_output_csv }, { ngx_string("plain"), ngx_pq_output_plain }, { ngx_string("value"), ngx_pq_output_value }, { ngx_string("binary"), ngx_pq_output_binary }, { ngx_null_string, 0 } };
+            static const ngx_conf_enum_t e[] = { { ngx_string("csv"), ngx_pq_output_csv }, { ngx_string("plain"), ngx_pq_output_plain }, { ngx_string("value"), ngx_pq_output_value }, { ngx_string("binary"), ngx_pq_output_binary }, { ngx_string("json"), ngx_pq_output_json }, { ngx_string("ndjson"), ngx_pq_output_ndjson }, { ngx_string("arrow"), ngx_pq_output_arrow }, { ngx_string("msgpack"), ngx_pq_output_msgpack }, { ngx_string("cbor"), ngx_pq_output_cbor }, { ngx_null_string, 0 } };
             for (j = 0; e[j].name.len; j++) if (e[j].name.len == str[i].len - (sizeof("output=") - 1) && !ngx_strncasecmp(e[j].name.data, &str[i].data[sizeof("output=") - 1], str[i].len - (sizeof("output=") - 1))) break;
-            if (!e[j].name.len) return "\"output\" value must be \"csv\", \"plain\", \"value\" or \"binary\"";
+            if (!e[j].name.len) return "\"output\" value must be \"csv\", \"plain\", \"value\", \"binary\", \"json\", \"ndjson\", \"arrow\", \"msgpack\" or \"cbor\"";
             query->output = e[j].value;
+            query->resultFormat = query->output == ngx_pq_output_binary || query->output == ngx_pq_output_arrow || query->output == ngx_pq_output_msgpack || query->output == ngx_pq_output_cbor;
             switch (query->output) {
                 case ngx_pq_output_csv: {
                     ngx_str_set(&query->null, "");
@@ -1410,6 +4389,17 @@ static char *ngx_pq_argument_output_loc_conf(ngx_conf_t *cf, ngx_pq_query_t *que
             query->string = e[j].value;
             continue;
         }
+#ifdef LIBPQ_HAS_PIPELINING
+        if (str[i].len > sizeof("cache=") - 1 && !ngx_strncasecmp(str[i].data, (u_char *)"cache=", sizeof("cache=") - 1)) {
+            if (!(query->type & ngx_pq_type_query)) return "cache not allowed";
+            ngx_uint_t j;
+            static const ngx_conf_enum_t e[] = { { ngx_string("off"), 0 }, { ngx_string("no"), 0 }, { ngx_string("false"), 0 }, { ngx_string("on"), 1 }, { ngx_string("yes"), 1 }, { ngx_string("true"), 1 }, { ngx_null_string, 0 } };
+            for (j = 0; e[j].name.len; j++) if (e[j].name.len == str[i].len - (sizeof("cache=") - 1) && !ngx_strncasecmp(e[j].name.data, &str[i].data[sizeof("cache=") - 1], str[i].len - (sizeof("cache=") - 1))) break;
+            if (!e[j].name.len) return "\"cache\" value must be \"off\", \"no\", \"false\", \"on\", \"yes\" or \"true\"";
+            query->cache = e[j].value;
+            continue;
+        }
+#endif
 #ifdef LIBPQ_HAS_CHUNK_MODE
         if (str[i].len > sizeof("chunkSize=") - 1 && !ngx_strncasecmp(str[i].data, (u_char *)"chunkSize=", sizeof("chunkSize=") - 1)) {
             if (!(query->type & ngx_pq_type_output)) return "output not allowed";
@@ -1426,22 +4416,34 @@ static char *ngx_pq_argument_output_loc_conf(ngx_conf_t *cf, ngx_pq_query_t *que
         ngx_memzero(argument, sizeof(*argument));
         ngx_str_t value = str[i];
         ngx_str_t oid = ngx_null_string;
-        if (query->type & ngx_pq_type_query) {
+        if (!(query->type & ngx_pq_type_prepare) && value.len > sizeof(":binary") - 1 && !ngx_strncasecmp(value.data + value.len - (sizeof(":binary") - 1), (u_char *)":binary", sizeof(":binary") - 1)) {
+            u_char *colon, *last = value.data + value.len - (sizeof(":binary") - 1);
+            if ((colon = ngx_strlcasestrn(value.data, last, (u_char *)"::", sizeof("::") - 1 - 1)) && colon + sizeof("::") - 1 < last) {
+                argument->binary = 1;
+                value.len = last - value.data;
+            }
+        }
+        if (query->type & ngx_pq_type_query || argument->binary) {
             u_char *colon;
-            if ((colon = ngx_strstrn(value.data, "::", sizeof("::") - 1 - 1))) {
-                value.len = colon - value.data;
+            if ((colon = ngx_strlcasestrn(value.data, value.data + value.len, (u_char *)"::", sizeof("::") - 1 - 1))) {
                 oid.data = colon + sizeof("::") - 1;
-                oid.len = str[i].len - value.len - sizeof("::") + 1;
+                oid.len = value.len - (oid.data - value.data);
+                value.len = colon - value.data;
             }
         } else if (query->type & ngx_pq_type_prepare) oid = value;
         if (!(query->type & ngx_pq_type_prepare)) {
             if (ngx_http_script_variables_count(&value)) {
                 ngx_http_compile_complex_value_t ccv = {cf, &value, &argument->value.complex, 0, 0, 0};
                 if (ngx_http_compile_complex_value(&ccv) != NGX_OK) return "ngx_http_compile_complex_value != NGX_OK";
-            } else argument->value.str = value;
+            } else {
+                if (!(argument->value.str.data = ngx_pnalloc(cf->pool, value.len + 1))) return "!ngx_pnalloc";
+                *ngx_cpymem(argument->value.str.data, value.data, value.len) = '\0';
+                argument->value.str.len = value.len;
+            }
         }
         if (!oid.len) continue;
         if (ngx_http_script_variables_count(&oid)) {
+            if (argument->binary) return "binary argument oid must not contain variables";
             ngx_http_compile_complex_value_t ccv = {cf, &oid, &argument->oid.complex, 0, 0, 0};
             if (ngx_http_compile_complex_value(&ccv) != NGX_OK) return "ngx_http_compile_complex_value != NGX_OK";
         } else {
@@ -1449,7 +4451,17 @@ static char *ngx_pq_argument_output_loc_conf(ngx_conf_t *cf, ngx_pq_query_t *que
             if (n == NGX_ERROR) return "ngx_atoi == NGX_ERROR";
             argument->oid.value = n;
         }
+        if (!argument->binary) continue;
+        switch (argument->oid.value) {
+            case ngx_pq_oid_bool: case ngx_pq_oid_bytea: case ngx_pq_oid_float4: case ngx_pq_oid_float8: case ngx_pq_oid_int2: case ngx_pq_oid_int4: case ngx_pq_oid_int8: case ngx_pq_oid_oid: case ngx_pq_oid_uuid: break;
+            default: return "binary argument oid must be bool (16), bytea (17), float4 (700), float8 (701), int2 (21), int4 (23), int8 (20), oid (26) or uuid (2950)";
+        }
+        query->binary = 1;
+        if (!argument->value.complex.value.data && ngx_pq_argument_binary(cf->pool, argument->oid.value, &argument->value.str, &argument->value.str) != NGX_OK) return "invalid binary argument value";
     }
+    ngx_pq_query_queue_t *qq;
+    size_t size = query->arguments.nelts * (query->binary ? sizeof(int) : 0);
+    query->size = ngx_align(sizeof(*qq), NGX_ALIGNMENT) + ngx_align(query->arguments.nelts * sizeof(*qq->paramValues), NGX_ALIGNMENT) + ngx_align(query->arguments.nelts * sizeof(*qq->paramTypes), NGX_ALIGNMENT) + 2 * ngx_align(size, NGX_ALIGNMENT);
     return NGX_CONF_OK;
 }
 static char *ngx_pq_execute_loc_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, ngx_array_t *queries) {
@@ -1506,6 +4518,12 @@ static char *ngx_pq_option_loc_ups_conf(ngx_conf_t *cf, ngx_pq_connect_t *connec
             connect->timeout = (ngx_msec_t)n;
             continue;
         }
+        if (str[i].len > sizeof("statements=") - 1 && !ngx_strncasecmp(str[i].data, (u_char *)"statements=", sizeof("statements=") - 1)) {
+            ngx_int_t n = ngx_atoi(str[i].data + sizeof("statements=") - 1, str[i].len - (sizeof("statements=") - 1));
+            if (n == NGX_ERROR) return "ngx_atoi == NGX_ERROR";
+            connect->statements = (ngx_uint_t)n;
+            continue;
+        }
         if (str[i].len > sizeof("application_name=") - 1 && !ngx_strncasecmp(str[i].data, (u_char *)"application_name=", sizeof("application_name=") - 1)) application_name = str[i];
         else if (str[i].len > sizeof("fallback_application_name=") - 1 && !ngx_strncasecmp(str[i].data, (u_char *)"fallback_application_name=", sizeof("fallback_application_name=") - 1)) application_name = str[i];
         if (!(option = ngx_array_push(&connect->options))) return "!ngx_array_push";
@@ -1517,6 +4535,14 @@ static char *ngx_pq_option_loc_ups_conf(ngx_conf_t *cf, ngx_pq_connect_t *connec
         ngx_memzero(option, sizeof(*option));
         ngx_str_set(option, "application_name=nginx");
     }
+    option = connect->options.elts;
+    for (ngx_uint_t i = 0; i < connect->options.nelts; i++) connect->conninfo.len += (i ? sizeof(" ") - 1 : 0) + option[i].len;
+    if (!(connect->conninfo.data = ngx_pnalloc(cf->pool, connect->conninfo.len))) return "!ngx_pnalloc";
+    u_char *p = connect->conninfo.data;
+    for (ngx_uint_t i = 0; i < connect->options.nelts; i++) {
+        if (i) *p++ = ' ';
+        p = ngx_copy(p, option[i].data, option[i].len);
+    }
     return NGX_CONF_OK;
 }
 static char *ngx_pq_prepare_query_loc_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, ngx_array_t *queries) {
@@ -1570,6 +4596,19 @@ static char *ngx_pq_prepare_query_loc_ups_conf(ngx_conf_t *cf, ngx_command_t *cm
         command->str.data = n;
         command->str.len = s - n;
     }
+    command = query->commands.elts;
+    for (i = 0; i < query->commands.nelts; i++) {
+        if (command[i].index) { query->sql.len = 0; break; }
+        query->sql.len += command[i].str.len;
+    }
+    if (i == query->commands.nelts) {
+        if (!(query->sql.data = ngx_pnalloc(cf->pool, query->sql.len + 1))) return "!ngx_pnalloc";
+        u_char *p = query->sql.data;
+        for (i = 0; i < query->commands.nelts; i++) p = ngx_copy(p, command[i].str.data, command[i].str.len);
+        *p = '\0';
+    }
+    while (b < e && (*b == ' ' || *b == '\t' || *b == '\r' || *b == '\n')) b++;
+    if (query->type & ngx_pq_type_query && e - b > (ssize_t)sizeof("copy") - 1 && !ngx_strncasecmp(b, (u_char *)"copy", sizeof("copy") - 1) && ngx_strcasestrn(b, "stdin", sizeof("stdin") - 2)) query->copy = 1;
     return ngx_pq_argument_output_loc_conf(cf, query);
 }
 
@@ -1581,22 +4620,54 @@ static ngx_int_t ngx_pq_preconfiguration(ngx_conf_t *cf) {
     }
     return NGX_OK;
 }
+static ngx_int_t ngx_pq_postconfiguration(ngx_conf_t *cf) {
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    ngx_http_upstream_srv_conf_t **uscfp = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!uscfp[i]->srv_conf) continue;
+        ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_pq_module);
+        /* keepalive declared after pq_pool wraps peer init of upstream after ngx_pq_peer_init_upstream */
+        if (pscf->pool.max && uscfp[i]->peer.init != ngx_pq_peer_init) { ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "pq_pool is incompatible with keepalive"); return NGX_ERROR; }
+    }
+    return NGX_OK;
+}
+static void *ngx_pq_create_main_conf(ngx_conf_t *cf) {
+    ngx_pq_main_conf_t *conf = ngx_pcalloc(cf->pool, sizeof(*conf));
+    if (!conf) return NULL;
+    if (ngx_array_init(&conf->caches, cf->pool, 1, sizeof(ngx_shm_zone_t *)) != NGX_OK) return NULL;
+    if (ngx_array_init(&conf->prefixes, cf->pool, 1, sizeof(ngx_str_t)) != NGX_OK) return NULL;
+    if (ngx_array_init(&conf->variables, cf->pool, 1, sizeof(ngx_int_t)) != NGX_OK) return NULL;
+    ngx_rbtree_init(&conf->coalesce.rbtree, &conf->coalesce.sentinel, ngx_str_rbtree_insert_value);
+    return conf;
+}
 static void *ngx_pq_create_srv_conf(ngx_conf_t *cf) {
     ngx_pq_srv_conf_t *conf = ngx_pcalloc(cf->pool, sizeof(*conf));
     if (!conf) return NULL;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->connect.statements = 64;
+    conf->multiplex.idle_timeout = NGX_CONF_UNSET_MSEC;
+    conf->multiplex.max = NGX_CONF_UNSET_UINT;
+    ngx_queue_init(&conf->pool.free);
+    ngx_queue_init(&conf->pool.waiters);
     return conf;
 }
 static void *ngx_pq_create_loc_conf(ngx_conf_t *cf) {
     ngx_pq_loc_conf_t *conf = ngx_pcalloc(cf->pool, sizeof(*conf));
     if (!conf) return NULL;
     conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->upstream.buffering = NGX_CONF_UNSET;
     conf->upstream.ignore_client_abort = NGX_CONF_UNSET;
     conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->upstream.pass_request_body = NGX_CONF_UNSET;
     conf->upstream.request_buffering = NGX_CONF_UNSET;
+    conf->cache.zone = NGX_CONF_UNSET_PTR;
+    conf->coalesce = NGX_CONF_UNSET;
+    conf->copy_in = NGX_CONF_UNSET;
+    conf->connect.statements = 64;
     conf->empty = NGX_CONF_UNSET_UINT;
+    conf->lsn = NGX_CONF_UNSET;
+    conf->route.type = NGX_CONF_UNSET_UINT;
     ngx_str_set(&conf->upstream.module, "pq");
     return conf;
 }
@@ -1608,14 +4679,162 @@ static char *ngx_pq_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
     ngx_conf_merge_msec_value(conf->upstream.next_upstream_timeout, prev->upstream.next_upstream_timeout, 0);
     ngx_conf_merge_size_value(conf->upstream.buffer_size, prev->upstream.buffer_size, (size_t)ngx_pagesize);
     ngx_conf_merge_uint_value(conf->upstream.next_upstream_tries, prev->upstream.next_upstream_tries, 0);
+    ngx_conf_merge_value(conf->upstream.buffering, prev->upstream.buffering, 1);
     ngx_conf_merge_value(conf->upstream.ignore_client_abort, prev->upstream.ignore_client_abort, 0);
+    ngx_conf_merge_value(conf->copy_in, prev->copy_in, 0);
+    if (conf->upstream.pass_request_body == NGX_CONF_UNSET && conf->copy_in) conf->upstream.pass_request_body = 1;
     ngx_conf_merge_value(conf->upstream.pass_request_body, prev->upstream.pass_request_body, 0);
     ngx_conf_merge_value(conf->upstream.request_buffering, prev->upstream.request_buffering, 1);
     ngx_conf_merge_uint_value(conf->empty, prev->empty, NGX_HTTP_OK);
+    if (conf->route.type == NGX_CONF_UNSET_UINT) conf->route = prev->route;
+    ngx_conf_init_uint_value(conf->route.type, 0);
+    ngx_conf_merge_value(conf->lsn, prev->lsn, 0);
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    if (conf->cache.zone == NGX_CONF_UNSET_PTR) conf->cache.ttl = prev->cache.ttl;
+    ngx_conf_merge_ptr_value(conf->cache.zone, prev->cache.zone, NULL);
     if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) conf->upstream.next_upstream = NGX_CONF_BITMASK_SET|NGX_HTTP_UPSTREAM_FT_OFF;
+    ngx_pq_query_t *query = conf->queries.elts;
+    if (conf->cache.zone || conf->coalesce) for (ngx_uint_t i = 0; i < conf->queries.nelts; i++) if (query[i].prefix) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "prefix output is incompatible with pq_cache and pq_coalesce"); return NGX_CONF_ERROR; }
+    if (conf->cache.zone && conf->upstream.upstream && conf->upstream.upstream->srv_conf) {
+        /* cache hits skip upstream queries, so their output variables would stay unset on hits only */
+        ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(conf->upstream.upstream, ngx_pq_module);
+        query = pscf->queries.elts;
+        for (ngx_uint_t i = 0; i < pscf->queries.nelts; i++) if (query[i].index || query[i].prefix) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "output variables are incompatible with pq_cache"); return NGX_CONF_ERROR; }
+    }
+    if (conf->lsn && conf->upstream.upstream && conf->upstream.upstream->srv_conf) {
+        ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(conf->upstream.upstream, ngx_pq_module);
+        if (pscf->multiplex.max && pscf->multiplex.max != NGX_CONF_UNSET_UINT) { ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "pq_lsn is incompatible with pq_multiplex"); return NGX_CONF_ERROR; }
+    }
+    if (conf->connect.options.elts && conf->upstream.upstream && !conf->upstream.upstream->srv_conf && ngx_pq_conninfo_init(cf, &conf->connect, conf->upstream.upstream) != NGX_OK) return NGX_CONF_ERROR;
     return NGX_CONF_OK;
 }
 
+static char *ngx_pq_balance_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_srv_conf_t *pscf = conf;
+    if (pscf->balance.method) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    if (str[1].len == sizeof("least_queries") - 1 && !ngx_strncmp(str[1].data, (u_char *)"least_queries", sizeof("least_queries") - 1)) pscf->balance.method = ngx_pq_balance_least_queries;
+    else return "invalid value";
+    ngx_http_upstream_srv_conf_t *uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    if ((uscf->peer.init_upstream && uscf->peer.init_upstream != ngx_pq_peer_init_upstream) || (pscf->peer.init_upstream && pscf->peer.init_upstream != ngx_http_upstream_init_round_robin)) ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "load balancing method redefined");
+    pscf->peer.init_upstream = ngx_http_upstream_init_round_robin;
+    uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
+    return NGX_CONF_OK;
+}
+static char *ngx_pq_cache_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_loc_conf_t *plcf = conf;
+    if (plcf->cache.zone != NGX_CONF_UNSET_PTR) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    if (cf->args->nelts == 2 && str[1].len == sizeof("off") - 1 && !ngx_strncmp(str[1].data, (u_char *)"off", sizeof("off") - 1)) { plcf->cache.zone = NULL; return NGX_CONF_OK; }
+    ngx_str_t channel = ngx_null_string;
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+    time_t ttl = 60;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (str[i].len > sizeof("zone=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"zone=", sizeof("zone=") - 1)) {
+            name.data = str[i].data + sizeof("zone=") - 1;
+            name.len = str[i].len - (sizeof("zone=") - 1);
+            u_char *p = ngx_strlchr(name.data, name.data + name.len, ':');
+            if (!p) continue;
+            ngx_str_t s = {name.data + name.len - p - 1, p + 1};
+            name.len = p - name.data;
+            if ((size = ngx_parse_size(&s)) == NGX_ERROR) return "ngx_parse_size == NGX_ERROR";
+            if (size < (ssize_t)(8 * ngx_pagesize)) return "\"zone\" size is too small";
+            continue;
+        }
+        if (str[i].len > sizeof("ttl=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"ttl=", sizeof("ttl=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("ttl=") - 1), str[i].data + sizeof("ttl=") - 1};
+            if ((ttl = ngx_parse_time(&s, 1)) == (time_t)NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("channel=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"channel=", sizeof("channel=") - 1)) {
+            channel.data = str[i].data + sizeof("channel=") - 1;
+            channel.len = str[i].len - (sizeof("channel=") - 1);
+            continue;
+        }
+        return "invalid parameter";
+    }
+    if (!name.len) return "\"zone\" parameter is required";
+    if (!(plcf->cache.zone = ngx_shared_memory_add(cf, &name, size, &ngx_pq_module))) return NGX_CONF_ERROR;
+    ngx_pq_cache_zone_t *ctx = plcf->cache.zone->data;
+    if (!ctx) {
+        if (!(ctx = ngx_pcalloc(cf->pool, sizeof(*ctx)))) return "!ngx_pcalloc";
+        plcf->cache.zone->data = ctx;
+        plcf->cache.zone->init = ngx_pq_cache_init_zone;
+        ngx_pq_main_conf_t *pmcf = ngx_http_conf_get_module_main_conf(cf, ngx_pq_module);
+        ngx_shm_zone_t **zone;
+        if (!(zone = ngx_array_push(&pmcf->caches))) return "!ngx_array_push";
+        *zone = plcf->cache.zone;
+    }
+    if (channel.len) {
+        if (ctx->channel.len && (ctx->channel.len != channel.len || ngx_strncmp(ctx->channel.data, channel.data, channel.len))) return "\"zone\" is already bound to another channel";
+        ctx->channel = channel;
+    }
+    plcf->cache.ttl = ttl;
+    return NGX_CONF_OK;
+}
+static char *ngx_pq_circuit_breaker_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_srv_conf_t *pscf = conf;
+    if (pscf->breaker.status) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    ngx_int_t errors = 50, min = 20, probes = 1, status = NGX_HTTP_SERVICE_UNAVAILABLE;
+    ngx_msec_t latency = 0, open = 10 * 1000, window = 10 * 1000;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (str[i].len > sizeof("errors=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"errors=", sizeof("errors=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("errors=") - 1), str[i].data + sizeof("errors=") - 1};
+            if (s.data[s.len - 1] == '%') s.len--;
+            if ((errors = ngx_atoi(s.data, s.len)) == NGX_ERROR || !errors || errors > 100) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("latency=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"latency=", sizeof("latency=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("latency=") - 1), str[i].data + sizeof("latency=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            latency = (ngx_msec_t)n;
+            continue;
+        }
+        if (str[i].len > sizeof("min=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"min=", sizeof("min=") - 1)) {
+            if ((min = ngx_atoi(str[i].data + sizeof("min=") - 1, str[i].len - (sizeof("min=") - 1))) == NGX_ERROR || !min) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("open=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"open=", sizeof("open=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("open=") - 1), str[i].data + sizeof("open=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            open = (ngx_msec_t)n;
+            continue;
+        }
+        if (str[i].len > sizeof("probes=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"probes=", sizeof("probes=") - 1)) {
+            if ((probes = ngx_atoi(str[i].data + sizeof("probes=") - 1, str[i].len - (sizeof("probes=") - 1))) == NGX_ERROR || !probes) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("status=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"status=", sizeof("status=") - 1)) {
+            if ((status = ngx_atoi(str[i].data + sizeof("status=") - 1, str[i].len - (sizeof("status=") - 1))) == NGX_ERROR || status < 400 || status > 599) return "\"status\" must be between 400 and 599";
+            continue;
+        }
+        if (str[i].len > sizeof("window=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"window=", sizeof("window=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("window=") - 1), str[i].data + sizeof("window=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || !n) return "ngx_parse_time == NGX_ERROR";
+            window = (ngx_msec_t)n;
+            continue;
+        }
+        return "invalid parameter";
+    }
+    pscf->breaker.errors = (ngx_uint_t)errors;
+    pscf->breaker.latency = latency;
+    pscf->breaker.min = (ngx_uint_t)min;
+    pscf->breaker.open = open;
+    pscf->breaker.probes = (ngx_uint_t)probes;
+    pscf->breaker.status = (ngx_uint_t)status;
+    pscf->breaker.window = window;
+    ngx_http_upstream_srv_conf_t *uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    if (uscf->peer.init_upstream != ngx_pq_peer_init_upstream) {
+        pscf->peer.init_upstream = uscf->peer.init_upstream ? uscf->peer.init_upstream : ngx_http_upstream_init_round_robin;
+        uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
+    }
+    return NGX_CONF_OK;
+}
 static char *ngx_pq_execute_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_pq_loc_conf_t *plcf = conf;
     return ngx_pq_execute_loc_ups_conf(cf, cmd, &plcf->queries);
@@ -1666,6 +4885,47 @@ static ngx_conf_bitmask_t ngx_pq_next_upstream_masks[] = {
   { ngx_string("updating"), NGX_HTTP_UPSTREAM_FT_UPDATING },
   { ngx_null_string, 0 }
 };
+static char *ngx_pq_health_check_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_srv_conf_t *pscf = conf;
+    if (pscf->health.interval) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    ngx_int_t fails = 1, passes = 1;
+    ngx_msec_t interval = 5 * 1000;
+    ngx_str_t query = ngx_null_string;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (str[i].len > sizeof("interval=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"interval=", sizeof("interval=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("interval=") - 1), str[i].data + sizeof("interval=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || !n) return "ngx_parse_time == NGX_ERROR";
+            interval = (ngx_msec_t)n;
+            continue;
+        }
+        if (str[i].len > sizeof("query=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"query=", sizeof("query=") - 1)) {
+            query.data = str[i].data + sizeof("query=") - 1;
+            query.len = str[i].len - (sizeof("query=") - 1);
+            continue;
+        }
+        if (str[i].len > sizeof("fails=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"fails=", sizeof("fails=") - 1)) {
+            if ((fails = ngx_atoi(str[i].data + sizeof("fails=") - 1, str[i].len - (sizeof("fails=") - 1))) == NGX_ERROR || !fails) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("passes=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"passes=", sizeof("passes=") - 1)) {
+            if ((passes = ngx_atoi(str[i].data + sizeof("passes=") - 1, str[i].len - (sizeof("passes=") - 1))) == NGX_ERROR || !passes) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        return "invalid parameter";
+    }
+    pscf->health.fails = (ngx_uint_t)fails;
+    pscf->health.interval = interval;
+    pscf->health.passes = (ngx_uint_t)passes;
+    pscf->health.query = query;
+    ngx_http_upstream_srv_conf_t *uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    if (uscf->peer.init_upstream != ngx_pq_peer_init_upstream) {
+        pscf->peer.init_upstream = uscf->peer.init_upstream ? uscf->peer.init_upstream : ngx_http_upstream_init_round_robin;
+        uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
+    }
+    return NGX_CONF_OK;
+}
 static char *ngx_pq_option_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_pq_loc_conf_t *plcf = conf;
     return ngx_pq_option_loc_ups_conf(cf, &plcf->connect);
@@ -1673,10 +4933,33 @@ static char *ngx_pq_option_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *co
 static char *ngx_pq_option_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_pq_srv_conf_t *pscf = conf;
     ngx_http_upstream_srv_conf_t *uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
-    pscf->peer.init_upstream = uscf->peer.init_upstream ? uscf->peer.init_upstream : ngx_http_upstream_init_round_robin;
-    uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
+    if (uscf->peer.init_upstream != ngx_pq_peer_init_upstream) {
+        pscf->peer.init_upstream = uscf->peer.init_upstream ? uscf->peer.init_upstream : ngx_http_upstream_init_round_robin;
+        uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
+    }
     return ngx_pq_option_loc_ups_conf(cf, &pscf->connect);
 }
+#ifdef LIBPQ_HAS_PIPELINING
+static char *ngx_pq_multiplex_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_srv_conf_t *pscf = conf;
+    if (pscf->multiplex.max != NGX_CONF_UNSET_UINT) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    ngx_int_t n = ngx_atoi(str[1].data, str[1].len);
+    if (n == NGX_ERROR) return "ngx_atoi == NGX_ERROR";
+    pscf->multiplex.max = (ngx_uint_t)n;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (str[i].len > sizeof("idle_timeout=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"idle_timeout=", sizeof("idle_timeout=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("idle_timeout=") - 1), str[i].data + sizeof("idle_timeout=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            pscf->multiplex.idle_timeout = (ngx_msec_t)n;
+            continue;
+        }
+        return "invalid parameter";
+    }
+    return NGX_CONF_OK;
+}
+#endif
 static char *ngx_pq_pass_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_pq_loc_conf_t *plcf = conf;
     if (plcf->upstream.upstream || plcf->complex.value.data) return "is duplicate";
@@ -1697,6 +4980,96 @@ static char *ngx_pq_pass_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
     if (!uscf->peer.init_upstream) uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
     return NGX_CONF_OK;
 }
+static char *ngx_pq_pool_ups_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_srv_conf_t *pscf = conf;
+    if (pscf->pool.max) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    ngx_int_t max = 0, min = 0, queue = 0;
+    ngx_msec_t idle_timeout = 0, lifetime = 0, lsn_interval = 0, timeout = 60 * 1000;
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (str[i].len > sizeof("min=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"min=", sizeof("min=") - 1)) {
+            if ((min = ngx_atoi(str[i].data + sizeof("min=") - 1, str[i].len - (sizeof("min=") - 1))) == NGX_ERROR || !min) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("max=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"max=", sizeof("max=") - 1)) {
+            if ((max = ngx_atoi(str[i].data + sizeof("max=") - 1, str[i].len - (sizeof("max=") - 1))) == NGX_ERROR) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("queue=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"queue=", sizeof("queue=") - 1)) {
+            if ((queue = ngx_atoi(str[i].data + sizeof("queue=") - 1, str[i].len - (sizeof("queue=") - 1))) == NGX_ERROR) return "ngx_atoi == NGX_ERROR";
+            continue;
+        }
+        if (str[i].len > sizeof("idle_timeout=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"idle_timeout=", sizeof("idle_timeout=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("idle_timeout=") - 1), str[i].data + sizeof("idle_timeout=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            idle_timeout = (ngx_msec_t)n;
+            continue;
+        }
+        if (str[i].len > sizeof("lsn_interval=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"lsn_interval=", sizeof("lsn_interval=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("lsn_interval=") - 1), str[i].data + sizeof("lsn_interval=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            lsn_interval = (ngx_msec_t)n;
+            continue;
+        }
+        if (str[i].len > sizeof("max_lifetime=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"max_lifetime=", sizeof("max_lifetime=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("max_lifetime=") - 1), str[i].data + sizeof("max_lifetime=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            lifetime = (ngx_msec_t)n;
+            continue;
+        }
+        if (str[i].len > sizeof("timeout=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"timeout=", sizeof("timeout=") - 1)) {
+            ngx_str_t s = {str[i].len - (sizeof("timeout=") - 1), str[i].data + sizeof("timeout=") - 1};
+            ngx_int_t n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) return "ngx_parse_time == NGX_ERROR";
+            timeout = (ngx_msec_t)n;
+            continue;
+        }
+        return "invalid parameter";
+    }
+    if (!max) return "\"max\" parameter is required";
+    if (min > max) return "\"min\" must not be greater than \"max\"";
+    pscf->pool.idle_timeout = idle_timeout;
+    pscf->pool.lifetime = lifetime;
+    pscf->pool.lsn_interval = lsn_interval;
+    pscf->pool.max = (ngx_uint_t)max;
+    pscf->pool.min = (ngx_uint_t)min;
+    pscf->pool.queue = (ngx_uint_t)queue;
+    pscf->pool.timeout = timeout;
+    ngx_http_upstream_srv_conf_t *uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    if (uscf->peer.init_upstream != ngx_pq_peer_init_upstream) {
+        pscf->peer.init_upstream = uscf->peer.init_upstream ? uscf->peer.init_upstream : ngx_http_upstream_init_round_robin;
+        uscf->peer.init_upstream = ngx_pq_peer_init_upstream;
+    }
+    return NGX_CONF_OK;
+}
+static ngx_conf_enum_t ngx_pq_route[] = {
+    { ngx_string("read"), ngx_pq_route_read },
+    { ngx_string("write"), ngx_pq_route_write },
+    { ngx_null_string, 0 }
+};
+static char *ngx_pq_route_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_pq_loc_conf_t *plcf = conf;
+    if (plcf->route.type != NGX_CONF_UNSET_UINT) return "is duplicate";
+    ngx_str_t *str = cf->args->elts;
+    for (ngx_conf_enum_t *e = ngx_pq_route; e->name.len; e++) if (e->name.len == str[1].len && !ngx_strncmp(e->name.data, str[1].data, str[1].len)) { plcf->route.type = e->value; break; }
+    if (plcf->route.type == NGX_CONF_UNSET_UINT) return "invalid value";
+    plcf->route.lsn = NULL;
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (str[i].len > sizeof("lsn=") - 1 && !ngx_strncmp(str[i].data, (u_char *)"lsn=", sizeof("lsn=") - 1)) {
+            if (plcf->route.type != ngx_pq_route_read) return "\"lsn\" is only allowed with read";
+            ngx_str_t value = {str[i].len - (sizeof("lsn=") - 1), str[i].data + sizeof("lsn=") - 1};
+            if (!(plcf->route.lsn = ngx_pcalloc(cf->pool, sizeof(*plcf->route.lsn)))) return "!ngx_pcalloc";
+            ngx_http_compile_complex_value_t ccv = {cf, &value, plcf->route.lsn, 0, 0, 0};
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) return "ngx_http_compile_complex_value != NGX_OK";
+            continue;
+        }
+        return "invalid parameter";
+    }
+    return NGX_CONF_OK;
+}
 static char *ngx_pq_prepare_loc_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_pq_loc_conf_t *plcf = conf;
     return ngx_pq_prepare_query_loc_ups_conf(cf, cmd, &plcf->queries);
@@ -1725,10 +5098,27 @@ static ngx_conf_enum_t ngx_pq_empty[] = {
     { ngx_null_string, 0 }
 };
 
+
+static ngx_int_t ngx_pq_init_process(ngx_cycle_t *cycle) {
+    ngx_http_upstream_main_conf_t *umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (!umcf) return NGX_OK;
+    ngx_http_upstream_srv_conf_t **uscfp = umcf->upstreams.elts;
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+        if (!uscfp[i]->srv_conf) continue;
+        ngx_pq_srv_conf_t *pscf = ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_pq_module);
+        if (!pscf->pool.upstream) continue;
+        if (pscf->health.interval) ngx_add_timer(&pscf->health.timer, ngx_random() % pscf->health.interval + 1);
+        if (!pscf->pool.min && !pscf->pool.lsn_interval) continue;
+        ngx_pq_pool_prewarm(pscf);
+        ngx_add_timer(&pscf->pool.timer, pscf->pool.lsn_interval && pscf->pool.lsn_interval < 1000 ? pscf->pool.lsn_interval : 1000);
+    }
+    return NGX_OK;
+}
+
 static ngx_http_module_t ngx_pq_ctx = {
     .preconfiguration = ngx_pq_preconfiguration,
-    .postconfiguration = NULL,
-    .create_main_conf = NULL,
+    .postconfiguration = ngx_pq_postconfiguration,
+    .create_main_conf = ngx_pq_create_main_conf,
     .init_main_conf = NULL,
     .create_srv_conf = ngx_pq_create_srv_conf,
     .merge_srv_conf = NULL,
@@ -1736,13 +5126,24 @@ static ngx_http_module_t ngx_pq_ctx = {
     .merge_loc_conf = ngx_pq_merge_loc_conf
 };
 static ngx_command_t ngx_pq_commands[] = {
+  { ngx_string("pq_balance"), NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1, ngx_pq_balance_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_buffer_size"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1, ngx_conf_set_size_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.buffer_size), NULL },
   { ngx_string("pq_buffer_size"), NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1, ngx_conf_set_size_slot, NGX_HTTP_SRV_CONF_OFFSET, offsetof(ngx_pq_srv_conf_t, buffer_size), NULL },
+  { ngx_string("pq_buffering"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.buffering), NULL },
+  { ngx_string("pq_cache"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE, ngx_pq_cache_loc_conf, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+  { ngx_string("pq_circuit_breaker"), NGX_HTTP_UPS_CONF|NGX_CONF_ANY, ngx_pq_circuit_breaker_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
+  { ngx_string("pq_coalesce"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, coalesce), NULL },
+  { ngx_string("pq_copy_in"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, copy_in), NULL },
   { ngx_string("pq_execute"), NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE, ngx_pq_execute_loc_conf, NGX_HTTP_LOC_CONF_OFFSET, ngx_pq_type_location|ngx_pq_type_execute|ngx_pq_type_output, NULL },
   { ngx_string("pq_execute"), NGX_HTTP_UPS_CONF|NGX_CONF_1MORE, ngx_pq_execute_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, ngx_pq_type_upstream|ngx_pq_type_execute, NULL },
+  { ngx_string("pq_health_check"), NGX_HTTP_UPS_CONF|NGX_CONF_ANY, ngx_pq_health_check_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_ignore_client_abort"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.ignore_client_abort), NULL },
   { ngx_string("pq_level"), NGX_HTTP_UPS_CONF|NGX_CONF_TAKE2, ngx_pq_level_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_log"), NGX_HTTP_UPS_CONF|NGX_CONF_1MORE, ngx_pq_log_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
+  { ngx_string("pq_lsn"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, lsn), NULL },
+#ifdef LIBPQ_HAS_PIPELINING
+  { ngx_string("pq_multiplex"), NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12, ngx_pq_multiplex_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
+#endif
   { ngx_string("pq_next_upstream"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE, ngx_conf_set_bitmask_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.next_upstream), &ngx_pq_next_upstream_masks },
   { ngx_string("pq_next_upstream_timeout"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1, ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.next_upstream_timeout), NULL },
   { ngx_string("pq_next_upstream_tries"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1, ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.next_upstream_tries), NULL },
@@ -1750,10 +5151,12 @@ static ngx_command_t ngx_pq_commands[] = {
   { ngx_string("pq_option"), NGX_HTTP_UPS_CONF|NGX_CONF_1MORE, ngx_pq_option_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_pass"), NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1, ngx_pq_pass_loc_conf, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_pass_request_body"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.pass_request_body), NULL },
+  { ngx_string("pq_pool"), NGX_HTTP_UPS_CONF|NGX_CONF_1MORE, ngx_pq_pool_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_prepare"), NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE, ngx_pq_prepare_loc_conf, NGX_HTTP_LOC_CONF_OFFSET, ngx_pq_type_location|ngx_pq_type_prepare, NULL },
   { ngx_string("pq_prepare"), NGX_HTTP_UPS_CONF|NGX_CONF_1MORE, ngx_pq_prepare_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, ngx_pq_type_upstream|ngx_pq_type_prepare, NULL },
   { ngx_string("pq_query"), NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE, ngx_pq_query_loc_conf, NGX_HTTP_LOC_CONF_OFFSET, ngx_pq_type_location|ngx_pq_type_query|ngx_pq_type_output, NULL },
   { ngx_string("pq_query"), NGX_HTTP_UPS_CONF|NGX_CONF_1MORE, ngx_pq_query_ups_conf, NGX_HTTP_SRV_CONF_OFFSET, ngx_pq_type_upstream|ngx_pq_type_query, NULL },
+  { ngx_string("pq_route"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE12, ngx_pq_route_loc_conf, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
   { ngx_string("pq_request_buffering"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG, ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, upstream.request_buffering), NULL },
   { ngx_string("pq_empty"), NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1, ngx_conf_set_enum_slot, NGX_HTTP_LOC_CONF_OFFSET, offsetof(ngx_pq_loc_conf_t, empty), &ngx_pq_empty },
     ngx_null_command
@@ -1766,7 +5169,7 @@ ngx_module_t ngx_pq_module = {
     .type = NGX_HTTP_MODULE,
     .init_master = NULL,
     .init_module = NULL,
-    .init_process = NULL,
+    .init_process = ngx_pq_init_process,
     .init_thread = NULL,
     .exit_thread = NULL,
     .exit_process = NULL,
@@ -805,3 +805,362 @@ user: postgres
 GET /
 --- error_code: 404
 --- timeout: 60
+
+=== TEST 18:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        pq_buffering off;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1 as ab union select $2 order by 1" $arg_a::23 $arg_b::23 output=plain;
+    }
+--- request
+GET /?a=12&b=345
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+Transfer-Encoding: chunked
+--- response_body eval
+"ab\x{0a}12\x{0a}345"
+--- timeout: 60
+
+=== TEST 19:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type application/json;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1::int as ab, $2 as cde, true as f, 1.5::numeric as n, 'NaN'::float8 as x, null as z, '{\"a\":1}'::json as j union all select 89, e'q\"w\\\\e\\n', false, 2, 3, null, '[]' order by 1" $arg_a $arg_b output=json;
+    }
+--- request
+GET /?a=34&b=qwe
+--- error_code: 200
+--- response_headers
+Content-Length: 137
+Content-Type: application/json
+--- response_body eval
+"[{\"ab\":34,\"cde\":\"qwe\",\"f\":true,\"n\":1.5,\"x\":\"NaN\",\"z\":null,\"j\":{\"a\":1}},{\"ab\":89,\"cde\":\"q\\\"w\\\\e\\n\",\"f\":false,\"n\":2,\"x\":3,\"z\":null,\"j\":[]}]"
+--- timeout: 60
+
+=== TEST 20:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type application/x-ndjson;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1::int as ab, $2 as cde union all select 89, null order by 1" $arg_a $arg_b output=ndjson;
+    }
+--- request
+GET /?a=34&b=qwe
+--- error_code: 200
+--- response_headers
+Content-Length: 43
+Content-Type: application/x-ndjson
+--- response_body eval
+"{\"ab\":34,\"cde\":\"qwe\"}\x{0a}{\"ab\":89,\"cde\":null}\x{0a}"
+--- timeout: 60
+
+=== TEST 21:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_cache zone=pq:1m ttl=1m;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1 as ab" $arg_a::23 output=value;
+    }
+--- pipelined_requests eval
+["GET /?a=34", "GET /?a=34", "GET /?a=89"]
+--- error_code eval
+[200, 200, 200]
+--- response_body eval
+["34", "34", "89"]
+--- timeout: 60
+
+=== TEST 22:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_coalesce on;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1 as ab" $arg_a::23 output=value;
+    }
+--- pipelined_requests eval
+["GET /?a=34", "GET /?a=34", "GET /?a=89"]
+--- error_code eval
+[200, 200, 200]
+--- response_body eval
+["34", "34", "89"]
+--- timeout: 60
+
+=== TEST 23:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/csv;
+        pq_buffering off;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "copy (select generate_series(1, 100000) as ab) to stdout with (format csv)" output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_headers
+Content-Type: text/csv
+--- response_body eval
+join("", map { "$_\x{0a}" } 1..100000)
+--- timeout: 60
+
+=== TEST 24:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_copy_in on;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "create temp table copy_in (a int)";
+        pq_query "copy copy_in from stdin with (format csv)";
+        pq_query "select sum(a) from copy_in" output=value;
+    }
+--- request eval
+"POST /\x{0a}" . join("", map { "$_\x{0a}" } 1..1000)
+--- error_code: 200
+--- response_body: 500500
+--- timeout: 60
+
+=== TEST 25:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type application/octet-stream;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select repeat('x', 100000)::bytea" output=binary;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body eval
+"x" x 100000
+--- timeout: 60
+
+=== TEST 26:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/csv;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1 + 1 as ab, $2 as cd, $3 as ef, $4 * 2 as gh, $5 as ij" $arg_a::20:binary $arg_b::16:binary $arg_c::2950:binary $arg_d::701:binary $arg_e::17:binary output=csv;
+    }
+--- request
+GET /?a=-35&b=on&c=A0EEBC99-9C0B-4EF8-BB6D-6BB9BD380A11&d=1.25&e=xyz
+--- error_code: 200
+--- response_body eval
+"ab,cd,ef,gh,ij\x{0a}-34,t,a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11,2.5,\\x78797a"
+--- timeout: 60
+
+=== TEST 27:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        add_header x-id $user_id;
+        add_header x-name $user_name;
+        add_header x-none "[$user_none]";
+        default_type text/plain;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select 7 as id, 'bob' as name, null as none" output=$user*;
+        pq_query "select 'ok'" output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_headers
+x-id: 7
+x-name: bob
+x-none: []
+--- response_body chomp
+ok
+--- timeout: 60
+
+=== TEST 28:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type application/vnd.apache.arrow.stream;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select generate_series(1, 3)::int8 as id, 'abc'::text as name" output=arrow;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body_like eval
+qr/^\xff\xff\xff\xff.+\x02\x00\x00\x00id\x00.+\x04\x00\x00\x00name\x00.+\xff\xff\xff\xff\x00\x00\x00\x00$/s
+--- timeout: 60
+
+=== TEST 29:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type application/msgpack;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select 1::int4 as a, 'x'::text as b, null::int8 as c, -200::int8 as d" output=msgpack header=on;
+        pq_query "select true as a, 2.5::float8 as b" output=cbor;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body eval
+"\x94\xa1a\xa1b\xa1c\xa1d\x94\x01\xa1x\xc0\xd1\xff\x38\x82\xf5\xfb\x40\x04\x00\x00\x00\x00\x00\x00"
+--- timeout: 60
+
+=== TEST 30:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 '<!--# include virtual="/random" wait="yes" --> <!--# include virtual="/random" wait="yes" -->';
+    }
+    location =/random {
+        default_type text/plain;
+        pq_cache zone=pq:1m ttl=1m;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select random()::text as ab" output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body_like: ^(\S+) \1$
+--- timeout: 60
+
+=== TEST 31:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/comma {
+        default_type text/csv;
+        pq_cache zone=pq:1m ttl=1m;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select 1 as ab, 2 as cde" output=csv;
+    }
+    location =/semicolon {
+        default_type text/csv;
+        pq_cache zone=pq:1m ttl=1m;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select 1 as ab, 2 as cde" output=csv "delimiter=;";
+    }
+--- pipelined_requests eval
+["GET /comma", "GET /semicolon"]
+--- error_code eval
+[200, 200]
+--- response_body eval
+["ab,cde\x{0a}1,2", "ab;cde\x{0a}1;2"]
+--- timeout: 60
+
+=== TEST 32:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    pq_copy_in on;
+    location =/ {
+        default_type text/plain;
+        pq_cache zone=pq:1m ttl=1m;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "create temp table copy_in (a int)";
+        pq_query "copy copy_in from stdin with (format csv)";
+        pq_query "select sum(a) from copy_in" output=value;
+    }
+--- pipelined_requests eval
+["POST /\x{0a}1\x{0a}2\x{0a}", "POST /\x{0a}3\x{0a}4\x{0a}"]
+--- error_code eval
+[200, 200]
+--- response_body eval
+["3", "7"]
+--- timeout: 60
+
+=== TEST 33:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select $1::text || ' ' || $2 as ab" abc:binary $arg_a:binary output=value;
+    }
+--- request
+GET /?a=def
+--- error_code: 200
+--- response_body: abc:binary def:binary
+--- timeout: 60
+
+=== TEST 34:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+--- config
+    location =/ {
+        add_header message-detail $pq_message_detail always;
+        add_header message-hint $pq_message_hint always;
+        add_header message-primary $pq_message_primary always;
+        add_header sqlstate $pq_sqlstate always;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select 1";
+        pq_query "do 'begin raise exception ''boom'' using detail = ''some detail'', hint = ''some hint'', errcode = ''P0002''; end'";
+    }
+--- request
+GET /
+--- error_code: 502
+--- response_headers
+message-detail: some detail
+message-hint: some hint
+message-primary: boom
+sqlstate: P0002
+--- timeout: 60
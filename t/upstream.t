@@ -865,3 +865,513 @@ user: postgres
 --- response_body eval
 "ab,cde\x{0a}34,qwe\x{0a}89,\x{0a}"
 --- timeout: 60
+
+=== TEST 17:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_multiplex 8;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select $1 * 2 as ab" $arg_a::23 output=plain;
+    }
+--- pipelined_requests eval
+["GET /?a=17", "GET /?a=21"]
+--- error_code eval
+[200, 200]
+--- response_body eval
+["ab\x{0a}34", "ab\x{0a}42"]
+--- timeout: 60
+
+=== TEST 18:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_pool min=1 max=1 idle_timeout=10s max_lifetime=1h queue=8 timeout=5s;
+        pq_query "set application_name = 'pool'";
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select current_setting('application_name') || ' ' || $1::int4 * 2 as ab" $arg_a output=plain;
+    }
+--- pipelined_requests eval
+["GET /?a=17", "GET /?a=21"]
+--- error_code eval
+[200, 200]
+--- response_body eval
+["ab\x{0a}pool 34", "ab\x{0a}pool 42"]
+--- timeout: 60
+
+=== TEST 19:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_query "select set_config('default_transaction_read_only', (strpos($1, '/:') > 0)::text, false)" $upstream_addr;
+        server unix:/run/postgresql:5432;
+        server unix:/run/postgresql/:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_route write;
+        pq_query "select current_setting('default_transaction_read_only')" output=value;
+    }
+--- pipelined_requests eval
+["GET /", "GET /", "GET /", "GET /"]
+--- error_code eval
+[200, 200, 200, 200]
+--- response_body_like eval
+["^(on|off)\$", "^(on|off)\$", "^off\$", "^off\$"]
+--- timeout: 60
+
+=== TEST 20:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_balance least_queries;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+        server unix:/run/postgresql/:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 '<!--# include virtual="/q?s=1" --> <!--# include virtual="/q?s=0" -->';
+    }
+    location =/q {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select $1 from pg_sleep($2::float8)" $upstream_addr::25 $arg_s output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body_like: ^(\S+) (?!\1$)\S+$
+--- timeout: 60
+
+=== TEST 21:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/write {
+        add_header lsn "[$pq_lsn]" always;
+        default_type text/plain;
+        pq_pass pg;
+        pq_lsn on;
+        pq_query "select pg_current_wal_lsn() >= '0/0'" output=value;
+    }
+    location =/read {
+        add_header lsn "[$pq_lsn]" always;
+        default_type text/plain;
+        pq_pass pg;
+        pq_route read lsn=$arg_lsn;
+        pq_query "select pg_is_in_recovery()" output=value;
+    }
+--- pipelined_requests eval
+["GET /write", "GET /read?lsn=FFFFFFFF/FFFFFFFF"]
+--- error_code eval
+[200, 200]
+--- response_headers_like eval
+["lsn: \\[[0-9A-F]+/[0-9A-F]+\\]", "lsn: \\[\\]"]
+--- response_body eval
+["t", "f"]
+--- timeout: 60
+
+=== TEST 22:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_health_check interval=1s fails=1 passes=2;
+        pq_option user=postgres;
+        server unix:/nonexistent:5432;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    add_header upstream $upstream_addr always;
+    location =/sleep {
+        default_type text/plain;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "select pg_sleep(1.5)::text" output=value;
+    }
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select 1" output=value;
+    }
+--- pipelined_requests eval
+["GET /sleep", "GET /", "GET /", "GET /"]
+--- error_code eval
+[200, 200, 200, 200]
+--- response_headers_like eval
+['upstream: ^unix:/run/postgresql:5432$', 'upstream: ^unix:/run/postgresql:5432$', 'upstream: ^unix:/run/postgresql:5432$', 'upstream: ^unix:/run/postgresql:5432$']
+--- response_body eval
+["", "1", "1", "1"]
+--- timeout: 60
+
+=== TEST 23:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_circuit_breaker errors=100 min=1 open=60s;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+        server unix:/run/postgresql/:5432;
+    }
+--- config
+    location =/ {
+        add_header upstream $upstream_addr always;
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select 1 / (strpos($1, '/:') = 0)::int" $upstream_addr output=value;
+    }
+--- pipelined_requests eval
+["GET /", "GET /", "GET /", "GET /"]
+--- error_code eval
+[200, 502, 200, 200]
+--- response_headers_like eval
+['upstream: ^unix:/run/postgresql:5432$', 'upstream: ^unix:/run/postgresql/:5432$', 'upstream: ^unix:/run/postgresql:5432$', 'upstream: ^unix:/run/postgresql:5432$']
+--- timeout: 60
+
+=== TEST 24:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_multiplex 8;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 '<!--# include virtual="/q?a=1" --> <!--# include virtual="/q?a=2" -->';
+    }
+    location =/q {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select $1 || ':' || pg_backend_pid() as ab from pg_sleep(0.2)" $arg_a::25 output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body_like: ^1:(\d+) 2:\1$
+--- timeout: 60
+
+=== TEST 25:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_multiplex 8;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/begin {
+        pq_pass pg;
+        pq_query "begin";
+    }
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select (now() = statement_timestamp())::text as ab" output=value;
+    }
+--- pipelined_requests eval
+["GET /begin", "GET /"]
+--- error_code eval
+[502, 200]
+--- response_body_like eval
+["502 Bad Gateway", "^t\$"]
+--- error_log
+transaction left open on multiplexed connection
+--- timeout: 60
+
+=== TEST 26:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_query "select case when strpos($1, ',') = 0 then 'first' end" $upstream_addr output=$first;
+        server unix:/run/postgresql:5432;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        pq_pass pg;
+        pq_query "select pg_terminate_backend(pg_backend_pid()) where $1 = 'first'" $first;
+        pq_query "select '<!--# echo var=\"first\" default=\"unset\" -->' as ab" output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body chomp
+unset
+--- timeout: 60
+
+=== TEST 27:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        pq_pass pg;
+        pq_query "select strpos($1, ',') = 0 as first" $upstream_addr output=$try*;
+        pq_query "select pg_terminate_backend(pg_backend_pid()) where strpos($1, ',') = 0" $upstream_addr;
+        pq_query "select '<!--# echo var=\"try_first\" -->' as ab" output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body chomp
+f
+--- timeout: 60
+
+=== TEST 28:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_pool min=1 max=2;
+        pq_query "set application_name = 'prewarmed'";
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_option user=postgres;
+        pq_pass unix:/run/postgresql:5432;
+        pq_query "do 'begin for i in 1..100 loop perform pg_stat_clear_snapshot(); exit when exists (select from pg_stat_activity where application_name = ''prewarmed''); perform pg_sleep(0.1); end loop; end'";
+        pq_query "select (count(*) > 0)::text from pg_stat_activity where application_name = 'prewarmed'" output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body chomp
+t
+--- timeout: 60
+
+=== TEST 29:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_pool max=2;
+        server unix:/run/postgresql:5432;
+        keepalive 2;
+    }
+--- config
+    location =/ {
+        pq_pass pg;
+        pq_query "select 1";
+    }
+--- must_die
+--- error_log
+pq_pool is incompatible with keepalive
+--- timeout: 60
+
+=== TEST 30:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_multiplex 2;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        pq_pass pg;
+        pq_lsn on;
+        pq_query "select 1";
+    }
+--- must_die
+--- error_log
+pq_lsn is incompatible with pq_multiplex
+--- timeout: 60
+
+=== TEST 31:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        keepalive 2;
+        pq_health_check interval=1s;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        pq_pass pg;
+        pq_query "select 1";
+    }
+--- must_die
+--- error_log
+pq_health_check requires round-robin balancing
+--- timeout: 60
+
+=== TEST 32:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_circuit_breaker errors=0;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        pq_pass pg;
+        pq_query "select 1";
+    }
+--- must_die
+--- error_log
+ngx_atoi == NGX_ERROR
+--- timeout: 60
+
+=== TEST 33:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_query "select 1" output=$one;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        pq_cache zone=cache:1m;
+        pq_pass pg;
+        pq_query "select 1";
+    }
+--- must_die
+--- error_log
+output variables are incompatible with pq_cache
+--- timeout: 60
+
+=== TEST 34:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        keepalive 2;
+        pq_option user=postgres;
+        pq_pool max=2;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        pq_pass pg;
+        pq_query "select 1";
+    }
+--- must_die
+--- error_log
+pq_pool requires round-robin balancing
+--- timeout: 60
+
+=== TEST 35:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_pool max=1 queue=1 timeout=200ms;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 '<!--# include virtual="/sleep" --> <!--# include virtual="/sleep" --> <!--# include virtual="/sleep" -->';
+    }
+    location =/sleep {
+        default_type text/plain;
+        error_page 503 = @busy;
+        error_page 504 = @timeout;
+        pq_pass pg;
+        pq_query "select 'ok' from pg_sleep(1)" output=value;
+    }
+    location @busy {
+        return 200 busy;
+    }
+    location @timeout {
+        return 200 timeout;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body chomp
+ok timeout busy
+--- error_log
+pq_pool queue is full
+pq_pool queue timed out
+--- timeout: 60
+
+=== TEST 36:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        pq_option user=postgres;
+        pq_pool max=1 queue=2 timeout=5s;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 '<!--# include virtual="/sleep?a=1" --> <!--# include virtual="/sleep?a=2" --> <!--# include virtual="/sleep?a=3" -->';
+    }
+    location =/sleep {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select $1 from pg_sleep(0.2)" $arg_a output=value;
+    }
+--- request
+GET /
+--- error_code: 200
+--- response_body chomp
+1 2 3
+--- timeout: 60
@@ -912,3 +912,113 @@ user: postgres
 --- response_body eval
 "ab,cde\x{0a}34,qwe\x{0a}89,\x{0a}"
 --- timeout: 60
+
+=== TEST 17:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        keepalive 1;
+        pq_option user=postgres statements=1;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        add_header transaction-status $pq_transaction_status always;
+        default_type text/plain;
+        set $pg pg;
+        pq_pass $pg;
+        pq_query "select $1::int as ab, $2 as cde" $arg_a $arg_b output=plain cache=on;
+        pq_query "select $1::int as ab" $arg_c output=plain cache=on;
+    }
+--- request
+GET /?a=34&b=qwe&c=89
+--- error_code: 200
+--- response_headers
+Content-Type: text/plain
+transaction-status: IDLE
+--- response_body eval
+"ab\x{09}cde\x{0a}34\x{09}qwe\x{0a}ab\x{0a}89"
+--- timeout: 60
+
+=== TEST 18:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        keepalive 1;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select $1::int * 100 + count(*)::int as ab from pg_prepared_statements" $arg_a output=value cache=on;
+    }
+--- pipelined_requests eval
+["GET /?a=3", "GET /?a=4"]
+--- error_code eval
+[200, 200]
+--- response_body eval
+["301", "401"]
+--- timeout: 60
+
+=== TEST 19:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        keepalive 1;
+        pq_option user=postgres;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/ {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select pg_typeof($1)::text as ab" $arg_a::$arg_oid output=value cache=on;
+    }
+--- pipelined_requests eval
+["GET /?a=1&oid=23", "GET /?a=1&oid=25", "GET /?a=1&oid=23"]
+--- error_code eval
+[200, 200, 200]
+--- response_body eval
+["integer", "text", "integer"]
+--- timeout: 60
+
+=== TEST 20:
+--- main_config
+    load_module /etc/nginx/modules/ngx_pq_module.so;
+--- http_config
+    upstream pg {
+        keepalive 1;
+        pq_option user=postgres;
+        pq_query "select 'a'" output=$small;
+        pq_query "select repeat('y', 300)" output=$middle;
+        pq_query "select repeat('x', i) from generate_series(1, 100) i" output=$large chunkSize=10;
+        server unix:/run/postgresql:5432;
+    }
+--- config
+    location =/small {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select $1" $small output=value;
+    }
+    location =/middle {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select length($1)::text" $middle output=value;
+    }
+    location =/large {
+        default_type text/plain;
+        pq_pass pg;
+        pq_query "select length($1)::text" $large output=value;
+    }
+--- pipelined_requests eval
+["GET /large", "GET /small", "GET /middle", "GET /large", "GET /small"]
+--- error_code eval
+[200, 200, 200, 200, 200]
+--- response_body eval
+["5149", "a", "300", "5149", "a"]
+--- timeout: 60